@@ -0,0 +1,288 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#include "allocator.h"
+#include "core.h"
+#include "aux.h"
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#define ALIGNMENT 16
+
+static size_t align_up(size_t size)
+{
+	return (size + ALIGNMENT-1) & ~(size_t)(ALIGNMENT-1);
+}
+
+/* Hooks */
+
+static void* default_malloc(size_t size, void* user)
+{
+	return malloc(size);
+}
+
+static void* default_realloc(void* ptr, size_t size, void* user)
+{
+	return realloc(ptr, size);
+}
+
+static void default_free(void* ptr, void* user)
+{
+	free(ptr);
+}
+
+static const CT_Allocator default_allocator = {
+	default_malloc, default_realloc, default_free, NULL };
+
+static CT_Allocator allocator = {
+	default_malloc, default_realloc, default_free, NULL };
+
+void* allocator_malloc(size_t size)
+{
+	return allocator.malloc(size, allocator.user);
+}
+
+void* allocator_realloc(void* ptr, size_t size)
+{
+	return allocator.realloc(ptr, size, allocator.user);
+}
+
+void allocator_free(void* ptr)
+{
+	allocator.free(ptr, allocator.user);
+}
+
+/* SDL's hooks carry no user pointer. */
+static void* sdl_malloc(size_t size)
+{
+	return allocator_malloc(size ? size : 1);
+}
+
+static void* sdl_calloc(size_t count, size_t size)
+{
+	size_t bytes = count * size;
+	if (size && bytes / size != count) return NULL;
+	void* ptr = allocator_malloc(bytes ? bytes : 1);
+	if (ptr) memset(ptr, 0, bytes);
+	return ptr;
+}
+
+static void* sdl_realloc(void* ptr, size_t size)
+{
+	if (!ptr) return sdl_malloc(size);
+	return allocator_realloc(ptr, size ? size : 1);
+}
+
+static void sdl_free(void* ptr)
+{
+	if (ptr) allocator_free(ptr);
+}
+
+int ct_allocator_set(const CT_Allocator* hooks, unsigned flags)
+{
+	unsigned i;
+	for (i=0; i<CT_MEMORY_TAG_COUNT; i++)
+	{
+		if (ct_memory_allocations(i) == 0) continue;
+		ct_set_error("Set the allocator before allocating anything.");
+		return 1;
+	}
+	if (pools_in_use())
+	{
+		ct_set_error("Set the allocator before allocating anything.");
+		return 1;
+	}
+	allocator = hooks ? *hooks : default_allocator;
+	if ((flags & CT_ALLOCATOR_SDL) &&
+	    SDL_SetMemoryFunctions(sdl_malloc, sdl_calloc,
+				   sdl_realloc, sdl_free) != 0)
+	{
+		return 1; /* SDL sets the error. */
+	}
+	return 0;
+}
+
+const CT_Allocator* ct_allocator()
+{
+	return &allocator;
+}
+
+/* Pools */
+
+typedef struct _PoolPage
+{
+	struct _PoolPage* next;
+} PoolPage;
+
+static Pool* pools; /* Every pool that ever allocated, to check for use */
+
+static void pool_grow(Pool* pool)
+{
+	size_t size = align_up(pool->size);
+	size_t header = align_up(sizeof(PoolPage));
+	PoolPage* page = allocator_malloc(header + size * POOL_PAGE_OBJECTS);
+	if (!page)
+	{
+		fprintf(stderr, "Out of memory!");
+		exit(-1);
+	}
+	if (!pool->pages)
+	{
+		pool->next_pool = pools;
+		pools = pool;
+	}
+	page->next = pool->pages;
+	pool->pages = page;
+	/* Thread the new objects onto the free list */
+	unsigned char* object = (unsigned char*)page + header;
+	unsigned i;
+	for (i=0; i<POOL_PAGE_OBJECTS; i++, object += size)
+	{
+		*(void**)object = pool->free_list;
+		pool->free_list = object;
+	}
+}
+
+void* pool_alloc(Pool* pool)
+{
+	if (!pool->free_list) pool_grow(pool);
+	void* object = pool->free_list;
+	pool->free_list = *(void**)object;
+	pool->live++;
+	memory_account(pool->tag, pool->size, 1);
+	return object;
+}
+
+void pool_free(Pool* pool, void* object)
+{
+	if (!object) return;
+	*(void**)object = pool->free_list;
+	pool->free_list = object;
+	pool->live--;
+	memory_account(pool->tag, -(long long)pool->size, -1);
+}
+
+int pools_in_use()
+{
+	Pool* pool;
+	for (pool=pools; pool; pool=pool->next_pool)
+	{
+		if (pool->pages) return 1;
+	}
+	return 0;
+}
+
+/* Arena */
+
+typedef struct _ArenaBlock
+{
+	struct _ArenaBlock* next;
+	size_t size;
+	size_t used;
+} ArenaBlock;
+
+struct _CT_Arena
+{
+	ArenaBlock* block; /* Current one, older ones follow */
+	size_t block_size;
+	size_t used;
+	size_t high_water;
+};
+
+static ArenaBlock* arena_block(size_t size, ArenaBlock* next)
+{
+	ArenaBlock* block = smalloc(align_up(sizeof(ArenaBlock)) + size);
+	block->next = next;
+	block->size = size;
+	block->used = 0;
+	return block;
+}
+
+CT_Arena* ct_arena_create(size_t block_size)
+{
+	CT_Arena* arena = smalloc(sizeof(CT_Arena));
+	arena->block_size = align_up(block_size ? block_size : 4096);
+	arena->block = arena_block(arena->block_size, NULL);
+	arena->used = 0;
+	arena->high_water = 0;
+	return arena;
+}
+
+static void arena_blocks_free(ArenaBlock* block)
+{
+	while (block)
+	{
+		ArenaBlock* next = block->next;
+		sfree(block);
+		block = next;
+	}
+}
+
+void ct_arena_free(CT_Arena* arena)
+{
+	arena_blocks_free(arena->block);
+	sfree(arena);
+}
+
+void* ct_arena_alloc(CT_Arena* arena, size_t size)
+{
+	size = align_up(size ? size : 1);
+	ArenaBlock* block = arena->block;
+	if (block->used + size > block->size)
+	{
+		size_t block_size = arena->block_size;
+		while (block_size < size) block_size *= 2;
+		block = arena->block = arena_block(block_size, block);
+	}
+	void* ptr = (unsigned char*)block + align_up(sizeof(ArenaBlock)) + block->used;
+	block->used += size;
+	arena->used += size;
+	if (arena->used > arena->high_water) arena->high_water = arena->used;
+	return ptr;
+}
+
+void ct_arena_reset(CT_Arena* arena)
+{
+	if (arena->block->next)
+	{
+		/* Outgrew the block, start over with one big enough */
+		arena_blocks_free(arena->block);
+		while (arena->block_size < arena->high_water) arena->block_size *= 2;
+		arena->block = arena_block(arena->block_size, NULL);
+	}
+	arena->block->used = 0;
+	arena->used = 0;
+}
+
+size_t ct_arena_used(CT_Arena* arena)
+{
+	return arena->used;
+}
+
+size_t ct_arena_high_water(CT_Arena* arena)
+{
+	return arena->high_water;
+}
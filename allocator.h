@@ -0,0 +1,78 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#ifndef __allocator_h__
+#define __allocator_h__
+
+#include <stddef.h>
+
+/*
+   Allocator
+   Every allocation the engine makes goes through these hooks, so a host
+   runtime can hand out memory from its own heap. Set them before
+   anything is allocated, ideally before ct_window_init; NULL goes back
+   to malloc. With CT_ALLOCATOR_SDL SDL allocates through them as well,
+   which only works before SDL_Init.
+*/
+typedef struct _CT_Allocator
+{
+	void* (*malloc)(size_t size, void* user);
+	void* (*realloc)(void* ptr, size_t size, void* user);
+	void (*free)(void* ptr, void* user);
+	void* user;
+} CT_Allocator;
+
+#define CT_ALLOCATOR_SDL 1
+
+/* Returns 1 if the engine already holds memory from the old hooks. */
+extern int ct_allocator_set(const CT_Allocator* allocator, unsigned flags);
+
+extern const CT_Allocator* ct_allocator();
+
+/*
+   Arena
+   Hands out memory by bumping a pointer, everything is released at once
+   by ct_arena_reset. When a block fills up another is chained on, and
+   the next reset replaces them with one block that fits the high water
+   mark, so a steady workload settles into a single block.
+*/
+typedef struct _CT_Arena CT_Arena;
+
+extern CT_Arena* ct_arena_create(size_t block_size);
+
+extern void ct_arena_free(CT_Arena* arena);
+
+/* Never fails, the memory is aligned for any type. */
+extern void* ct_arena_alloc(CT_Arena* arena, size_t size);
+
+extern void ct_arena_reset(CT_Arena* arena);
+
+/* Bytes handed out since the last reset. */
+extern size_t ct_arena_used(CT_Arena* arena);
+
+/* Most bytes handed out between two resets. */
+extern size_t ct_arena_high_water(CT_Arena* arena);
+
+#endif /* __allocator_h__ */
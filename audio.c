@@ -24,14 +24,12 @@ OTHER DEALINGS IN THE SOFTWARE.
 **/
 
 #include "audio.h"
+#include "pack.h"
+#include "core.h"
+#include "aux.h"
 #include <SDL2/SDL_mixer.h>
 #include <math.h>
 
-/* No need to bring in the whole of core.h */
-extern const char* ct_get_error();
-extern void ct_set_error(const char* str);
-extern void* smalloc(size_t size);
-
 #define CAP(v,min,max) ((v)>(max))?(max):((v)<(min))?(min):(v)
 
 static int is_sound_inited = 0;
@@ -62,6 +60,17 @@ static int init_sound()
 	return 0;
 }
 
+static Pool sample_pool = POOL(CT_Sample, CT_MEMORY_AUDIO);
+
+/* The decoded samples are counted as well, SDL_mixer holds them. */
+static CT_Sample* sample_alloc(Mix_Chunk* chunk)
+{
+	CT_Sample* sample = pool_alloc(&sample_pool);
+	sample->mix_chunk = chunk;
+	if (chunk) memory_account(CT_MEMORY_AUDIO, chunk->alen, 1);
+	return sample;
+}
+
 CT_Sample* ct_sample_load(const char* filename)
 {
 	if (init_sound()) return NULL;
@@ -73,15 +82,32 @@ CT_Sample* ct_sample_load(const char* filename)
 			filename, Mix_GetError());
 		ct_set_error(str);
 	}
-	CT_Sample* sample = smalloc(sizeof(CT_Sample));
-	sample->mix_chunk = chunk;
-	return sample;
+	return sample_alloc(chunk);
+}
+
+CT_Sample* ct_sample_load_packed(CT_Pack* pack, const char* name)
+{
+	if (init_sound()) return NULL;
+	SDL_RWops* rw = ct_pack_rw(pack, name);
+	if (!rw) return NULL; /* ct_pack_rw already sets the error. */
+	Mix_Chunk* chunk = Mix_LoadWAV_RW(rw, 1);
+	if (!chunk)
+	{
+		char str[1024];
+		sprintf(str, "Could not load packed audio: %s, %s",
+			name, Mix_GetError());
+		ct_set_error(str);
+		return NULL;
+	}
+	return sample_alloc(chunk);
 }
 
 void ct_sample_free(CT_Sample* sample)
 {
-	Mix_FreeChunk(sample->mix_chunk);
-	free(sample);
+	Mix_Chunk* chunk = sample->mix_chunk;
+	if (chunk) memory_account(CT_MEMORY_AUDIO, -(long long)chunk->alen, -1);
+	Mix_FreeChunk(chunk);
+	pool_free(&sample_pool, sample);
 }
 
 /* Sample radius */
@@ -128,3 +154,75 @@ CT_Channel ct_sample_play(CT_Sample* sample, float* position, int loop)
 	Mix_SetPanning(channel, left, right);
 	return channel;
 }
+
+/* Track */
+
+static CT_Track* playing_track = NULL;
+
+static CT_Track* track_alloc(Mix_Music* music)
+{
+	CT_Track* track = smalloc_tag(sizeof(CT_Track), CT_MEMORY_AUDIO);
+	track->mix_music = music;
+	return track;
+}
+
+CT_Track* ct_track_load(const char* filename)
+{
+	if (init_sound()) return NULL;
+	Mix_Music* music = Mix_LoadMUS(filename);
+	if (!music)
+	{
+		char str[1024];
+		sprintf(str, "Could not load music file: %s, %s",
+			filename, Mix_GetError());
+		ct_set_error(str);
+		return NULL;
+	}
+	return track_alloc(music);
+}
+
+CT_Track* ct_track_load_packed(CT_Pack* pack, const char* name)
+{
+	if (init_sound()) return NULL;
+	SDL_RWops* rw = ct_pack_rw(pack, name);
+	if (!rw) return NULL; /* ct_pack_rw already sets the error. */
+	/* Music is streamed from the mapped pack while playing. */
+	Mix_Music* music = Mix_LoadMUS_RW(rw, 1);
+	if (!music)
+	{
+		char str[1024];
+		sprintf(str, "Could not load packed music: %s, %s",
+			name, Mix_GetError());
+		ct_set_error(str);
+		return NULL;
+	}
+	return track_alloc(music);
+}
+
+void ct_track_free(CT_Track* track)
+{
+	if (playing_track == track) playing_track = NULL;
+	Mix_FreeMusic(track->mix_music);
+	sfree(track);
+}
+
+void ct_track_play(CT_Track* track, int fadein_ms)
+{
+	if (Mix_FadeInMusic(track->mix_music, -1, fadein_ms) == 0)
+	{
+		playing_track = track;
+	}
+}
+
+void ct_track_stop(CT_Track* track, int fadeout_ms)
+{
+	if (ct_is_track_playing(track))
+	{
+		Mix_FadeOutMusic(fadeout_ms);
+	}
+}
+
+int ct_is_track_playing(CT_Track* track)
+{
+	return playing_track == track && Mix_PlayingMusic();
+}
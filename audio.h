@@ -28,6 +28,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 typedef struct Mix_Chunk Mix_Chunk;
 typedef struct _Mix_Music Mix_Music;
+typedef struct _CT_Pack CT_Pack;
 
 typedef struct _CT_Sample
 {
@@ -45,6 +46,8 @@ typedef struct _CT_Track
 
 extern CT_Sample* ct_sample_load(const char* filename);
 
+extern CT_Sample* ct_sample_load_packed(CT_Pack* pack, const char* name);
+
 extern void ct_sample_free(CT_Sample* sample);
 
 /* 
@@ -72,6 +75,8 @@ extern void ct_channel_stop(CT_Channel channel, int fadeout_ms);
 
 extern CT_Track* ct_track_load(const char* filename);
 
+extern CT_Track* ct_track_load_packed(CT_Pack* pack, const char* name);
+
 extern void ct_track_free(CT_Track* track);
 
 extern void ct_track_play(CT_Track* track, int fadein_ms);
@@ -23,8 +23,16 @@ FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
 OTHER DEALINGS IN THE SOFTWARE.
 **/
 
+#include "core.h"
+#include "aux.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
 
 void swap_float(float* a, float* b)
 {
@@ -41,6 +49,8 @@ int zeroish(float v)
 #ifdef DEBUG
 void check_gl_error(const char* func)
 {
+	/* There is no context to ask */
+	if (ct_window_backend() == CT_BACKEND_SOFTWARE) return;
 	GLuint err = glGetError();
 	if (err != GL_NO_ERROR)
 	{
@@ -50,24 +60,198 @@ void check_gl_error(const char* func)
 }
 #endif
 
+/* Memory accounting
+   Every block starts with a header holding its size and tag, so sfree
+   knows what to take off. The union keeps the data maximally aligned. */
+
+typedef union
+{
+	struct
+	{
+		size_t size;
+		unsigned tag;
+	} info;
+	long double align_float;
+	void* align_pointer;
+	long long align_integer;
+} AllocHeader;
+
+static struct
+{
+	size_t bytes[CT_MEMORY_TAG_COUNT];
+	size_t peak[CT_MEMORY_TAG_COUNT];
+	unsigned count[CT_MEMORY_TAG_COUNT];
+	size_t total;
+	size_t total_peak;
+	SDL_SpinLock lock;
+} memory;
+
+static const char* memory_tag_names[] = {
+	"general", "batch", "indices", "font", "image", "audio",
+	"texture", "shader"
+};
+
+void memory_account(unsigned tag, long long bytes, int count)
+{
+	SDL_AtomicLock(&memory.lock);
+	memory.bytes[tag] += bytes;
+	memory.count[tag] += count;
+	memory.total += bytes;
+	if (memory.bytes[tag] > memory.peak[tag])
+		memory.peak[tag] = memory.bytes[tag];
+	if (memory.total > memory.total_peak)
+		memory.total_peak = memory.total;
+	SDL_AtomicUnlock(&memory.lock);
+}
+
+static void out_of_memory()
+{
+	fprintf(stderr, "Out of memory!");
+	exit(-1);
+}
+
+void* smalloc_tag(size_t size, unsigned tag)
+{
+	AllocHeader* header = allocator_malloc(sizeof(AllocHeader) + size);
+	if (!header) out_of_memory();
+	header->info.size = size;
+	header->info.tag  = tag;
+	memory_account(tag, size, 1);
+	return header + 1;
+}
+
 void* smalloc(size_t size)
 {
-	void* ptr = malloc(size);
-	if (!ptr)
+	return smalloc_tag(size, CT_MEMORY_GENERAL);
+}
+
+void* srealloc(void* old, size_t size)
+{
+	if (!old) return smalloc(size);
+	AllocHeader* header = (AllocHeader*)old - 1;
+	size_t old_size = header->info.size;
+	header = allocator_realloc(header, sizeof(AllocHeader) + size);
+	if (!header) out_of_memory();
+	header->info.size = size;
+	memory_account(header->info.tag, (long long)size - (long long)old_size, 0);
+	return header + 1;
+}
+
+void sfree(void* ptr)
+{
+	if (!ptr) return;
+	AllocHeader* header = (AllocHeader*)ptr - 1;
+	memory_account(header->info.tag, -(long long)header->info.size, -1);
+	allocator_free(header);
+}
+
+size_t ct_memory_usage(CT_MemoryTag tag)
+{
+	return memory.bytes[tag];
+}
+
+size_t ct_memory_peak(CT_MemoryTag tag)
+{
+	return memory.peak[tag];
+}
+
+unsigned ct_memory_allocations(CT_MemoryTag tag)
+{
+	return memory.count[tag];
+}
+
+size_t ct_memory_total()
+{
+	return memory.total;
+}
+
+size_t ct_memory_total_peak()
+{
+	return memory.total_peak;
+}
+
+const char* ct_memory_tag_name(CT_MemoryTag tag)
+{
+	return memory_tag_names[tag];
+}
+
+void ct_memory_report(FILE* file)
+{
+	unsigned i;
+	fprintf(file, "%-8s %12s %12s %8s\n", "tag", "bytes", "peak", "count");
+	for (i=0; i<CT_MEMORY_TAG_COUNT; i++)
 	{
-		fprintf(stderr, "Out of memory!");
-		exit(-1);
+		fprintf(file, "%-8s %12zu %12zu %8u\n", memory_tag_names[i],
+			memory.bytes[i], memory.peak[i], memory.count[i]);
 	}
-	return ptr;
+	fprintf(file, "%-8s %12zu %12zu\n", "total",
+		memory.total, memory.total_peak);
 }
 
-void* srealloc(void* old, size_t size)
+int memory_report_leaks()
 {
-	void* ptr = realloc(old, size);
-	if (!ptr)
+	int leaked = 0;
+	unsigned i;
+	for (i=0; i<CT_MEMORY_TAG_COUNT; i++)
 	{
-		fprintf(stderr, "Out of memory!");
-		exit(-1);
+		if (!memory.count[i]) continue;
+		fprintf(stderr, "light_engine: %u %s allocation(s) (%zu bytes) "
+			"still live\n", memory.count[i], memory_tag_names[i],
+			memory.bytes[i]);
+		leaked = 1;
+	}
+	return leaked;
+}
+
+unsigned long long fnv1a(const void* data, size_t size,
+			 unsigned long long hash)
+{
+	const unsigned char* bytes = data;
+	size_t i;
+	for (i=0; i<size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+const void* map_file(const char* filename, size_t* size)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* The mapping keeps the file alive. */
+	close(fd);
+	if (data == MAP_FAILED) return NULL;
+	*size = st.st_size;
+	return data;
+}
+
+void unmap_file(const void* data, size_t size)
+{
+	munmap((void*)data, size);
+}
+
+int write_file(const char* filename, const void* data, size_t size)
+{
+	/* Write to a temporary file first so a crash never
+	   leaves a truncated file behind. */
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+	FILE* file = fopen(tmp, "wb");
+	int failed = !file || fwrite(data, 1, size, file) != size;
+	if (file) failed |= fclose(file) != 0;
+	if (failed || rename(tmp, filename) != 0)
+	{
+		remove(tmp);
+		return 1;
 	}
-	return ptr;
+	return 0;
 }
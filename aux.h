@@ -40,8 +40,67 @@ extern int zeroish(float v);
 extern void check_gl_error(const char* func);
 #endif /* DEBUG */
 
+/* Engine allocations, counted per CT_MemoryTag. Only sfree may release
+   them, and srealloc keeps the tag of `old` (general if NULL). */
 extern void* smalloc(size_t size);
 
+extern void* smalloc_tag(size_t size, unsigned tag);
+
 extern void* srealloc(void* old, size_t size);
 
+extern void sfree(void* ptr);
+
+/* The hooks set by ct_allocator_set, without accounting. */
+extern void* allocator_malloc(size_t size);
+
+extern void* allocator_realloc(void* ptr, size_t size);
+
+extern void allocator_free(void* ptr);
+
+/* Fixed-size pool for small handle structs, counted under `tag`. Pages
+   are kept once allocated, freed objects go on a free list.
+
+     static Pool texture_pool = POOL(CT_Texture, CT_MEMORY_TEXTURE); */
+#define POOL_PAGE_OBJECTS 64
+
+typedef struct _Pool
+{
+	size_t size;
+	unsigned tag;
+	void* free_list;
+	void* pages;
+	unsigned live;
+	struct _Pool* next_pool;
+} Pool;
+
+#define POOL(type, tag) { sizeof(type), tag, NULL, NULL, 0, NULL }
+
+extern void* pool_alloc(Pool* pool);
+
+extern void pool_free(Pool* pool, void* object);
+
+/* Returns 1 if any pool holds pages. */
+extern int pools_in_use();
+
+/* Counts memory a library holds on our behalf, e.g. decoded surfaces. */
+extern void memory_account(unsigned tag, long long bytes, int count);
+
+/* Prints what is still allocated, returns 1 if anything is. */
+extern int memory_report_leaks();
+
+/* 64 bit FNV-1a, pass the previous result as `hash` to continue
+   hashing, or FNV1A_SEED to start. */
+#define FNV1A_SEED 0xcbf29ce484222325ULL
+
+extern unsigned long long fnv1a(const void* data, size_t size,
+				unsigned long long hash);
+
+/* Maps a whole file read-only, returns NULL on failure or when empty. */
+extern const void* map_file(const char* filename, size_t* size);
+
+extern void unmap_file(const void* data, size_t size);
+
+/* Replaces `filename` in one go, returns 1 on failure. */
+extern int write_file(const char* filename, const void* data, size_t size);
+
 #endif /* __aux_h__ */
@@ -0,0 +1,491 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+/* Micro-benchmarks
+   Every benchmark runs its operation `ops` times per sample. Samples are
+   repeated and the median is reported, one tab separated line each:
+
+     name  ops  median_ns_per_op  min_ns_per_op  max_ns_per_op
+
+   Lines starting with '#' describe the machine. The inputs come from a
+   fixed seed so runs can be compared with each other.
+
+   Usage: bench [--cpu] [name-prefix]
+   --cpu skips everything that needs a GL context. */
+
+#include "core.h"
+#include "input.h"
+#include "dynvector.h"
+#include "hypermath/hypermath.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/glew.h>
+#include <SDL2/SDL.h>
+
+#define BENCH_SAMPLES 7
+#define BENCH_MAX_QUADS 16000 /* Indices are unsigned short */
+
+typedef struct
+{
+	const char* name;
+	unsigned ops;
+	int needs_gl;
+	void (*prepare)(unsigned ops); /* Untimed, may be NULL */
+	void (*run)(unsigned ops);
+	void (*finish)();              /* Untimed, may be NULL */
+} Bench;
+
+/* Results go here so the compiler can't drop the work. */
+static volatile float sink;
+
+static unsigned seed;
+
+static float random_float()
+{
+	seed = seed * 1664525 + 1013904223;
+	return (float)(seed >> 8) / (float)(1 << 24);
+}
+
+static void random_transformation(CT_Transformation* trans, int rotated)
+{
+	float x = random_float() * 0.9f;
+	float y = random_float() * 0.9f;
+	CT_Transformation t = {
+		{ 0, 1, 0, 1 },
+		{ x, x + 0.05f, y, y + 0.05f },
+		{ 0.025f, 0.025f },
+		rotated ? random_float() * 360.0f : 0,
+		-1, -1 };
+	*trans = t;
+}
+
+/* Dynamic vector */
+
+static DV_Vector* vector;
+static unsigned* vector_ids;
+static float chunk[16];
+static unsigned grown_by;
+
+static void vector_prepare(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<16; i++) chunk[i] = random_float();
+	vector = dv_vector_new(16, 16);
+	vector_ids = malloc(sizeof(unsigned)*ops);
+	for (i=0; i<ops; i++) vector_ids[i] = dv_vector_push(vector, chunk, &grown_by);
+	/* Shuffle so removal order is not the push order */
+	for (i=ops-1; i>0; i--)
+	{
+		unsigned j = (unsigned)(random_float() * (i+1));
+		unsigned tmp = vector_ids[i];
+		vector_ids[i] = vector_ids[j];
+		vector_ids[j] = tmp;
+	}
+}
+
+static void vector_finish()
+{
+	dv_vector_free(vector);
+	free(vector_ids);
+}
+
+static void vector_push_prepare(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<16; i++) chunk[i] = random_float();
+	vector = dv_vector_new(16, 16);
+}
+
+static void vector_push_finish()
+{
+	dv_vector_free(vector);
+}
+
+static void vector_push_run(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<ops; i++) dv_vector_push(vector, chunk, &grown_by);
+}
+
+static void vector_remove_run(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<ops; i++) dv_vector_remove(vector, vector_ids[i]);
+}
+
+static void vector_change_run(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		chunk[0] = (float)i;
+		dv_vector_change(vector, vector_ids[i], chunk);
+	}
+}
+
+/* Batch, which is where vertex_data runs */
+
+static CT_Batch* batch;
+static CT_Transformation* transformations;
+static unsigned* batch_ids;
+
+static void batch_prepare_with(unsigned ops, int rotated, int push)
+{
+	unsigned i;
+	batch = ct_batch_create(ops);
+	transformations = malloc(sizeof(CT_Transformation)*ops);
+	batch_ids = malloc(sizeof(unsigned)*ops);
+	for (i=0; i<ops; i++)
+	{
+		random_transformation(transformations + i, rotated);
+		if (push) batch_ids[i] = ct_batch_push(batch, transformations + i);
+	}
+}
+
+static void batch_prepare(unsigned ops)
+{
+	batch_prepare_with(ops, 0, 0);
+}
+
+static void batch_prepare_rotated(unsigned ops)
+{
+	batch_prepare_with(ops, 1, 0);
+}
+
+static void batch_prepare_filled(unsigned ops)
+{
+	batch_prepare_with(ops, 1, 1);
+}
+
+static void batch_finish()
+{
+	ct_batch_free(batch);
+	free(transformations);
+	free(batch_ids);
+}
+
+static void batch_push_run(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<ops; i++) ct_batch_push(batch, transformations + i);
+}
+
+static void batch_change_run(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		ct_batch_change(batch, batch_ids[i], transformations + (ops-1-i));
+	}
+}
+
+/* Translation stack, one op is three pushes and three pops */
+
+static void translation_run(unsigned ops)
+{
+	float position[2] = { 0.1f, 0.2f };
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		ct_translation_push(position, 1.01f, 3.0f);
+		ct_translation_push(position, 0.99f, -3.0f);
+		ct_translation_push(position, 1.0f, 45.0f);
+		ct_translation_pop();
+		ct_translation_pop();
+		ct_translation_pop();
+	}
+}
+
+/* Hypermath */
+
+#define HPM_VECTORS 1024
+
+static float matrix_a[16], matrix_b[16];
+static float rotation[16]; /* Keeps repeatedly transformed vectors finite */
+static float vectors[HPM_VECTORS*4];
+
+static void hpm_prepare(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<16; i++)
+	{
+		matrix_a[i] = random_float();
+		matrix_b[i] = random_float();
+	}
+	for (i=0; i<HPM_VECTORS*4; i++) vectors[i] = random_float();
+	hpmZRotation(0.3f, rotation);
+}
+
+static void hpm_mult_run(unsigned ops)
+{
+	float result[16];
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		matrix_a[0] = (float)i;
+		hpmMultMat4(matrix_a, matrix_b, result);
+		sink = result[5];
+	}
+}
+
+static void hpm_inverse_run(unsigned ops)
+{
+	float result[16];
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		matrix_a[0] = (float)i;
+		hpmInverse(matrix_a, result);
+		sink = result[5];
+	}
+}
+
+/* One op is a whole array of HPM_VECTORS */
+static void hpm_vec_array_run(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		hpmMat4VecArrayMult(rotation, vectors, HPM_VECTORS, 4);
+		sink = vectors[1];
+	}
+}
+
+static void hpm_vec2_array_run(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		hpmMat4Vec2ArrayMult(rotation, vectors, HPM_VECTORS*2);
+		sink = vectors[1];
+	}
+}
+
+/* Input, one op queues a few key events and polls them */
+
+static void input_run(unsigned ops)
+{
+	static const int keys[] = { CT_KEY_A, CT_KEY_D, CT_KEY_SPACE, CT_KEY_W };
+	unsigned i, k;
+	for (i=0; i<ops; i++)
+	{
+		for (k=0; k<4; k++)
+		{
+			SDL_Event event;
+			memset(&event, 0, sizeof(event));
+			event.type = (i & 1) ? SDL_KEYUP : SDL_KEYDOWN;
+			event.key.keysym.sym = keys[k];
+			SDL_PushEvent(&event);
+		}
+		ct_poll_input();
+	}
+}
+
+/* GL, one op is a frame */
+
+static CT_Texture* texture;
+
+static void gl_prepare(unsigned ops)
+{
+	texture = ct_texture_create(64, 64);
+}
+
+static void gl_finish()
+{
+	ct_texture_free(texture);
+}
+
+static void gl_batch_prepare(unsigned ops)
+{
+	gl_prepare(ops);
+	batch_prepare_with(BENCH_MAX_QUADS, 1, 1);
+}
+
+static void gl_batch_finish()
+{
+	batch_finish();
+	gl_finish();
+}
+
+static void frame_end()
+{
+	ct_window_update();
+	glFinish();
+}
+
+static void gl_batch_run(unsigned ops)
+{
+	static float black[4] = { 0, 0, 0, 1 };
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		ct_window_clear(black);
+		ct_batch_render(batch, texture);
+		frame_end();
+	}
+}
+
+static void gl_texture_run(unsigned ops)
+{
+	static float black[4] = { 0, 0, 0, 1 };
+	CT_Transformation trans[64];
+	unsigned i, j;
+	for (j=0; j<64; j++) random_transformation(trans + j, 1);
+	for (i=0; i<ops; i++)
+	{
+		ct_window_clear(black);
+		for (j=0; j<1024; j++) ct_texture_render(texture, trans + (j & 63));
+		frame_end();
+	}
+}
+
+static void gl_translated_run(unsigned ops)
+{
+	static float black[4] = { 0, 0, 0, 1 };
+	float position[2] = { 0.01f, 0.01f };
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		ct_window_clear(black);
+		ct_translation_push(position, 1.0f, 1.0f);
+		ct_batch_render(batch, texture);
+		ct_translation_pop();
+		frame_end();
+	}
+}
+
+static void gl_upload_run(unsigned ops)
+{
+	unsigned i;
+	for (i=0; i<ops; i++)
+	{
+		CT_Texture* tex = ct_texture_create(256, 256);
+		ct_texture_free(tex);
+	}
+	glFinish();
+}
+
+static const Bench benches[] = {
+	{ "dv_vector_push",      100000, 0, vector_push_prepare, vector_push_run, vector_push_finish },
+	{ "dv_vector_remove",    100000, 0, vector_prepare, vector_remove_run, vector_finish },
+	{ "dv_vector_change",    100000, 0, vector_prepare, vector_change_run, vector_finish },
+	{ "batch_push",          BENCH_MAX_QUADS, 0, batch_prepare, batch_push_run, batch_finish },
+	{ "batch_push_rotated",  BENCH_MAX_QUADS, 0, batch_prepare_rotated, batch_push_run, batch_finish },
+	{ "batch_change",        BENCH_MAX_QUADS, 0, batch_prepare_filled, batch_change_run, batch_finish },
+	{ "translation_push_pop", 100000, 0, NULL, translation_run, NULL },
+	{ "hpm_mult_mat4",       1000000, 0, hpm_prepare, hpm_mult_run, NULL },
+	{ "hpm_inverse",         1000000, 0, hpm_prepare, hpm_inverse_run, NULL },
+	{ "hpm_mat4_vec_array",  1000, 0, hpm_prepare, hpm_vec_array_run, NULL },
+	{ "hpm_mat4_vec2_array", 1000, 0, hpm_prepare, hpm_vec2_array_run, NULL },
+	{ "poll_input",          10000, 0, NULL, input_run, NULL },
+	{ "gl_batch_render",     20, 1, gl_batch_prepare, gl_batch_run, gl_batch_finish },
+	{ "gl_batch_translated", 20, 1, gl_batch_prepare, gl_translated_run, gl_batch_finish },
+	{ "gl_texture_render",   20, 1, gl_prepare, gl_texture_run, gl_finish },
+	{ "gl_texture_create",   100, 1, NULL, gl_upload_run, NULL }
+};
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_run(const Bench* bench)
+{
+	double samples[BENCH_SAMPLES];
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	int i;
+	seed = 12345;
+	/* One untimed round to warm caches and the driver */
+	for (i=-1; i<BENCH_SAMPLES; i++)
+	{
+		if (bench->prepare) bench->prepare(bench->ops);
+		Uint64 start = SDL_GetPerformanceCounter();
+		bench->run(bench->ops);
+		Uint64 end = SDL_GetPerformanceCounter();
+		if (bench->finish) bench->finish();
+		if (i >= 0)
+			samples[i] = (end - start) * 1e9 / frequency / bench->ops;
+	}
+	qsort(samples, BENCH_SAMPLES, sizeof(double), compare_double);
+	printf("%s\t%u\t%.2f\t%.2f\t%.2f\n", bench->name, bench->ops,
+	       samples[BENCH_SAMPLES/2], samples[0], samples[BENCH_SAMPLES-1]);
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	int is_cpu_only = 0;
+	const char* prefix = "";
+	int i;
+	for (i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i], "--cpu") == 0) is_cpu_only = 1;
+		else prefix = argv[i];
+	}
+
+	int has_gl = 0;
+	if (!is_cpu_only)
+	{
+		has_gl = ct_window_init() == 0;
+		if (has_gl)
+		{
+			SDL_GL_SetSwapInterval(0);
+		} else
+		{
+			fprintf(stderr, "bench: no GL context (%s), running CPU "
+				"benchmarks only\n", ct_get_error());
+		}
+	}
+	if (!has_gl && SDL_Init(SDL_INIT_EVENTS) != 0)
+	{
+		fprintf(stderr, "bench: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	printf("# light_engine bench 1\n");
+	printf("# simd\t%s\n", hpmSimdLevel());
+	if (has_gl)
+	{
+		printf("# gl_renderer\t%s\n", glGetString(GL_RENDERER));
+		printf("# gl_version\t%s\n", glGetString(GL_VERSION));
+	}
+	printf("# name\tops\tmedian_ns\tmin_ns\tmax_ns\n");
+
+	for (i=0; i<(int)(sizeof(benches)/sizeof(Bench)); i++)
+	{
+		const Bench* bench = benches + i;
+		if (bench->needs_gl && !has_gl) continue;
+		if (strncmp(bench->name, prefix, strlen(prefix)) != 0) continue;
+		bench_run(bench);
+	}
+
+	if (has_gl)
+		ct_window_quit();
+	else
+		SDL_Quit();
+	return 0;
+}
@@ -27,8 +27,16 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "hypermath/hypermath.h"
 #include "dynvector.h"
 #include "aux.h"
+#include "pack.h"
+#include "texcache.h"
+#include "ktx.h"
+#include "profile.h"
+#include "allocator.h"
+#include "software.h"
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <ctype.h>
 #include <math.h>
 #include <GL/glew.h>
 #include <GL/glu.h>
@@ -36,31 +44,17 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 
-/* Utils */
-
-static void push_everything(CT_Texture* target, 
-		     float* colour, 
-		     float* pos, float scale, float rotation,
-		     CT_BlendMode blend_mode)
-{
-	ct_target_push(target);
-	ct_colour_push(colour);
-	ct_translation_push(pos, scale, rotation);
-	ct_blend_mode_push(blend_mode);
-}
-
-static void pop_everything()
-{
-	ct_target_pop();
-	ct_colour_pop();
-	ct_translation_pop();
-	ct_blend_mode_pop();
-}
-
 /* Constants */
 
 static float colour_white[4] = { 1, 1, 1, 1 };
 
+static float matrix_identity[16] = {
+	1, 0, 0, 0,
+	0, 1, 0, 0,
+	0, 0, 1, 0,
+	0, 0, 0, 1
+};
+
 /* Error */
 
 const char* ct_get_error()
@@ -73,18 +67,188 @@ void ct_set_error(const char* str)
 	SDL_SetError(str);
 }
 
+/* Backend */
+
+static struct
+{
+	CT_Backend type;
+	int is_open;
+} backend;
+
+/* The software backend has no GL context, nothing may call GL then. */
+static int is_software()
+{
+	return backend.type == CT_BACKEND_SOFTWARE;
+}
+
+int ct_window_backend_set(CT_Backend type)
+{
+	if (backend.is_open)
+	{
+		ct_set_error("The backend can't change while the window is open.");
+		return 1;
+	}
+	backend.type = type;
+	return 0;
+}
+
+CT_Backend ct_window_backend()
+{
+	return backend.type;
+}
+
+void ct_window_backend_threads_set(unsigned count)
+{
+	sw_threads_set(count);
+}
+
+/* Statistics */
+
+static struct
+{
+	CT_FrameStats frame;
+	CT_FrameStats last;
+} stats;
+
+const CT_FrameStats* ct_frame_stats()
+{
+	return &stats.last;
+}
+
+const CT_FrameStats* ct_frame_stats_current()
+{
+	return &stats.frame;
+}
+
+static void stats_frame_end()
+{
+	stats.last = stats.frame;
+	memset(&stats.frame, 0, sizeof(stats.frame));
+}
+
+/* Vertices come from client memory, so every draw sends them along with
+   the indices. */
+static void stats_draw(unsigned quads)
+{
+	stats.frame.draw_calls++;
+	stats.frame.quads += quads;
+	stats.frame.vertices += quads*4;
+	stats.frame.upload_bytes += quads*(4*4*sizeof(float) + 6*sizeof(GLushort));
+}
+
+static void bind_texture(GLuint texture)
+{
+	if (is_software()) return;
+	glBindTexture(GL_TEXTURE_2D, texture);
+	stats.frame.texture_binds++;
+}
+
+static void bind_framebuffer(GLenum target, GLuint buffer)
+{
+	if (is_software()) return;
+	glBindFramebuffer(target, buffer);
+	stats.frame.framebuffer_binds++;
+}
+
+/* Memory */
+
+static struct
+{
+	size_t bytes;
+	size_t peak;
+} vram;
+
+static void vram_account(long long bytes)
+{
+	vram.bytes += bytes;
+	if (vram.bytes > vram.peak) vram.peak = vram.bytes;
+}
+
+static void texture_vram_set(CT_Texture* tex, unsigned bytes)
+{
+	vram_account((long long)bytes - tex->vram);
+	tex->vram = bytes;
+}
+
+size_t ct_vram_usage()
+{
+	return vram.bytes;
+}
+
+size_t ct_vram_peak()
+{
+	return vram.peak;
+}
+
+/* Frame arena
+   Two arenas take turns, so what a frame allocates is still there while
+   the next one is compared against it. */
+
+#define FRAME_ARENA_BLOCK_SIZE (64*1024)
+
+static struct
+{
+	CT_Arena* arenas[2];
+	unsigned current;
+} frame_arena;
+
+void* ct_frame_alloc(size_t size)
+{
+	CT_Arena** arena = frame_arena.arenas + frame_arena.current;
+	if (!*arena) *arena = ct_arena_create(FRAME_ARENA_BLOCK_SIZE);
+	return ct_arena_alloc(*arena, size);
+}
+
+size_t ct_frame_arena_used()
+{
+	CT_Arena* arena = frame_arena.arenas[frame_arena.current];
+	return arena ? ct_arena_used(arena) : 0;
+}
+
+size_t ct_frame_arena_high_water()
+{
+	size_t high_water = 0;
+	unsigned i;
+	for (i=0; i<2; i++)
+	{
+		CT_Arena* arena = frame_arena.arenas[i];
+		if (arena && ct_arena_high_water(arena) > high_water)
+			high_water = ct_arena_high_water(arena);
+	}
+	return high_water;
+}
+
+static void frame_arena_end()
+{
+	frame_arena.current = !frame_arena.current;
+	CT_Arena* arena = frame_arena.arenas[frame_arena.current];
+	if (arena) ct_arena_reset(arena);
+}
+
+static void frame_arena_free()
+{
+	unsigned i;
+	for (i=0; i<2; i++)
+	{
+		if (frame_arena.arenas[i]) ct_arena_free(frame_arena.arenas[i]);
+		frame_arena.arenas[i] = NULL;
+	}
+}
 
-/* Default shader */
+
+/* Shader */
 
 static const char* vertex_shader_source = 
 	"#version 330\n"
 	"layout (location = 0) in vec2 vertex; "
 	"layout (location = 1) in vec2 coord; "
+	"layout (std140) uniform ct_state { "
+		"mat4 projection; "
+		"mat4 modelview; "
+		"vec4 colour; "
+	"}; "
 	"out vec4 f_colour; "
 	"out vec2 f_coord; "
-	"uniform mat4 modelview; "
-	"uniform mat4 projection; "
-	"uniform vec4 colour; "
 	"void main() { "
 		"gl_Position = projection * modelview * vec4(vertex, 0, 1); "
 		"f_coord = coord; "
@@ -101,12 +265,37 @@ static const char* fragment_shader_source =
 		"fragment = texture2D(texture, f_coord.st) * f_colour; "
  	"}";
 
-typedef struct
+/* What the shaders get from the engine. `block` is laid out as the std140
+   ct_state block and only sent to the buffer when it changed. */
+static struct
+{
+	struct
+	{
+		float projection[16];
+		float modelview[16];
+		float colour[4];
+	} block;
+	unsigned version;
+	int dirty;
+	GLuint gl_buffer_id;
+	GLuint gl_program_id;
+} state;
+
+static void state_set(float* dst, const float* src, unsigned count)
 {
-	unsigned gl_program_id;
-	unsigned gl_vertex_id;
-	unsigned gl_fragment_id;
-} CT_Shader;
+	if (memcmp(dst, src, sizeof(float)*count) == 0) return;
+	memcpy(dst, src, sizeof(float)*count);
+	state.version++;
+	state.dirty = 1;
+}
+
+static void use_program(GLuint program)
+{
+	if (is_software() || state.gl_program_id == program) return;
+	glUseProgram(program);
+	state.gl_program_id = program;
+	stats.frame.program_changes++;
+}
 
 static GLuint compile_shader(const char* source, GLuint type, int* success)
 {
@@ -129,11 +318,14 @@ static GLuint compile_shader(const char* source, GLuint type, int* success)
 	return shader;
 }
 
-static GLuint create_shader_program(GLuint vertex, GLuint fragment, int* success)
+static GLuint create_shader_program(GLuint vertex, GLuint fragment,
+				    int retrievable, int* success)
 {
 	GLuint prog = glCreateProgram();
 	glAttachShader(prog, vertex);
 	glAttachShader(prog, fragment);
+	if (retrievable)
+		glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(prog);
 	glGetProgramiv(prog, GL_LINK_STATUS, success);
 	if (*success == GL_FALSE)
@@ -143,15 +335,169 @@ static GLuint create_shader_program(GLuint vertex, GLuint fragment, int* success
 		*success = 0;
 		return 0;
 	}
-	glUseProgram(prog);
 	glActiveTexture(GL_TEXTURE0);
 	CHECK_GL();
 	return prog;
 }
 
+/* Shader cache */
+
+#define SHADER_CACHE_MAGIC "LESP"
+#define SHADER_CACHE_VERSION 1
+
+typedef struct
+{
+	char magic[4];
+	unsigned version;
+	unsigned format;
+	unsigned size;
+} ShaderCacheHeader;
+
+static struct
+{
+	char* directory;
+	unsigned long long driver_hash;
+} shader_cache;
+
+void ct_shader_cache_set(const char* directory)
+{
+	sfree(shader_cache.directory);
+	shader_cache.directory = NULL;
+	if (directory)
+	{
+		shader_cache.directory = smalloc(strlen(directory)+1);
+		strcpy(shader_cache.directory, directory);
+	}
+}
+
+/* Binaries only fit the driver that made them, so the driver strings
+   are part of the key. Returns 0 when there is no cache to use. */
+static int shader_cache_path(const char* vertex_source,
+			     const char* fragment_source,
+			     char* path, size_t path_size)
+{
+	if (!shader_cache.directory || !GLEW_ARB_get_program_binary) return 0;
+	if (!shader_cache.driver_hash)
+	{
+		GLenum names[] = { GL_VENDOR, GL_RENDERER, GL_VERSION };
+		unsigned long long hash = FNV1A_SEED;
+		unsigned i;
+		for (i=0; i<3; i++)
+		{
+			const char* str = (const char*)glGetString(names[i]);
+			if (str) hash = fnv1a(str, strlen(str), hash);
+		}
+		shader_cache.driver_hash = hash;
+	}
+	unsigned long long hash = shader_cache.driver_hash;
+	hash = fnv1a(vertex_source, strlen(vertex_source)+1, hash);
+	hash = fnv1a(fragment_source, strlen(fragment_source)+1, hash);
+	snprintf(path, path_size, "%s/%016llx.lesp", shader_cache.directory, hash);
+	return 1;
+}
+
+/* Returns 0 if there is no usable binary, e.g. after a driver update
+   the driver may still reject it. */
+static GLuint shader_cache_load(const char* path)
+{
+	size_t size;
+	const unsigned char* data = map_file(path, &size);
+	if (!data) return 0;
+	const ShaderCacheHeader* header = (const ShaderCacheHeader*)data;
+	GLuint prog = 0;
+	if (size >= sizeof(ShaderCacheHeader) &&
+	    memcmp(header->magic, SHADER_CACHE_MAGIC, 4) == 0 &&
+	    header->version == SHADER_CACHE_VERSION &&
+	    header->size == size - sizeof(ShaderCacheHeader))
+	{
+		GLint success;
+		prog = glCreateProgram();
+		glProgramBinary(prog, header->format,
+				data + sizeof(ShaderCacheHeader), header->size);
+		glGetProgramiv(prog, GL_LINK_STATUS, &success);
+		if (success == GL_FALSE)
+		{
+			glDeleteProgram(prog);
+			prog = 0;
+		}
+	}
+	unmap_file(data, size);
+	/* Drivers may report the rejection as an error too. */
+	while (!prog && glGetError() != GL_NO_ERROR);
+	return prog;
+}
+
+static void shader_cache_store(GLuint prog, const char* path)
+{
+	GLint length = 0;
+	glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+	size_t size = sizeof(ShaderCacheHeader) + length;
+	unsigned char* data = smalloc_tag(size, CT_MEMORY_SHADER);
+	ShaderCacheHeader* header = (ShaderCacheHeader*)data;
+	GLenum format;
+	glGetProgramBinary(prog, length, NULL, &format,
+			   data + sizeof(ShaderCacheHeader));
+	memcpy(header->magic, SHADER_CACHE_MAGIC, 4);
+	header->version = SHADER_CACHE_VERSION;
+	header->format  = format;
+	header->size    = length;
+	write_file(path, data, size);
+	sfree(data);
+	CHECK_GL();
+}
+
+/* Hooks the program up to the ct_state block, or finds the plain
+   uniforms older shaders use instead. */
+static void shader_resolve(CT_Shader* shader)
+{
+	GLuint prog = shader->gl_program_id;
+	GLuint block = glGetUniformBlockIndex(prog, "ct_state");
+	if (block != GL_INVALID_INDEX)
+		glUniformBlockBinding(prog, block, CT_STATE_BINDING);
+	shader->colour_location     = glGetUniformLocation(prog, "colour");
+	shader->modelview_location  = glGetUniformLocation(prog, "modelview");
+	shader->projection_location = glGetUniformLocation(prog, "projection");
+	shader->state_version = state.version - 1;
+	CHECK_GL();
+}
+
 static CT_Shader* shader_create(const char* vertex_source,
 			 const char* fragment_source)
 {
+	CT_Shader* shader;
+	if (is_software())
+	{
+		/* Nothing to compile, drawing uses the rasteriser. */
+		shader = smalloc_tag(sizeof(CT_Shader), CT_MEMORY_SHADER);
+		shader->gl_vertex_id   = 0;
+		shader->gl_fragment_id = 0;
+		shader->gl_program_id  = 0;
+		shader->colour_location     = -1;
+		shader->modelview_location  = -1;
+		shader->projection_location = -1;
+		shader->state_version = state.version;
+		return shader;
+	}
+	char path[1024];
+	int cached = shader_cache_path(vertex_source, fragment_source,
+				       path, sizeof(path));
+	if (cached)
+	{
+		GLuint program = shader_cache_load(path);
+		if (program)
+		{
+			/* Loaded programs have no shader objects. The block
+			   bindings are set again by shader_resolve. */
+			shader = smalloc_tag(sizeof(CT_Shader), CT_MEMORY_SHADER);
+			shader->gl_vertex_id   = 0;
+			shader->gl_fragment_id = 0;
+			shader->gl_program_id  = program;
+			shader_resolve(shader);
+			return shader;
+		}
+	}
+
 	int success;
 	GLuint vertex = compile_shader(vertex_source,
 				       GL_VERTEX_SHADER,
@@ -160,46 +506,83 @@ static CT_Shader* shader_create(const char* vertex_source,
 	GLuint fragment = compile_shader(fragment_source,
 					 GL_FRAGMENT_SHADER,
 					 &success);
-	if (!success) return NULL;
-	GLuint program  = create_shader_program(vertex, fragment, &success);
-	if (!success) return NULL;
+	if (!success)
+	{
+		glDeleteShader(vertex);
+		return NULL;
+	}
+	GLuint program  = create_shader_program(vertex, fragment, cached, &success);
+	if (!success)
+	{
+		glDeleteShader(vertex);
+		glDeleteShader(fragment);
+		return NULL;
+	}
+
+	if (cached) shader_cache_store(program, path);
 
-	CT_Shader* shader = smalloc(sizeof(CT_Shader));
+	shader = smalloc_tag(sizeof(CT_Shader), CT_MEMORY_SHADER);
 	shader->gl_vertex_id   = vertex;
 	shader->gl_fragment_id = fragment;
 	shader->gl_program_id  = program;
+	shader_resolve(shader);
 	CHECK_GL();
 	return shader;
 }
 
 static void shader_free(CT_Shader* shader)
 {
-	free(shader);
-}
-
-
-static void shader_upload_colour(CT_Shader* shader, float* colour)
-{
-	glUniform4fv(glGetUniformLocation(shader->gl_program_id, "colour"),
-		     1, colour);
-	CHECK_GL();
-}
-
-static void shader_upload_modelview_matrix(CT_Shader* shader, float* matrix)
-{
-	glUniformMatrix4fv(glGetUniformLocation(shader->gl_program_id, "modelview"),
-			   1, GL_FALSE, matrix);
-	CHECK_GL();
+	if (!is_software())
+	{
+		if (state.gl_program_id == shader->gl_program_id)
+			use_program(0);
+		glDeleteProgram(shader->gl_program_id);
+		glDeleteShader(shader->gl_vertex_id);
+		glDeleteShader(shader->gl_fragment_id);
+	}
+	sfree(shader);
 }
 
-static void shader_upload_projection_matrix(CT_Shader* shader, float* matrix)
+/* Binds `shader` for a draw with the given state. The block is sent once
+   per change, the plain uniforms once per change per shader. */
+static void shader_prepare(CT_Shader* shader, float* modelview, float* colour)
 {
-	glUniformMatrix4fv(glGetUniformLocation(shader->gl_program_id, "projection"),
-			   1, GL_FALSE, matrix);
+	state_set(state.block.modelview, modelview, 16);
+	state_set(state.block.colour, colour, 4);
+	use_program(shader->gl_program_id);
+	if (state.dirty)
+	{
+		glBindBuffer(GL_UNIFORM_BUFFER, state.gl_buffer_id);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(state.block), &state.block);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		state.dirty = 0;
+		stats.frame.uniform_uploads++;
+		stats.frame.upload_bytes += sizeof(state.block);
+	}
+	if (shader->state_version != state.version)
+	{
+		if (shader->colour_location >= 0)
+		{
+			glUniform4fv(shader->colour_location, 1, state.block.colour);
+			stats.frame.uniform_uploads++;
+		}
+		if (shader->modelview_location >= 0)
+		{
+			glUniformMatrix4fv(shader->modelview_location, 1, GL_FALSE,
+					   state.block.modelview);
+			stats.frame.uniform_uploads++;
+		}
+		if (shader->projection_location >= 0)
+		{
+			glUniformMatrix4fv(shader->projection_location, 1, GL_FALSE,
+					   state.block.projection);
+			stats.frame.uniform_uploads++;
+		}
+		shader->state_version = state.version;
+	}
 	CHECK_GL();
 }
 
-
 static CT_Shader* _default_shader;
 
 static struct
@@ -213,12 +596,32 @@ static void shader_push(CT_Shader* shader)
 	if (shader_stack.size >= CT_STACK_SIZE)
 	{
 		/* Stack overflow, resetting stack to prevent
-		   crashing if this error is ignored. */
+		   crashing if this error is ignored. The default
+		   shader stays at the bottom. */
 		ct_set_error("Stack overflow");
-		shader_stack.size = 0;
+		shader_stack.size = 1;
 	}
 	shader_stack.stack[shader_stack.size++] = shader;
-	glUseProgram(shader->gl_program_id);
+}
+
+CT_Shader* ct_shader_create(const char* vertex_source,
+			    const char* fragment_source)
+{
+	CT_Shader* shader = shader_create(
+		vertex_source ? vertex_source : vertex_shader_source,
+		fragment_source);
+	if (!shader) ct_set_error("Could not create shader.");
+	return shader;
+}
+
+void ct_shader_free(CT_Shader* shader)
+{
+	shader_free(shader);
+}
+
+void ct_shader_push(CT_Shader* shader)
+{
+	shader_push(shader);
 }
 
 void ct_push_default_shader()
@@ -229,13 +632,12 @@ void ct_push_default_shader()
 void ct_shader_pop()
 {
 	/* First item is default shader pushed by ct_window_init() */
-	if (shader_stack.size == 1) 
+	if (shader_stack.size <= 1) 
 	{
-		/* Stack underflow, setting stack to one
-		   so it will set to default value if this
-		   error is ignored. */
+		/* Stack underflow, the default shader
+		   stays if this error is ignored. */
 		ct_set_error("Stack underflow");
-		shader_stack.size = 1;
+		return;
 	}
 	shader_stack.size--;
 }
@@ -245,6 +647,123 @@ static CT_Shader* current_shader()
 	return shader_stack.stack[shader_stack.size-1];
 }
 
+CT_Uniform ct_shader_uniform(CT_Shader* shader, const char* name)
+{
+	if (is_software()) return -1;
+	return glGetUniformLocation(shader->gl_program_id, name);
+}
+
+/* Binds `shader` to set one of its uniforms, returns 0 if there is
+   nowhere to set it. */
+static int uniform_begin(CT_Shader* shader)
+{
+	if (is_software()) return 0;
+	use_program(shader->gl_program_id);
+	stats.frame.uniform_uploads++;
+	return 1;
+}
+
+void ct_shader_uniform_int(CT_Shader* shader, CT_Uniform uniform, int value)
+{
+	if (uniform_begin(shader)) glUniform1i(uniform, value);
+}
+
+void ct_shader_uniform_float(CT_Shader* shader, CT_Uniform uniform, float value)
+{
+	if (uniform_begin(shader)) glUniform1f(uniform, value);
+}
+
+void ct_shader_uniform_vec2(CT_Shader* shader, CT_Uniform uniform, float* value)
+{
+	if (uniform_begin(shader)) glUniform2fv(uniform, 1, value);
+}
+
+void ct_shader_uniform_vec3(CT_Shader* shader, CT_Uniform uniform, float* value)
+{
+	if (uniform_begin(shader)) glUniform3fv(uniform, 1, value);
+}
+
+void ct_shader_uniform_vec4(CT_Shader* shader, CT_Uniform uniform, float* value)
+{
+	if (uniform_begin(shader)) glUniform4fv(uniform, 1, value);
+}
+
+void ct_shader_uniform_mat4(CT_Shader* shader, CT_Uniform uniform, float* value)
+{
+	if (uniform_begin(shader)) glUniformMatrix4fv(uniform, 1, GL_FALSE, value);
+}
+
+int ct_shader_uniform_block_bind(CT_Shader* shader, const char* name, unsigned binding)
+{
+	if (is_software()) return 0;
+	GLuint block = glGetUniformBlockIndex(shader->gl_program_id, name);
+	if (block == GL_INVALID_INDEX)
+	{
+		ct_set_error("No such uniform block.");
+		return 1;
+	}
+	glUniformBlockBinding(shader->gl_program_id, block, binding);
+	CHECK_GL();
+	return 0;
+}
+
+/* Uniform buffer */
+
+CT_UniformBuffer* ct_uniform_buffer_create(unsigned size)
+{
+	CT_UniformBuffer* buffer = smalloc_tag(sizeof(CT_UniformBuffer),
+					       CT_MEMORY_SHADER);
+	buffer->size = size;
+	buffer->gl_buffer_id = 0;
+	if (is_software()) return buffer;
+	vram_account(size);
+	glGenBuffers(1, &buffer->gl_buffer_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer->gl_buffer_id);
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	CHECK_GL();
+	return buffer;
+}
+
+void ct_uniform_buffer_free(CT_UniformBuffer* buffer)
+{
+	if (!is_software())
+	{
+		glDeleteBuffers(1, &buffer->gl_buffer_id);
+		vram_account(-(long long)buffer->size);
+	}
+	sfree(buffer);
+}
+
+void ct_uniform_buffer_update(CT_UniformBuffer* buffer, unsigned offset,
+			      unsigned size, const void* data)
+{
+	if (offset + size > buffer->size)
+	{
+		ct_set_error("Uniform buffer update out of range.");
+		return;
+	}
+	if (is_software()) return;
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer->gl_buffer_id);
+	glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	stats.frame.uniform_uploads++;
+	stats.frame.upload_bytes += size;
+	CHECK_GL();
+}
+
+void ct_uniform_buffer_bind(CT_UniformBuffer* buffer, unsigned binding)
+{
+	if (binding == CT_STATE_BINDING)
+	{
+		ct_set_error("Binding point taken by ct_state.");
+		return;
+	}
+	if (is_software()) return;
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer->gl_buffer_id);
+	CHECK_GL();
+}
+
 
 /* Window */
 
@@ -252,7 +771,7 @@ static CT_Window window = { NULL, "Coati", 0, 1 };
 
 static CT_Texture _ct_screen_texture;
 
-int ct_window_init()
+static int window_init_gl()
 {
 	/* Initialise SDL */
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) return 1;
@@ -279,39 +798,103 @@ int ct_window_init()
 		return 1;
 	}
 
-	/* Initialise Default Shader */
-	_default_shader = shader_create(
-		vertex_shader_source, fragment_shader_source);
-	if (!_default_shader)
-	{
+	/* Initialise the ct_state block */
+	glGenBuffers(1, &state.gl_buffer_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, state.gl_buffer_id);
+	glBufferData(GL_UNIFORM_BUFFER, sizeof(state.block), NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBufferBase(GL_UNIFORM_BUFFER, CT_STATE_BINDING, state.gl_buffer_id);
+	vram_account(sizeof(state.block));
+	state.dirty = 1;
+	CHECK_GL();
+	return 0;
+}
+
+/* No window, the screen only exists in memory. */
+static int window_init_software()
+{
+	if (SDL_Init(SDL_INIT_EVENTS | SDL_INIT_TIMER) != 0) return 1;
+	_ct_screen_texture.w = 800;
+	_ct_screen_texture.h = 600;
+	sw_texture_alloc(&_ct_screen_texture);
+	window.is_size_changed = 0;
+	return 0;
+}
+
+int ct_window_init()
+{
+	if (is_software() ? window_init_software() : window_init_gl()) return 1;
+	backend.is_open = 1;
+
+	/* Initialise Default Shader */
+	_default_shader = shader_create(
+		vertex_shader_source, fragment_shader_source);
+	if (!_default_shader)
+	{
 		ct_set_error("Could not create default shader.");
 		return 1;
 	}
-	shader_upload_colour(_default_shader, colour_white);
 
 	/* Make sure first shader is always the default shader */
 	/* This one cannot be removed by ct_shader_pop() */
 	ct_push_default_shader();
-
-	CHECK_GL();
 	return 0;
 }
 
+static void postfx_shaders_free();
+
+static void upload_queue_clear();
+
+static void capture_quit();
+
 void ct_window_quit()
 {
-	SDL_DestroyWindow(window.sdl_window);
+	capture_quit();
+	ct_dirty_rects_set(0);
+	ct_target_pool_clear();
+	postfx_shaders_free();
 	shader_free(_default_shader);
+	ct_shader_cache_set(NULL);
+	ct_texture_cache_set(NULL, 0);
+	upload_queue_clear();
+	frame_arena_free();
+	if (is_software())
+	{
+		sw_texture_free(&_ct_screen_texture);
+		sw_quit();
+	} else
+	{
+		glDeleteBuffers(1, &state.gl_buffer_id);
+		vram_account(-(long long)sizeof(state.block));
+		SDL_DestroyWindow(window.sdl_window);
+	}
+	backend.is_open = 0;
 	SDL_Quit();
+	memory_report_leaks();
 }
 
 void ct_window_resolution_set(unsigned* xy)
 {
+	if (is_software())
+	{
+		sw_texture_free(&_ct_screen_texture);
+		_ct_screen_texture.w = xy[0];
+		_ct_screen_texture.h = xy[1];
+		sw_texture_alloc(&_ct_screen_texture);
+		return;
+	}
 	window.is_size_changed = 1;
 	SDL_SetWindowSize(window.sdl_window, ((int*)xy)[0], ((int*)xy)[1]);
 }
 
 void ct_window_resolution(unsigned* ret)
 {
+	if (is_software())
+	{
+		ret[0] = _ct_screen_texture.w;
+		ret[1] = _ct_screen_texture.h;
+		return;
+	}
 	SDL_GetWindowSize(window.sdl_window, (int*)ret, (int*)ret+1);
 }
 
@@ -321,7 +904,8 @@ void ct_window_res_set(int x, int y)
 
 void ct_window_fullscreen_set(int fullscreen)
 {
-	SDL_SetWindowFullscreen(window.sdl_window, fullscreen ? SDL_WINDOW_FULLSCREEN : 0);
+	if (!is_software())
+		SDL_SetWindowFullscreen(window.sdl_window, fullscreen ? SDL_WINDOW_FULLSCREEN : 0);
 	window.fullscreen = fullscreen;
 }
 
@@ -345,9 +929,32 @@ CT_Texture* ct_screen_texture()
 	return &_ct_screen_texture;
 }
 
+static void upload_process(unsigned budget);
+
+static void target_pool_recycle();
+
+static void dirty_present();
+
+static void capture_frame(CT_Texture* src);
+
 void ct_window_update()
 {
-	SDL_GL_SwapWindow(window.sdl_window);
+	CT_PROFILE_BEGIN("ct_window_update");
+	if (is_software()) sw_finish();
+	if (ct_dirty_rects())
+	{
+		dirty_present();
+	} else
+	{
+		capture_frame(ct_screen_texture());
+		if (!is_software()) SDL_GL_SwapWindow(window.sdl_window);
+	}
+	upload_process(ct_upload_budget());
+	target_pool_recycle();
+	frame_arena_end();
+	stats_frame_end();
+	CT_PROFILE_END();
+	CT_PROFILE_FRAME_END();
 }
 
 void ct_window_clear(float* colour)
@@ -357,10 +964,14 @@ void ct_window_clear(float* colour)
 
 /* Image */
 
+static Pool image_pool = POOL(CT_Image, CT_MEMORY_IMAGE);
+
+/* Surfaces are counted with images, SDL holds their pixels for us. */
 static CT_Image* image_alloc(SDL_Surface* sur)
 {
-	CT_Image* image = smalloc(sizeof(CT_Image));
+	CT_Image* image = pool_alloc(&image_pool);
 	image->sdl_surface = sur;
+	if (sur) memory_account(CT_MEMORY_IMAGE, sur->pitch * sur->h, 1);
 	return image;
 }
 
@@ -377,6 +988,21 @@ CT_Image* ct_image_load(const char* filename)
 	return image_alloc(sur);
 }
 
+CT_Image* ct_image_load_packed(CT_Pack* pack, const char* name)
+{
+	SDL_RWops* rw = ct_pack_rw(pack, name);
+	if (!rw) return NULL; /* ct_pack_rw already sets the error. */
+	SDL_Surface* sur = IMG_Load_RW(rw, 1);
+	if (sur == NULL)
+	{
+		char str[1024];
+		sprintf(str, "Could not load packed image: %s", name);
+		ct_set_error(str);
+		return NULL;
+	}
+	return image_alloc(sur);
+}
+
 CT_Image* ct_image_create(unsigned w, unsigned h)
 {
 	SDL_Surface* sur = SDL_CreateRGBSurface(0, w, h, 32, 0, 0, 0, 0);
@@ -390,8 +1016,10 @@ CT_Image* ct_image_create(unsigned w, unsigned h)
 
 void ct_image_free(CT_Image* image)
 {
-	SDL_FreeSurface(image->sdl_surface);
-	free(image);
+	SDL_Surface* sur = image->sdl_surface;
+	if (sur) memory_account(CT_MEMORY_IMAGE, -(long long)sur->pitch * sur->h, -1);
+	SDL_FreeSurface(sur);
+	pool_free(&image_pool, image);
 }
 
 unsigned ct_image_bpp(CT_Image* image)
@@ -436,7 +1064,6 @@ void ct_colour_push(float* colour)
 	       colour,
 	       sizeof(float)*4);
 	colour_stack.size++;
-	shader_upload_colour(current_shader(), colour);
 }
 
 void ct_colour_pop()
@@ -450,13 +1077,13 @@ void ct_colour_pop()
 		colour_stack.size = 1;
 	}
 	colour_stack.size--;
-	if (colour_stack.size == 0)
-	{
-		shader_upload_colour(current_shader(), colour_white);
-	} else
-	{
-		shader_upload_colour(current_shader(), colour_stack.stack+(colour_stack.size*4));
-	}
+}
+
+static float* current_colour()
+{
+	return colour_stack.size
+		? colour_stack.stack+((colour_stack.size-1)*4)
+		: colour_white;
 }
 
 /* Blending */
@@ -467,8 +1094,14 @@ static struct
 	unsigned size;
 } blend_stack;
 
+/* What draws blend with, GL keeps its own copy. */
+static CT_BlendMode applied_blend_mode = CT_BLEND_MODE_NORMAL;
+
 static void set_blend_mode(CT_BlendMode mode)
 {
+	applied_blend_mode = mode;
+	stats.frame.blend_changes++;
+	if (is_software()) return;
 	if (blend_stack.size == 0)
 	{
 		glEnable(GL_BLEND);
@@ -487,9 +1120,19 @@ static void set_blend_mode(CT_BlendMode mode)
 	case CT_BLEND_MODE_ONE_ONE:
 		glBlendFunc(GL_ONE, GL_ONE);
 		break;
+	case CT_BLEND_MODE_PREMULTIPLIED:
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+		break;
 	}
 }
 
+static CT_BlendMode current_blend_mode()
+{
+	return blend_stack.size
+		? blend_stack.stack[blend_stack.size-1]
+		: CT_BLEND_MODE_NORMAL;
+}
+
 void ct_blend_mode_push(CT_BlendMode mode)
 {
 	if (blend_stack.size >= CT_STACK_SIZE)
@@ -500,7 +1143,7 @@ void ct_blend_mode_push(CT_BlendMode mode)
 		colour_stack.size = 0;
 	}
 	blend_stack.stack[blend_stack.size++] = mode;
-	glEnable(GL_BLEND);
+	if (!is_software()) glEnable(GL_BLEND);
 	set_blend_mode(mode);
 }
 
@@ -531,288 +1174,2643 @@ static CT_Texture* current_target();
 static GLuint create_buffer(GLuint tex_id)
 {
 	GLuint buf_id; glGenFramebuffers(1, &buf_id);
-	glBindFramebuffer(GL_FRAMEBUFFER, buf_id);
+	stats.frame.framebuffers_created++;
+	bind_framebuffer(GL_FRAMEBUFFER, buf_id);
 	glFramebufferTexture2D(GL_FRAMEBUFFER,
 			       GL_COLOR_ATTACHMENT0,
 			       GL_TEXTURE_2D, tex_id, 0);
-	glBindFramebuffer(GL_FRAMEBUFFER, current_target()->gl_buffer_id);
+	bind_framebuffer(GL_FRAMEBUFFER, current_target()->gl_buffer_id);
 	CHECK_GL();
 	return buf_id;
 }
 
+/* Sampling */
+
+static struct
+{
+	CT_TextureFilter filter;
+	CT_TextureWrap wrap;
+} default_sampling = { CT_TEXTURE_FILTER_NEAREST, CT_TEXTURE_WRAP_REPEAT };
+
+static int is_mipmap_filter(CT_TextureFilter filter)
+{
+	return filter == CT_TEXTURE_FILTER_NEAREST_MIPMAP ||
+		filter == CT_TEXTURE_FILTER_LINEAR_MIPMAP;
+}
+
+static void texture_apply_sampling(CT_Texture* tex)
+{
+	static const GLint min_filters[] = {
+		GL_NEAREST, GL_LINEAR,
+		GL_NEAREST_MIPMAP_NEAREST, GL_LINEAR_MIPMAP_LINEAR };
+	static const GLint mag_filters[] = {
+		GL_NEAREST, GL_LINEAR,
+		GL_NEAREST, GL_LINEAR };
+	static const GLint wraps[] = {
+		GL_REPEAT, GL_CLAMP_TO_EDGE, GL_MIRRORED_REPEAT };
+	if (is_software()) return;
+	bind_texture(tex->gl_texture_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wraps[tex->wrap]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wraps[tex->wrap]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, min_filters[tex->filter]);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mag_filters[tex->filter]);
+	CHECK_GL();
+}
+
+void ct_texture_default_sampling_set(CT_TextureFilter filter, CT_TextureWrap wrap)
+{
+	default_sampling.filter = filter;
+	default_sampling.wrap   = wrap;
+}
+
+void ct_texture_mipmaps_generate(CT_Texture* tex)
+{
+	if (is_software() || tex->is_compressed) return;
+	unsigned size = tex->w > tex->h ? tex->w : tex->h;
+	tex->levels = 1;
+	while (size >>= 1) tex->levels++;
+	bind_texture(tex->gl_texture_id);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, tex->levels-1);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	unsigned bytes = 0, i;
+	for (i=0; i<tex->levels; i++)
+	{
+		unsigned w = tex->w >> i, h = tex->h >> i;
+		bytes += (w ? w : 1) * (h ? h : 1) * 4;
+	}
+	texture_vram_set(tex, bytes);
+	CHECK_GL();
+}
+
+void ct_texture_filter_set(CT_Texture* tex, CT_TextureFilter filter)
+{
+	tex->filter = filter;
+	/* A mipmapped filter without mipmaps samples black */
+	if (is_mipmap_filter(filter) && tex->levels == 1)
+	{
+		if (tex->is_compressed)
+		{
+			tex->filter = filter == CT_TEXTURE_FILTER_NEAREST_MIPMAP
+				? CT_TEXTURE_FILTER_NEAREST : CT_TEXTURE_FILTER_LINEAR;
+		} else if (ct_is_texture_ready(tex))
+		{
+			/* Queued uploads get theirs in texture_finished. */
+			ct_texture_mipmaps_generate(tex);
+		}
+	}
+	texture_apply_sampling(tex);
+}
+
+CT_TextureFilter ct_texture_filter(CT_Texture* tex)
+{
+	return tex->filter;
+}
+
+void ct_texture_wrap_set(CT_Texture* tex, CT_TextureWrap wrap)
+{
+	tex->wrap = wrap;
+	texture_apply_sampling(tex);
+}
+
+CT_TextureWrap ct_texture_wrap(CT_Texture* tex)
+{
+	return tex->wrap;
+}
+
+/* Versions of textures and batches come from one counter. Their pools
+   hand a freed slot straight to the next object, which so never repeats
+   a pointer and version pair the dirty rectangles or layers have seen. */
+static unsigned content_version = 0;
+
+static unsigned next_version()
+{
+	return ++content_version;
+}
+
+/* Called once the first level holds its final contents. Mipmaps
+   that came with the file are kept, otherwise they are generated. */
+static void texture_finished(CT_Texture* tex)
+{
+	tex->version = next_version();
+	if (is_mipmap_filter(tex->filter) && !tex->has_file_mipmaps)
+	{
+		ct_texture_mipmaps_generate(tex);
+	}
+}
+
+/* Resolves the mipmaps after rendering or copying into `tex`. */
+static void texture_contents_changed(CT_Texture* tex)
+{
+	tex->version = next_version();
+	if (is_mipmap_filter(tex->filter) && !ct_is_texture_screen(tex))
+	{
+		ct_texture_mipmaps_generate(tex);
+	}
+}
+
+static Pool texture_pool = POOL(CT_Texture, CT_MEMORY_TEXTURE);
+
 static CT_Texture* new_texture(unsigned w, unsigned h)
 {
-	GLuint tex_id; glGenTextures(1, &tex_id);
-	CT_Texture* tex = smalloc(sizeof(CT_Texture));
+	stats.frame.textures_created++;
+	CT_Texture* tex = pool_alloc(&texture_pool);
 	tex->w = w;
 	tex->h = h;
-	/**/
-	glBindTexture(GL_TEXTURE_2D, tex_id);
-	/* Use repeat for wrapping-mode */
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);	
-	/* Don't use mipmapping */
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	/**/
+	tex->levels = 1;
+	tex->has_file_mipmaps = 0;
+	tex->is_compressed = 0;
+	tex->version = next_version();
+	tex->vram = 0;
+	tex->filter = default_sampling.filter;
+	tex->wrap   = default_sampling.wrap;
+	tex->pixels = NULL;
+	if (is_software())
+	{
+		tex->gl_texture_id = 0;
+		tex->gl_buffer_id  = 0;
+		sw_texture_alloc(tex);
+		return tex;
+	}
+	GLuint tex_id; glGenTextures(1, &tex_id);
 	tex->gl_texture_id = tex_id;
+	texture_apply_sampling(tex);
 	tex->gl_buffer_id  = create_buffer(tex_id);
 	CHECK_GL();
 	return tex;
 }
 
-static CT_Texture* texture_init(CT_Image* image, unsigned format)
+static int upload_enqueue(CT_Texture* tex,
+			  const unsigned char* pixels, unsigned pitch,
+			  unsigned bpp, unsigned format);
+
+static void upload_cancel(CT_Texture* tex);
+
+static unsigned upload_budget = 0;
+
+/* Describes rows `pitch` bytes apart to GL. Whole pixels per row are
+   given as the row length; other pitches are SDL's rows padded to
+   their alignment, which GL then pads the same way. unpack_reset puts
+   back GL's defaults. */
+static void unpack_rows(unsigned pitch, unsigned bpp)
+{
+	if (pitch % bpp == 0)
+	{
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / bpp);
+		return;
+	}
+	unsigned alignment = 8;
+	while (pitch % alignment) alignment /= 2;
+	glPixelStorei(GL_UNPACK_ALIGNMENT, alignment);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+static void unpack_reset()
+{
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+/* Uploads one level of the bound texture `tex`. Deferred uploads (level
+   0 only) go through the upload queue when possible. */
+static int texture_upload(CT_Texture* tex, unsigned level,
+			  unsigned w, unsigned h,
+			  const unsigned char* pixels, unsigned pitch,
+			  unsigned bpp, unsigned format, int deferred)
+{
+	if (is_software())
+	{
+		/* Only the first level is ever sampled */
+		if (level == 0)
+			sw_texture_upload(tex, pixels, pitch, bpp,
+					  format == GL_BGRA || format == GL_BGR);
+		stats.frame.upload_bytes += w*h*bpp;
+		return 0;
+	}
+	if (deferred)
+	{
+		/* Only allocate storage, the pixels will arrive
+		   over the next frames through the upload queue. */
+		glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8,
+			     w, h,
+			     0, format, GL_UNSIGNED_BYTE, NULL);
+		texture_vram_set(tex, tex->vram + w*h*4);
+		if (!upload_enqueue(tex, pixels, pitch, bpp, format)) return 1;
+	}
+	unpack_rows(pitch, bpp);
+	glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8,
+		     w, h,
+		     0, format, GL_UNSIGNED_BYTE, pixels);
+	if (!deferred) texture_vram_set(tex, tex->vram + w*h*4);
+	stats.frame.upload_bytes += w*h*bpp;
+	unpack_reset();
+	CHECK_GL();
+	return 0;
+}
+
+static CT_Texture* texture_init(CT_Image* image, unsigned format, int deferred)
+{
+	SDL_Surface* sur = image->sdl_surface;
+	CT_Texture* tex = new_texture(sur->w, sur->h);
+	bind_texture(tex->gl_texture_id);
+	if (!texture_upload(tex, 0, sur->w, sur->h,
+			    sur->pixels, sur->pitch, ct_image_bpp(image),
+			    format, deferred))
+	{
+		texture_finished(tex);
+	}
+	return tex;
+}
+
+CT_Texture* ct_image_to_texture(CT_Image* image)
+{
+	return texture_init(image, ct_image_gl_format(image), upload_budget > 0);
+}
+
+/* Blobs are already RGBA8, optionally with a full mip chain. */
+static CT_Texture* texture_from_blob(TC_Blob* blob)
+{
+	CT_Texture* tex = new_texture(blob->w, blob->h);
+	bind_texture(tex->gl_texture_id);
+	unsigned level;
+	int queued = 0;
+	for (level=0; level<blob->levels; level++)
+	{
+		unsigned w, h;
+		const unsigned char* pixels = tc_blob_level(blob, level, &w, &h);
+		queued |= texture_upload(tex, level, w, h,
+					 pixels, w*4, 4,
+					 GL_RGBA, level == 0 && upload_budget > 0);
+	}
+	tex->levels = blob->levels;
+	tex->has_file_mipmaps = blob->levels > 1;
+	bind_texture(tex->gl_texture_id);
+	if (!is_software())
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, blob->levels-1);
+	if (!queued) texture_finished(tex);
+	CHECK_GL();
+	return tex;
+}
+
+/* Whether the driver can sample `format` without decompressing it. */
+static int is_format_supported(unsigned format)
+{
+	if (is_software()) return format == GL_RGBA8;
+	switch (format)
+	{
+	case GL_RGBA8:
+		return 1;
+	case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+		return GLEW_EXT_texture_compression_s3tc;
+	case GL_COMPRESSED_RGB8_ETC2:
+	case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+	case GL_COMPRESSED_RGBA8_ETC2_EAC:
+		return GLEW_ARB_ES3_compatibility;
+	}
+	if (format >= GL_COMPRESSED_RGBA_ASTC_4x4_KHR &&
+	    format <= GL_COMPRESSED_RGBA_ASTC_12x12_KHR)
+	{
+		return GLEW_KHR_texture_compression_astc_ldr;
+	}
+	return 0;
+}
+
+/* Compressed levels are uploaded as is when the driver supports the
+   format and decompressed on the CPU otherwise. */
+static CT_Texture* texture_from_ktx(const void* data, size_t size)
+{
+	KTX_Texture ktx;
+	if (ktx_parse(data, size, &ktx)) return NULL; /* Error already set. */
+	int supported = is_format_supported(ktx.gl_internal_format);
+	if (!supported && !ktx_can_decode(ktx.gl_internal_format))
+	{
+		ct_set_error("KTX: texture format not supported by the driver.");
+		return NULL;
+	}
+	CT_Texture* tex = new_texture(ktx.w, ktx.h);
+	bind_texture(tex->gl_texture_id);
+	unsigned char* rgba = supported ? NULL
+		: smalloc_tag(ktx.w * ktx.h * 4, CT_MEMORY_IMAGE);
+	unsigned i;
+	for (i=0; i<ktx.levels; i++)
+	{
+		KTX_Level* level = ktx.level + i;
+		if (!ktx.compressed)
+		{
+			texture_upload(tex, i, level->w, level->h,
+				       level->data, level->w*4, 4, GL_RGBA, 0);
+		} else if (supported)
+		{
+			glCompressedTexImage2D(GL_TEXTURE_2D, i,
+					       ktx.gl_internal_format,
+					       level->w, level->h, 0,
+					       level->size, level->data);
+			stats.frame.upload_bytes += level->size;
+			texture_vram_set(tex, tex->vram + level->size);
+		} else
+		{
+			ktx_decode(&ktx, i, rgba);
+			texture_upload(tex, i, level->w, level->h,
+				       rgba, level->w*4, 4, GL_RGBA, 0);
+		}
+	}
+	sfree(rgba);
+	tex->levels = ktx.levels;
+	tex->has_file_mipmaps = ktx.levels > 1;
+	tex->is_compressed = ktx.compressed && supported;
+	if (!is_software())
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, ktx.levels-1);
+	if (!tex->is_compressed)
+	{
+		texture_finished(tex);
+	} else
+	{
+		ct_texture_filter_set(tex, tex->filter);
+	}
+	CHECK_GL();
+	return tex;
+}
+
+CT_Texture* ct_texture_load_ktx(const char* filename)
+{
+	size_t size;
+	const void* data = map_file(filename, &size);
+	if (!data)
+	{
+		char str[1024];
+		sprintf(str, "Could not load KTX file: %s", filename);
+		ct_set_error(str);
+		return NULL;
+	}
+	CT_Texture* tex = texture_from_ktx(data, size);
+	unmap_file(data, size);
+	return tex;
+}
+
+static int has_extension(const char* filename, const char* extension)
+{
+	size_t length = strlen(filename), ext_length = strlen(extension);
+	return length >= ext_length &&
+		strcasecmp(filename + length - ext_length, extension) == 0;
+}
+
+/* Texture cache */
+
+static struct
+{
+	char* directory;
+	unsigned flags;
+} texture_cache;
+
+void ct_texture_cache_set(const char* directory, unsigned flags)
+{
+	sfree(texture_cache.directory);
+	texture_cache.directory = NULL;
+	if (directory)
+	{
+		texture_cache.directory = smalloc(strlen(directory)+1);
+		strcpy(texture_cache.directory, directory);
+	}
+	texture_cache.flags = flags;
+}
+
+int ct_texture_cache_write(const char* filename,
+			   const char* cache_filename,
+			   unsigned flags)
+{
+	CT_Image* image = ct_image_load(filename);
+	if (!image) return 1; /* ct_image_load already sets the error. */
+	size_t size;
+	unsigned char* data = tc_blob_create(image->sdl_surface, flags, &size);
+	ct_image_free(image);
+	int failed = !data || tc_blob_write(cache_filename, data, size);
+	sfree(data);
+	if (failed)
+	{
+		char str[1024];
+		sprintf(str, "Could not write texture cache file: %s", cache_filename);
+		ct_set_error(str);
+	}
+	return failed;
+}
+
+static CT_Texture* texture_load_cached(const char* filename)
+{
+	unsigned long long hash = tc_source_hash(filename, texture_cache.flags);
+	if (!hash) return NULL;
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%016llx.letc",
+		 texture_cache.directory, hash);
+	TC_Blob blob;
+	if (!tc_blob_open(path, &blob))
+	{
+		CT_Texture* tex = texture_from_blob(&blob);
+		tc_blob_close(&blob);
+		return tex;
+	}
+	/* Not cached yet, decode once and store the result. If storing fails
+	   the blob is still used, so the flags are honoured either way. */
+	SDL_Surface* sur = IMG_Load(filename);
+	if (!sur) return NULL;
+	size_t size;
+	unsigned char* data = tc_blob_create(sur, texture_cache.flags, &size);
+	SDL_FreeSurface(sur);
+	if (!data) return NULL;
+	tc_blob_write(path, data, size);
+	CT_Texture* tex = NULL;
+	if (!tc_blob_from_memory(data, size, &blob))
+	{
+		tex = texture_from_blob(&blob);
+	}
+	sfree(data);
+	return tex;
+}
+
+CT_Texture* ct_texture_create(unsigned w, unsigned h)
+{
+	static const float transparent[4] = { 0, 0, 0, 0 };
+	CT_Texture* tex = new_texture(w, h);
+	if (is_software())
+	{
+		/* The pixels come cleared */
+		texture_finished(tex);
+		return tex;
+	}
+	/* Allocate storage only, clearing it is far cheaper than
+	   uploading a blank image. */
+	bind_texture(tex->gl_texture_id);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8,
+		     w, h,
+		     0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	texture_vram_set(tex, w*h*4);
+	bind_framebuffer(GL_FRAMEBUFFER, tex->gl_buffer_id);
+	glClearBufferfv(GL_COLOR, 0, transparent);
+	bind_framebuffer(GL_FRAMEBUFFER, current_target()->gl_buffer_id);
+	texture_finished(tex);
+	CHECK_GL();
+	return tex;
+}
+
+CT_Texture* ct_texture_load(const char* filename)
+{
+	if (has_extension(filename, ".ktx") || has_extension(filename, ".ktx2"))
+	{
+		return ct_texture_load_ktx(filename);
+	}
+	if (texture_cache.directory)
+	{
+		CT_Texture* tex = texture_load_cached(filename);
+		if (tex) return tex;
+	}
+	CT_Image* image = ct_image_load(filename);
+	if (!image) return NULL; /* ct_image_load already prints error message. */
+	CT_Texture* tex = ct_image_to_texture(image);
+	ct_image_free(image);
+	return tex;
+}
+
+CT_Texture* ct_texture_load_packed(CT_Pack* pack, const char* name)
+{
+	/* Packs can hold texture cache files as well as images. */
+	size_t size;
+	TC_Blob blob;
+	const void* data = ct_pack_find(pack, name, &size);
+	if (data && !tc_blob_from_memory(data, size, &blob))
+	{
+		return texture_from_blob(&blob);
+	}
+	if (data && ktx_is_ktx(data, size))
+	{
+		return texture_from_ktx(data, size);
+	}
+	CT_Image* image = ct_image_load_packed(pack, name);
+	if (!image) return NULL; /* ct_image_load_packed already sets the error. */
+	CT_Texture* tex = ct_image_to_texture(image);
+	ct_image_free(image);
+	return tex;
+}
+
+/* Engine rectangles have their origin top left, the screen's
+   framebuffer is upside down compared to that. */
+static void gl_rows(CT_Texture* tex, int y, int h, int* y0, int* y1)
+{
+	if (ct_is_texture_screen(tex))
+	{
+		*y0 = tex->h - y;
+		*y1 = tex->h - y - h;
+	} else
+	{
+		*y0 = y;
+		*y1 = y + h;
+	}
+}
+
+static void dirty_preserve(CT_Texture* tex);
+
+static void layer_forget(const unsigned* version);
+
+void ct_texture_copy_rect(CT_Texture* src, float* src_rect,
+			  CT_Texture* dst, float* dst_pos)
+{
+	int sx = src_rect[0] * src->w + .5;
+	int sy = src_rect[2] * src->h + .5;
+	int w  = src_rect[1] * src->w + .5 - sx;
+	int h  = src_rect[3] * src->h + .5 - sy;
+	int dx = dst_pos[0] * dst->w + .5;
+	int dy = dst_pos[1] * dst->h + .5;
+	/* Clip to both textures */
+	if (sx < 0) { w += sx; dx -= sx; sx = 0; }
+	if (sy < 0) { h += sy; dy -= sy; sy = 0; }
+	if (dx < 0) { w += dx; sx -= dx; dx = 0; }
+	if (dy < 0) { h += dy; sy -= dy; dy = 0; }
+	if (sx + w > (int)src->w) w = src->w - sx;
+	if (sy + h > (int)src->h) h = src->h - sy;
+	if (dx + w > (int)dst->w) w = dst->w - dx;
+	if (dy + h > (int)dst->h) h = dst->h - dy;
+	if (w <= 0 || h <= 0) return;
+	dirty_preserve(dst);
+	/**/
+	if (is_software())
+	{
+		sw_copy(src, sx, sy, dst, dx, dy, w, h);
+	} else if (GLEW_ARB_copy_image &&
+	    !ct_is_texture_screen(src) && !ct_is_texture_screen(dst))
+	{
+		glCopyImageSubData(src->gl_texture_id, GL_TEXTURE_2D, 0, sx, sy, 0,
+				   dst->gl_texture_id, GL_TEXTURE_2D, 0, dx, dy, 0,
+				   w, h, 1);
+	} else
+	{
+		int sy0, sy1, dy0, dy1;
+		gl_rows(src, sy, h, &sy0, &sy1);
+		gl_rows(dst, dy, h, &dy0, &dy1);
+		bind_framebuffer(GL_READ_FRAMEBUFFER, src->gl_buffer_id);
+		bind_framebuffer(GL_DRAW_FRAMEBUFFER, dst->gl_buffer_id);
+		glBlitFramebuffer(sx, sy0, sx + w, sy1,
+				  dx, dy0, dx + w, dy1,
+				  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+		bind_framebuffer(GL_FRAMEBUFFER, current_target()->gl_buffer_id);
+	}
+	texture_contents_changed(dst);
+	CHECK_GL();
+}
+
+CT_Texture* ct_texture_copy(CT_Texture* texture)
+{
+	static float all[] = { 0, 1, 0, 1 };
+	static float origin[] = { 0, 0 };
+	CT_Texture* tex = ct_texture_create(texture->w, texture->h);
+	ct_texture_copy_rect(texture, all, tex, origin);
+	return tex;
+}
+
+void ct_texture_free(CT_Texture* tex)
+{
+	dirty_preserve(tex);
+	layer_forget(&tex->version);
+	upload_cancel(tex);
+	if (is_software())
+	{
+		sw_texture_free(tex);
+	} else
+	{
+		glDeleteTextures(1, &tex->gl_texture_id);
+		glDeleteFramebuffers(1, &tex->gl_buffer_id);
+		stats.frame.framebuffers_deleted++;
+		texture_vram_set(tex, 0);
+		CHECK_GL();
+	}
+	stats.frame.textures_deleted++;
+	pool_free(&texture_pool, tex);
+}
+
+int ct_is_texture_screen(CT_Texture* tex)
+{
+	return tex == &_ct_screen_texture;
+}
+
+void ct_texture_size(CT_Texture* tex, float* vect)
+{
+	if (ct_is_texture_screen(tex)) {
+	}
+	vect[0] = (float)tex->w;
+	vect[1] = (float)tex->h;
+}
+
+const unsigned char* ct_texture_pixels(CT_Texture* tex)
+{
+	if (tex->pixels) sw_finish();
+	return tex->pixels;
+}
+
+/* Software drawing goes to current_target() directly. */
+static void texture_bind(CT_Texture* tex)
+{
+	if (is_software()) return;
+	float project_matrix[16];
+	glViewport(0, 0, tex->w, tex->h);
+	hpmOrthoFloat(1, ct_is_texture_screen(tex) ? -1 : 1, -100, 100, project_matrix);
+	/* Put origin origin at 0,0 */
+	hpmTranslation(-.5, -.5, 0, project_matrix);
+	hpmScale2D(2, ct_is_texture_screen(tex) ? -2 : 2, project_matrix);
+	state_set(state.block.projection, project_matrix, 16);
+	bind_framebuffer(GL_FRAMEBUFFER, tex->gl_buffer_id);
+	CHECK_GL();
+}
+
+
+void ct_target_push(CT_Texture* tex);
+
+void ct_target_pop();
+
+static int dirty_record_clear(float* colour);
+
+/* Clears the current target, within the scissor if set. */
+static void target_clear(const float* colour)
+{
+	if (is_software())
+		sw_clear(current_target(), colour);
+	else
+		glClearBufferfv(GL_COLOR, 0, colour);
+	CHECK_GL();
+}
+
+void ct_texture_clear(CT_Texture* tex, float* colour)
+{
+	if (ct_is_texture_screen(tex) && dirty_record_clear(colour)) return;
+	ct_target_push(tex);
+	target_clear(colour);
+	ct_target_pop();
+}
+
+static GLushort rect_index_order[] = { 0, 1, 2, 0, 2, 3 };
+
+static void vertex_data(CT_Transformation* tran, float* data);
+
+static float* current_matrix();
+
+/* Draws `quads` quads with the given state instead of the stacks'.
+   Texture coordinates always have the full vertex stride. */
+static void draw_quads(CT_Shader* shader, float* modelview, float* colour,
+		       CT_Texture* tex, const float* positions, int stride,
+		       const float* coords, unsigned quads,
+		       const unsigned short* indices)
+{
+	if (is_software())
+	{
+		sw_draw(current_target(), tex, modelview, colour, applied_blend_mode,
+			positions, stride, coords, quads, indices);
+		stats_draw(quads);
+		return;
+	}
+	shader_prepare(shader, modelview, colour);
+	bind_texture(tex->gl_texture_id);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, positions);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 16, coords);
+	glDrawElements(GL_TRIANGLES, quads*6, GL_UNSIGNED_SHORT, indices);
+	stats_draw(quads);
+	CHECK_GL();
+}
+
+static int dirty_record_texture(CT_Texture* tex, float* data);
+
+static void layer_depend(const unsigned* version);
+
+void ct_texture_render(CT_Texture* tex, CT_Transformation* trans)
+{
+	CT_PROFILE_BEGIN("ct_texture_render");
+	float data[16]; vertex_data(trans, data);
+	layer_depend(&tex->version);
+	if (!dirty_record_texture(tex, data))
+	{
+		draw_quads(current_shader(), current_matrix(), current_colour(),
+			   tex, data, 16, data+2, 1, rect_index_order);
+	}
+	CT_PROFILE_END();
+}
+
+/* Upload queue */
+
+typedef struct
+{
+	CT_Texture* texture;
+	GLuint gl_pbo_id;
+	GLenum format;
+	unsigned bpp;
+	unsigned row_size;
+	unsigned next_row;
+} CT_Upload;
+
+static struct
+{
+	CT_Upload* uploads;
+	unsigned size;
+	unsigned capacity;
+	unsigned bytes;
+} upload_queue;
+
+/* Copies the pixels into a pixel buffer object so the driver can
+   transfer them asynchronously, returns 0 on success. */
+static int upload_enqueue(CT_Texture* tex,
+			  const unsigned char* pixels, unsigned pitch,
+			  unsigned bpp, unsigned format)
+{
+	unsigned row_size = tex->w * bpp;
+	GLuint pbo_id; glGenBuffers(1, &pbo_id);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo_id);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, row_size * tex->h, NULL, GL_STREAM_DRAW);
+	unsigned char* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+					      0, row_size * tex->h,
+					      GL_MAP_WRITE_BIT |
+					      GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!dst)
+	{
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &pbo_id);
+		return 1;
+	}
+	unsigned y;
+	for (y=0; y<tex->h; y++)
+	{
+		memcpy(dst + y*row_size, pixels + y*pitch, row_size);
+	}
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	/**/
+	if (upload_queue.size >= upload_queue.capacity)
+	{
+		upload_queue.capacity = upload_queue.capacity
+			? upload_queue.capacity * 2 : 16;
+		upload_queue.uploads = srealloc(upload_queue.uploads,
+			sizeof(CT_Upload) * upload_queue.capacity);
+	}
+	CT_Upload* upload = upload_queue.uploads + upload_queue.size++;
+	upload->texture   = tex;
+	upload->gl_pbo_id = pbo_id;
+	upload->format    = format;
+	upload->bpp       = bpp;
+	upload->row_size  = row_size;
+	upload->next_row  = 0;
+	upload_queue.bytes += row_size * tex->h;
+	vram_account(row_size * tex->h);
+	CHECK_GL();
+	return 0;
+}
+
+static void upload_remove(unsigned index)
+{
+	CT_Upload* upload = upload_queue.uploads + index;
+	upload_queue.bytes -= upload->row_size *
+		(upload->texture->h - upload->next_row);
+	glDeleteBuffers(1, &upload->gl_pbo_id);
+	vram_account(-(long long)upload->row_size * upload->texture->h);
+	upload_queue.size--;
+	memmove(upload, upload + 1,
+		sizeof(CT_Upload) * (upload_queue.size - index));
+}
+
+static void upload_queue_clear()
+{
+	while (upload_queue.size) upload_remove(upload_queue.size-1);
+	sfree(upload_queue.uploads);
+	memset(&upload_queue, 0, sizeof(upload_queue));
+}
+
+static void upload_cancel(CT_Texture* tex)
+{
+	unsigned i = upload_queue.size;
+	while (i--)
+	{
+		if (upload_queue.uploads[i].texture == tex) upload_remove(i);
+	}
+}
+
+/* Transfers at most `budget` bytes from the queue to the textures.
+   At least one row is transferred so big images always progress. */
+static void upload_process(unsigned budget)
+{
+	if (!upload_queue.size) return;
+	while (upload_queue.size && budget)
+	{
+		CT_Upload* upload = upload_queue.uploads;
+		CT_Texture* tex = upload->texture;
+		unsigned rows = budget / upload->row_size;
+		if (rows == 0) rows = 1;
+		if (rows > tex->h - upload->next_row)
+		{
+			rows = tex->h - upload->next_row;
+		}
+		unsigned bytes = rows * upload->row_size;
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->gl_pbo_id);
+		bind_texture(tex->gl_texture_id);
+		/* Rows are staged without padding */
+		unpack_rows(upload->row_size, upload->bpp);
+		glTexSubImage2D(GL_TEXTURE_2D, 0,
+				0, upload->next_row, tex->w, rows,
+				upload->format, GL_UNSIGNED_BYTE,
+				(void*)(size_t)(upload->next_row * upload->row_size));
+		upload->next_row += rows;
+		upload_queue.bytes -= bytes;
+		stats.frame.upload_bytes += bytes;
+		budget = bytes < budget ? budget - bytes : 0;
+		if (upload->next_row >= tex->h)
+		{
+			upload_remove(0);
+			texture_finished(tex);
+		}
+	}
+	unpack_reset();
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	CHECK_GL();
+}
+
+void ct_upload_budget_set(unsigned bytes)
+{
+	upload_budget = bytes;
+}
+
+unsigned ct_upload_budget()
+{
+	return upload_budget;
+}
+
+unsigned ct_upload_queue_depth()
+{
+	return upload_queue.size;
+}
+
+unsigned ct_upload_queue_bytes()
+{
+	return upload_queue.bytes;
+}
+
+int ct_is_texture_ready(CT_Texture* tex)
+{
+	unsigned i;
+	for (i=0; i<upload_queue.size; i++)
+	{
+		if (upload_queue.uploads[i].texture == tex) return 0;
+	}
+	return 1;
+}
+
+void ct_upload_flush()
+{
+	upload_process(upload_queue.bytes);
+}
+
+/* Readback */
+
+struct _CT_Readback
+{
+	unsigned w, h;
+	int is_flipped; /* The screen's rows are from the bottom */
+	GLuint gl_pbo_id;
+	GLsync gl_fence;
+	unsigned char* pixels;
+};
+
+static Pool readback_pool = POOL(CT_Readback, CT_MEMORY_IMAGE);
+
+CT_Readback* ct_readback_begin(CT_Texture* tex)
+{
+	size_t size = (size_t)tex->w * tex->h * 4;
+	CT_Readback* readback = pool_alloc(&readback_pool);
+	memset(readback, 0, sizeof(CT_Readback));
+	readback->w = tex->w;
+	readback->h = tex->h;
+	if (is_software())
+	{
+		const unsigned char* pixels = ct_texture_pixels(tex);
+		readback->pixels = smalloc_tag(size ? size : 4, CT_MEMORY_IMAGE);
+		memcpy(readback->pixels, pixels, size);
+		return readback;
+	}
+	readback->is_flipped = ct_is_texture_screen(tex);
+	glGenBuffers(1, &readback->gl_pbo_id);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->gl_pbo_id);
+	glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+	bind_framebuffer(GL_READ_FRAMEBUFFER, tex->gl_buffer_id);
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glReadPixels(0, 0, tex->w, tex->h, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	bind_framebuffer(GL_FRAMEBUFFER, current_target()->gl_buffer_id);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	/* Without fences the map simply waits. */
+	if (GLEW_ARB_sync)
+		readback->gl_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	vram_account(size);
+	if (glGetError() != GL_NO_ERROR)
+	{
+		ct_readback_free(readback);
+		ct_set_error("Could not read back the texture.");
+		return NULL;
+	}
+	return readback;
+}
+
+/* Copies the pixels out of the pixel buffer object once the fence has
+   passed, waiting at most `timeout` nanoseconds for it. Returns 0 when
+   the pixels are in. */
+static int readback_collect(CT_Readback* readback, GLuint64 timeout)
+{
+	if (readback->pixels) return 0;
+	if (readback->gl_fence)
+	{
+		GLenum status = glClientWaitSync(readback->gl_fence,
+						  GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+		if (status == GL_TIMEOUT_EXPIRED) return 1;
+		glDeleteSync(readback->gl_fence);
+		readback->gl_fence = NULL;
+	}
+	size_t row = (size_t)readback->w * 4, size = row * readback->h;
+	readback->pixels = smalloc_tag(size ? size : 4, CT_MEMORY_IMAGE);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback->gl_pbo_id);
+	const unsigned char* src = size ? glMapBufferRange(GL_PIXEL_PACK_BUFFER,
+						   0, size, GL_MAP_READ_BIT) : NULL;
+	unsigned y;
+	if (src)
+	{
+		for (y=0; y<readback->h; y++)
+		{
+			unsigned from = readback->is_flipped ? readback->h-1-y : y;
+			memcpy(readback->pixels + y*row, src + from*row, row);
+		}
+		glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	} else
+	{
+		memset(readback->pixels, 0, size);
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glDeleteBuffers(1, &readback->gl_pbo_id);
+	readback->gl_pbo_id = 0;
+	vram_account(-(long long)size);
+	CHECK_GL();
+	return 0;
+}
+
+const unsigned char* ct_readback_pixels(CT_Readback* readback)
+{
+	return readback_collect(readback, 0) ? NULL : readback->pixels;
+}
+
+const unsigned char* ct_readback_wait(CT_Readback* readback)
+{
+	while (readback_collect(readback, 1000000000));
+	return readback->pixels;
+}
+
+void ct_readback_size(CT_Readback* readback, unsigned* ret)
+{
+	ret[0] = readback->w;
+	ret[1] = readback->h;
+}
+
+void ct_readback_free(CT_Readback* readback)
+{
+	if (readback->gl_fence) glDeleteSync(readback->gl_fence);
+	if (readback->gl_pbo_id)
+	{
+		glDeleteBuffers(1, &readback->gl_pbo_id);
+		vram_account(-(long long)readback->w * readback->h * 4);
+	}
+	sfree(readback->pixels);
+	pool_free(&readback_pool, readback);
+}
+
+/* Capture */
+
+/* Readbacks in flight, the oldest is waited for past this. */
+#define CAPTURE_READBACKS 3
+
+/* Frames waiting for the encoder before ct_window_update waits too. */
+#define CAPTURE_QUEUE 16
+
+typedef struct _CT_CaptureFrame
+{
+	unsigned char* pixels;
+	unsigned w, h;
+	char* filename; /* NULL for raw frames */
+	struct _CT_CaptureFrame* next;
+} CT_CaptureFrame;
+
+static struct
+{
+	int is_on;
+	int is_single; /* A screenshot, `path` is the file */
+	char* path;
+	CT_CaptureFormat format;
+	FILE* file;
+	unsigned frame;
+	CT_Readback* readbacks[CAPTURE_READBACKS];
+	unsigned readback_count;
+	/* The encoder thread and what it shares, under `lock` */
+	SDL_Thread* thread;
+	SDL_mutex* lock;
+	SDL_cond* changed;
+	CT_CaptureFrame* first;
+	CT_CaptureFrame* last;
+	unsigned queued; /* Handed over, not yet written */
+	unsigned failed;
+	int is_quitting;
+} capture;
+
+static int capture_write(CT_CaptureFrame* frame)
+{
+	if (!frame->filename)
+	{
+		size_t size = (size_t)frame->w * frame->h * 4;
+		return fwrite(frame->pixels, 1, size, capture.file) != size;
+	}
+	SDL_Surface* sur = SDL_CreateRGBSurfaceWithFormatFrom(frame->pixels,
+		frame->w, frame->h, 32, frame->w * 4, SDL_PIXELFORMAT_RGBA32);
+	if (!sur) return 1;
+	int ret = IMG_SavePNG(sur, frame->filename) != 0;
+	SDL_FreeSurface(sur);
+	return ret;
+}
+
+static int capture_thread(void* data)
+{
+	SDL_LockMutex(capture.lock);
+	for (;;)
+	{
+		while (!capture.first && !capture.is_quitting)
+			SDL_CondWait(capture.changed, capture.lock);
+		if (!capture.first) break;
+		CT_CaptureFrame* frame = capture.first;
+		capture.first = frame->next;
+		if (!capture.first) capture.last = NULL;
+		SDL_UnlockMutex(capture.lock);
+		int failed = capture_write(frame);
+		sfree(frame->pixels);
+		sfree(frame->filename);
+		sfree(frame);
+		SDL_LockMutex(capture.lock);
+		capture.failed += failed;
+		capture.queued--;
+		SDL_CondBroadcast(capture.changed);
+	}
+	SDL_UnlockMutex(capture.lock);
+	return 0;
+}
+
+static int capture_thread_start()
+{
+	if (capture.thread) return 0;
+	capture.lock = SDL_CreateMutex();
+	capture.changed = SDL_CreateCond();
+	if (capture.lock && capture.changed)
+		capture.thread = SDL_CreateThread(capture_thread, "ct_capture", NULL);
+	if (!capture.thread)
+	{
+		if (capture.lock) SDL_DestroyMutex(capture.lock);
+		if (capture.changed) SDL_DestroyCond(capture.changed);
+		capture.lock = NULL;
+		capture.changed = NULL;
+		ct_set_error(SDL_GetError());
+		return 1;
+	}
+	return 0;
+}
+
+/* Waits until the encoder has at most `count` frames left. */
+static void capture_drain(unsigned count)
+{
+	SDL_LockMutex(capture.lock);
+	while (capture.queued > count)
+		SDL_CondWait(capture.changed, capture.lock);
+	SDL_UnlockMutex(capture.lock);
+}
+
+/* Gives the pixels of the oldest readback to the encoder. */
+static void capture_hand_over()
+{
+	CT_Readback* readback = capture.readbacks[0];
+	CT_CaptureFrame* frame = smalloc(sizeof(CT_CaptureFrame));
+	frame->pixels = readback->pixels;
+	frame->w = readback->w;
+	frame->h = readback->h;
+	frame->filename = NULL;
+	frame->next = NULL;
+	readback->pixels = NULL;
+	ct_readback_free(readback);
+	capture.readback_count--;
+	memmove(capture.readbacks, capture.readbacks + 1,
+		sizeof(CT_Readback*) * capture.readback_count);
+	if (capture.format == CT_CAPTURE_PNG)
+	{
+		size_t size = strlen(capture.path) + 32;
+		frame->filename = smalloc(size);
+		if (capture.is_single)
+			strcpy(frame->filename, capture.path);
+		else
+			snprintf(frame->filename, size, capture.path, capture.frame);
+		capture.frame++;
+	}
+	capture_drain(CAPTURE_QUEUE - 1);
+	SDL_LockMutex(capture.lock);
+	if (capture.last) capture.last->next = frame;
+	else capture.first = frame;
+	capture.last = frame;
+	capture.queued++;
+	SDL_CondBroadcast(capture.changed);
+	SDL_UnlockMutex(capture.lock);
+}
+
+/* Called by ct_window_update with what it shows, before it's swapped
+   away. Frames come out in order: only the oldest readback is taken. */
+static void capture_frame(CT_Texture* src)
+{
+	while (capture.readback_count &&
+	       ct_readback_pixels(capture.readbacks[0]))
+		capture_hand_over();
+	if (!capture.is_on) return;
+	if (capture.readback_count == CAPTURE_READBACKS)
+	{
+		ct_readback_wait(capture.readbacks[0]);
+		capture_hand_over();
+	}
+	CT_Readback* readback = ct_readback_begin(src);
+	if (!readback)
+	{
+		capture.failed++;
+		return;
+	}
+	capture.readbacks[capture.readback_count++] = readback;
+	if (capture.is_single) capture.is_on = 0;
+}
+
+/* Whether `path` is safe to give snprintf with the frame number: one
+   integer conversion of at most two digits wide, other percent signs
+   doubled. */
+static int is_capture_pattern(const char* path)
+{
+	unsigned conversions = 0;
+	for (; *path; path++)
+	{
+		if (*path != '%') continue;
+		path++;
+		if (*path == '%') continue;
+		while (*path && strchr("-+ #0", *path)) path++;
+		if (isdigit((unsigned char)*path)) path++;
+		if (isdigit((unsigned char)*path)) path++;
+		if (!*path || !strchr("diouxX", *path)) return 0;
+		conversions++;
+	}
+	return conversions == 1;
+}
+
+static int capture_begin(const char* path, CT_CaptureFormat format,
+			 int is_single)
+{
+	if (capture.is_on)
+	{
+		ct_set_error("A capture is already running.");
+		return 1;
+	}
+	if (format == CT_CAPTURE_PNG && !is_single && !is_capture_pattern(path))
+	{
+		/* No percent signs, the error is a format itself */
+		ct_set_error("The capture path needs exactly one frame "
+			     "number conversion.");
+		return 1;
+	}
+	if (capture_thread_start()) return 1;
+	/* The last capture's frames still take its path and file. */
+	ct_capture_stop();
+	if (format == CT_CAPTURE_RAW)
+	{
+		capture.file = fopen(path, "wb");
+		if (!capture.file)
+		{
+			ct_set_error("Could not open the capture file.");
+			return 1;
+		}
+	}
+	sfree(capture.path);
+	capture.path = smalloc(strlen(path) + 1);
+	strcpy(capture.path, path);
+	capture.format = format;
+	capture.is_single = is_single;
+	capture.frame = 0;
+	capture.failed = 0;
+	capture.is_on = 1;
+	return 0;
+}
+
+int ct_capture_start(const char* path, CT_CaptureFormat format)
+{
+	return capture_begin(path, format, 0);
+}
+
+int ct_capture_screenshot(const char* filename)
+{
+	return capture_begin(filename, CT_CAPTURE_PNG, 1);
+}
+
+int ct_capture_stop()
+{
+	capture.is_on = 0;
+	if (!capture.thread) return 0;
+	while (capture.readback_count)
+	{
+		ct_readback_wait(capture.readbacks[0]);
+		capture_hand_over();
+	}
+	capture_drain(0);
+	if (capture.file && fclose(capture.file) != 0) capture.failed++;
+	capture.file = NULL;
+	if (capture.failed)
+	{
+		ct_set_error("Some captured frames could not be written.");
+		return 1;
+	}
+	return 0;
+}
+
+int ct_is_capturing()
+{
+	return capture.is_on;
+}
+
+unsigned ct_capture_pending()
+{
+	unsigned queued = 0;
+	if (capture.thread)
+	{
+		SDL_LockMutex(capture.lock);
+		queued = capture.queued;
+		SDL_UnlockMutex(capture.lock);
+	}
+	return capture.readback_count + queued;
+}
+
+static void capture_quit()
+{
+	ct_capture_stop();
+	if (capture.thread)
+	{
+		SDL_LockMutex(capture.lock);
+		capture.is_quitting = 1;
+		SDL_CondBroadcast(capture.changed);
+		SDL_UnlockMutex(capture.lock);
+		SDL_WaitThread(capture.thread, NULL);
+		SDL_DestroyMutex(capture.lock);
+		SDL_DestroyCond(capture.changed);
+	}
+	sfree(capture.path);
+	memset(&capture, 0, sizeof(capture));
+}
+
+/* Target pool */
+
+/* Pooled targets nobody asked for in this many frames are freed. */
+#define TARGET_POOL_MAX_AGE 120
+
+typedef struct
+{
+	CT_Texture* texture;
+	int in_use;
+	int transient;
+	unsigned last_used;
+} CT_PooledTarget;
+
+static struct
+{
+	CT_PooledTarget* targets;
+	unsigned size;
+	unsigned capacity;
+	unsigned frame;
+} target_pool;
+
+static CT_Texture* target_pool_acquire(unsigned w, unsigned h, int transient)
+{
+	CT_PooledTarget* target = NULL;
+	unsigned i;
+	for (i=0; i<target_pool.size; i++)
+	{
+		CT_PooledTarget* t = target_pool.targets + i;
+		if (!t->in_use && t->texture->w == w && t->texture->h == h)
+		{
+			target = t;
+			break;
+		}
+	}
+	if (!target)
+	{
+		CT_Texture* tex = ct_texture_create(w, h);
+		if (!tex) return NULL;
+		if (target_pool.size >= target_pool.capacity)
+		{
+			target_pool.capacity = target_pool.capacity
+				? target_pool.capacity * 2 : 16;
+			target_pool.targets = srealloc(target_pool.targets,
+				sizeof(CT_PooledTarget) * target_pool.capacity);
+		}
+		target = target_pool.targets + target_pool.size++;
+		target->texture = tex;
+	} else
+	{
+		/* Undo whatever the previous user changed */
+		CT_Texture* tex = target->texture;
+		if (tex->filter != default_sampling.filter ||
+		    tex->wrap != default_sampling.wrap)
+		{
+			tex->wrap = default_sampling.wrap;
+			ct_texture_filter_set(tex, default_sampling.filter);
+		}
+	}
+	target->in_use    = 1;
+	target->transient = transient;
+	target->last_used = target_pool.frame;
+	return target->texture;
+}
+
+static void target_pool_release(CT_Texture* tex)
+{
+	unsigned i;
+	for (i=0; i<target_pool.size; i++)
+	{
+		if (target_pool.targets[i].texture == tex)
+		{
+			target_pool.targets[i].in_use = 0;
+			target_pool.targets[i].last_used = target_pool.frame;
+			return;
+		}
+	}
+}
+
+/* Takes back this frame's transient targets and frees targets
+   that have not been used for a while. */
+static void target_pool_recycle()
+{
+	target_pool.frame++;
+	unsigned i = target_pool.size;
+	while (i--)
+	{
+		CT_PooledTarget* t = target_pool.targets + i;
+		if (t->in_use && t->transient) t->in_use = 0;
+		if (!t->in_use && target_pool.frame - t->last_used > TARGET_POOL_MAX_AGE)
+		{
+			ct_texture_free(t->texture);
+			*t = target_pool.targets[--target_pool.size];
+		}
+	}
+}
+
+CT_Texture* ct_texture_transient(unsigned w, unsigned h)
+{
+	return target_pool_acquire(w, h, 1);
+}
+
+void ct_texture_transient_release(CT_Texture* tex)
+{
+	target_pool_release(tex);
+}
+
+unsigned ct_target_pool_size()
+{
+	return target_pool.size;
+}
+
+void ct_target_pool_clear()
+{
+	unsigned i = target_pool.size;
+	while (i--)
+	{
+		CT_PooledTarget* t = target_pool.targets + i;
+		if (t->in_use) continue;
+		ct_texture_free(t->texture);
+		*t = target_pool.targets[--target_pool.size];
+	}
+	if (!target_pool.size)
+	{
+		sfree(target_pool.targets);
+		target_pool.targets = NULL;
+		target_pool.capacity = 0;
+	}
+}
+
+/* Target */
+
+static struct
+{
+	CT_Texture* stack[CT_STACK_SIZE];
+	unsigned size;
+} target_stack;
+
+static CT_Texture* current_target()
+{
+	return target_stack.size
+		? target_stack.stack[target_stack.size-1]
+		: ct_screen_texture();
+}
+
+void ct_target_push(CT_Texture* tex)
+{
+	if (target_stack.size >= CT_STACK_SIZE)
+	{
+		/* Stack overflow, resetting stack to prevent
+		   crashing if this error is ignored. */
+		ct_set_error("Stack overflow");
+		target_stack.size = 0;
+	}
+	dirty_preserve(tex);
+	texture_bind(tex);
+	target_stack.stack[target_stack.size++] = tex;
+}
+
+void ct_target_pop()
+{
+	if (target_stack.size == 0)
+	{
+		/* Stack underflow, setting stack to one
+		   so it will set to default value if this
+		   error is ignored. */
+		ct_set_error("Stack underflow");
+		target_stack.size = 1;
+	}
+	target_stack.size--;
+	texture_contents_changed(target_stack.stack[target_stack.size]);
+	texture_bind(target_stack.size
+		     ? target_stack.stack[target_stack.size-1]
+		     : ct_screen_texture());
+}
+
+/* Post-processing */
+
+/* A pass shader with its uniforms resolved. */
+typedef struct
+{
+	CT_Shader* shader;
+	CT_Uniform texel;
+	CT_Uniform params;
+	CT_Uniform direction;
+} CT_PostFXProgram;
+
+typedef struct
+{
+	CT_PostFXEffect effect;
+	CT_PostFXProgram program; /* Only for CT_POSTFX_SHADER */
+	float scale;
+	float params[4];
+	int enabled;
+} CT_PostFXPass;
+
+struct _CT_PostFX
+{
+	CT_Texture* targets[2];
+	CT_PostFXPass passes[CT_POSTFX_MAX_PASSES];
+	unsigned size;
+	CT_Texture* result;
+};
+
+/* Nine tap gaussian in five fetches, leaning on linear filtering. */
+static const char* postfx_blur_source =
+	"#version 330\n"
+	"uniform sampler2D texture; "
+	"uniform vec2 texel; "
+	"uniform vec4 params; "
+	"uniform vec2 direction; "
+	"in vec4 f_colour; "
+	"in vec2 f_coord; "
+	"out vec4 fragment; "
+	"void main() { "
+		"vec2 s = direction * texel * params.x; "
+		"vec4 sum = texture2D(texture, f_coord) * 0.2270270270; "
+		"sum += texture2D(texture, f_coord + s * 1.3846153846) * 0.3162162162; "
+		"sum += texture2D(texture, f_coord - s * 1.3846153846) * 0.3162162162; "
+		"sum += texture2D(texture, f_coord + s * 3.2307692308) * 0.0702702703; "
+		"sum += texture2D(texture, f_coord - s * 3.2307692308) * 0.0702702703; "
+		"fragment = sum * f_colour; "
+	"}";
+
+static const char* postfx_bright_source =
+	"#version 330\n"
+	"uniform sampler2D texture; "
+	"uniform vec4 params; "
+	"in vec4 f_colour; "
+	"in vec2 f_coord; "
+	"out vec4 fragment; "
+	"void main() { "
+		"vec4 c = texture2D(texture, f_coord); "
+		"float l = dot(c.rgb, vec3(0.2126, 0.7152, 0.0722)); "
+		"fragment = c * clamp((l - params.x) / max(1.0 - params.x, 0.0001), 0.0, 1.0); "
+	"}";
+
+static const char* postfx_grade_source =
+	"#version 330\n"
+	"uniform sampler2D texture; "
+	"uniform vec4 params; "
+	"in vec4 f_colour; "
+	"in vec2 f_coord; "
+	"out vec4 fragment; "
+	"void main() { "
+		"vec4 c = texture2D(texture, f_coord); "
+		"vec3 rgb = (c.rgb + params.x - 0.5) * params.y + 0.5; "
+		"float l = dot(rgb, vec3(0.2126, 0.7152, 0.0722)); "
+		"rgb = mix(vec3(l), rgb, params.z); "
+		"fragment = vec4(clamp(rgb, 0.0, 1.0), c.a) * f_colour; "
+	"}";
+
+static const char* postfx_crt_source =
+	"#version 330\n"
+	"uniform sampler2D texture; "
+	"uniform vec2 texel; "
+	"uniform vec4 params; "
+	"in vec4 f_colour; "
+	"in vec2 f_coord; "
+	"out vec4 fragment; "
+	"void main() { "
+		"vec2 uv = f_coord * 2.0 - 1.0; "
+		"uv *= 1.0 + params.x * dot(uv, uv); "
+		"vec2 edge = step(vec2(1.0), abs(uv)); "
+		"uv = uv * 0.5 + 0.5; "
+		"vec4 c = texture2D(texture, uv); "
+		"float scan = sin(uv.y / texel.y * 3.14159265); "
+		"c.rgb *= 1.0 - params.y * (1.0 - scan * scan); "
+		"vec2 v = uv - 0.5; "
+		"c.rgb *= clamp(1.0 - params.z * dot(v, v) * 2.0, 0.0, 1.0); "
+		"fragment = mix(c, vec4(0, 0, 0, 1), max(edge.x, edge.y)) * f_colour; "
+	"}";
+
+enum
+{
+	POSTFX_SHADER_BLUR,
+	POSTFX_SHADER_BRIGHT,
+	POSTFX_SHADER_GRADE,
+	POSTFX_SHADER_CRT,
+	POSTFX_SHADER_COUNT
+};
+
+static void postfx_program_init(CT_PostFXProgram* program, CT_Shader* shader)
+{
+	program->shader    = shader;
+	program->texel     = ct_shader_uniform(shader, "texel");
+	program->params    = ct_shader_uniform(shader, "params");
+	program->direction = ct_shader_uniform(shader, "direction");
+}
+
+/* Built-in shaders, compiled on first use. */
+static CT_PostFXProgram postfx_programs[POSTFX_SHADER_COUNT];
+
+static CT_PostFXProgram* postfx_program(unsigned index)
+{
+	static const char** sources[POSTFX_SHADER_COUNT] = {
+		&postfx_blur_source,
+		&postfx_bright_source,
+		&postfx_grade_source,
+		&postfx_crt_source
+	};
+	CT_PostFXProgram* program = postfx_programs + index;
+	if (!program->shader)
+	{
+		CT_Shader* shader = shader_create(vertex_shader_source,
+						  *sources[index]);
+		if (!shader) return NULL;
+		postfx_program_init(program, shader);
+	}
+	return program;
+}
+
+static void postfx_shaders_free()
+{
+	unsigned i;
+	for (i=0; i<POSTFX_SHADER_COUNT; i++)
+	{
+		if (postfx_programs[i].shader) shader_free(postfx_programs[i].shader);
+		postfx_programs[i].shader = NULL;
+	}
+}
+
+/* Draws all of `src` over all of the current target. */
+static void postfx_draw(CT_PostFXProgram* program, CT_Texture* src,
+			float* colour, float* params, float* direction)
+{
+	static float data[16] = {
+		0, 0, 0, 0,
+		1, 0, 1, 0,
+		1, 1, 1, 1,
+		0, 1, 0, 1 };
+	CT_Shader* shader = program->shader;
+	float texel[2] = { 1.0f / src->w, 1.0f / src->h };
+	shader_prepare(shader, matrix_identity, colour);
+	ct_shader_uniform_vec2(shader, program->texel, texel);
+	if (params)
+		ct_shader_uniform_vec4(shader, program->params, params);
+	if (direction)
+		ct_shader_uniform_vec2(shader, program->direction, direction);
+	bind_texture(src->gl_texture_id);
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 16, data);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 16, data+2);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, rect_index_order);
+	stats_draw(1);
+	CHECK_GL();
+}
+
+/* Renders `src` into `dst` with a single draw. */
+static void postfx_pass(CT_PostFXProgram* program, CT_Texture* src,
+			CT_Texture* dst, float* params, float* direction)
+{
+	if (!program) return;
+	ct_target_push(dst);
+	postfx_draw(program, src, colour_white, params, direction);
+	ct_target_pop();
+}
+
+static CT_Texture* postfx_transient(unsigned w, unsigned h)
+{
+	CT_Texture* tex = ct_texture_transient(w ? w : 1, h ? h : 1);
+	if (!tex) return NULL;
+	tex->wrap = CT_TEXTURE_WRAP_CLAMP;
+	ct_texture_filter_set(tex, CT_TEXTURE_FILTER_LINEAR);
+	return tex;
+}
+
+/* Where a pass at `scale` writes when it reads `src`. */
+static CT_Texture* postfx_destination(CT_PostFX* fx, CT_Texture* src, float scale)
+{
+	if (scale < 1)
+	{
+		return postfx_transient(fx->targets[0]->w * scale,
+					fx->targets[0]->h * scale);
+	}
+	return src == fx->targets[0] ? fx->targets[1] : fx->targets[0];
+}
+
+/* Transient intermediates go back to the pool as soon as they are read. */
+static void postfx_done_with(CT_PostFX* fx, CT_Texture* tex)
+{
+	if (tex != fx->targets[0] && tex != fx->targets[1])
+		ct_texture_transient_release(tex);
+}
+
+/* Horizontal then vertical pass, the first one into a scratch target of
+   the same size as `dst`. */
+static void postfx_blur(CT_Texture* src, CT_Texture* dst, float radius)
+{
+	float params[4] = { radius, 0, 0, 0 };
+	float horizontal[2] = { 1, 0 };
+	float vertical[2] = { 0, 1 };
+	CT_PostFXProgram* program = postfx_program(POSTFX_SHADER_BLUR);
+	CT_Texture* tmp = postfx_transient(dst->w, dst->h);
+	if (!program || !tmp) return;
+	postfx_pass(program, src, tmp, params, horizontal);
+	postfx_pass(program, tmp, dst, params, vertical);
+	ct_texture_transient_release(tmp);
+}
+
+/* Bright parts are extracted and blurred at the pass's scale, then added
+   on top of the source at the chain's resolution. */
+static CT_Texture* postfx_bloom(CT_PostFX* fx, CT_Texture* src, CT_PostFXPass* pass)
+{
+	CT_Texture* full = src == fx->targets[0] ? fx->targets[1] : fx->targets[0];
+	CT_Texture* bright = postfx_transient(full->w * pass->scale,
+					      full->h * pass->scale);
+	CT_PostFXProgram* program = postfx_program(POSTFX_SHADER_BRIGHT);
+	if (!bright || !program) return src;
+	postfx_pass(program, src, bright, pass->params, NULL);
+	postfx_blur(bright, bright, pass->params[1]);
+
+	float intensity[4] = {
+		pass->params[2], pass->params[2], pass->params[2], pass->params[2] };
+	CT_PostFXProgram copy = { _default_shader, -1, -1, -1 };
+	ct_target_push(full);
+	postfx_draw(&copy, src, colour_white, NULL, NULL);
+	ct_blend_mode_push(CT_BLEND_MODE_ONE_ONE);
+	postfx_draw(&copy, bright, intensity, NULL, NULL);
+	ct_blend_mode_pop();
+	ct_target_pop();
+	ct_texture_transient_release(bright);
+	return full;
+}
+
+CT_PostFX* ct_postfx_create(unsigned w, unsigned h)
+{
+	CT_PostFX* fx = smalloc(sizeof(CT_PostFX));
+	unsigned i;
+	for (i=0; i<2; i++)
+	{
+		fx->targets[i] = ct_texture_create(w, h);
+		if (!fx->targets[i])
+		{
+			if (i) ct_texture_free(fx->targets[0]);
+			sfree(fx);
+			return NULL;
+		}
+		fx->targets[i]->wrap = CT_TEXTURE_WRAP_CLAMP;
+		ct_texture_filter_set(fx->targets[i], CT_TEXTURE_FILTER_LINEAR);
+	}
+	fx->size = 0;
+	fx->result = fx->targets[0];
+	return fx;
+}
+
+void ct_postfx_free(CT_PostFX* fx)
+{
+	unsigned i;
+	for (i=0; i<fx->size; i++)
+	{
+		if (fx->passes[i].program.shader)
+			shader_free(fx->passes[i].program.shader);
+	}
+	ct_texture_free(fx->targets[0]);
+	ct_texture_free(fx->targets[1]);
+	sfree(fx);
+}
+
+static int postfx_add(CT_PostFX* fx, CT_PostFXEffect effect, CT_Shader* shader,
+		      float scale, float* params)
+{
+	static float defaults[][4] = {
+		{ 1, 0, 0, 0 },
+		{ .7, 1, 1, 0 },
+		{ 0, 1, 1, 0 },
+		{ .1, .3, .5, 0 },
+		{ 0, 0, 0, 0 }
+	};
+	if (fx->size >= CT_POSTFX_MAX_PASSES)
+	{
+		ct_set_error("Too many post-processing passes.");
+		return -1;
+	}
+	CT_PostFXPass* pass = fx->passes + fx->size;
+	pass->effect  = effect;
+	if (shader) postfx_program_init(&pass->program, shader);
+	else pass->program.shader = NULL;
+	pass->scale   = scale > 0 && scale < 1 ? scale : 1;
+	pass->enabled = 1;
+	memcpy(pass->params, params ? params : defaults[effect], sizeof(float)*4);
+	return fx->size++;
+}
+
+int ct_postfx_add(CT_PostFX* fx, CT_PostFXEffect effect, float scale, float* params)
+{
+	if (effect == CT_POSTFX_SHADER)
+	{
+		ct_set_error("Use ct_postfx_add_shader for custom shaders.");
+		return -1;
+	}
+	return postfx_add(fx, effect, NULL, scale, params);
+}
+
+int ct_postfx_add_shader(CT_PostFX* fx, const char* fragment_source,
+			 float scale, float* params)
+{
+	CT_Shader* shader = shader_create(vertex_shader_source, fragment_source);
+	if (!shader)
+	{
+		ct_set_error("Could not create post-processing shader.");
+		return -1;
+	}
+	int index = postfx_add(fx, CT_POSTFX_SHADER, shader, scale, params);
+	if (index < 0) shader_free(shader);
+	return index;
+}
+
+void ct_postfx_params_set(CT_PostFX* fx, unsigned pass, float* params)
+{
+	if (pass < fx->size)
+		memcpy(fx->passes[pass].params, params, sizeof(float)*4);
+}
+
+void ct_postfx_enabled_set(CT_PostFX* fx, unsigned pass, int enabled)
+{
+	if (pass < fx->size)
+		fx->passes[pass].enabled = enabled;
+}
+
+void ct_postfx_begin(CT_PostFX* fx)
+{
+	ct_target_push(fx->targets[0]);
+}
+
+CT_Texture* ct_postfx_end(CT_PostFX* fx)
+{
+	ct_target_pop();
+	CT_Texture* src = fx->targets[0];
+	/* Pass shaders don't run in software, the scene stays as drawn. */
+	if (is_software())
+	{
+		fx->result = src;
+		return src;
+	}
+	ct_blend_mode_push(CT_BLEND_MODE_NORMAL);
+	unsigned i;
+	for (i=0; i<fx->size; i++)
+	{
+		CT_PostFXPass* pass = fx->passes + i;
+		if (!pass->enabled) continue;
+		CT_Texture* dst;
+		if (pass->effect == CT_POSTFX_BLOOM)
+		{
+			dst = postfx_bloom(fx, src, pass);
+		} else
+		{
+			dst = postfx_destination(fx, src, pass->scale);
+			if (!dst) continue;
+			switch (pass->effect)
+			{
+			case CT_POSTFX_BLUR:
+				postfx_blur(src, dst, pass->params[0]);
+				break;
+			case CT_POSTFX_COLOUR_GRADE:
+				postfx_pass(postfx_program(POSTFX_SHADER_GRADE),
+					    src, dst, pass->params, NULL);
+				break;
+			case CT_POSTFX_CRT:
+				postfx_pass(postfx_program(POSTFX_SHADER_CRT),
+					    src, dst, pass->params, NULL);
+				break;
+			default:
+				postfx_pass(&pass->program, src, dst, pass->params, NULL);
+				break;
+			}
+		}
+		if (dst != src) postfx_done_with(fx, src);
+		src = dst;
+	}
+	ct_blend_mode_pop();
+	fx->result = src;
+	return src;
+}
+
+/* Batch */
+
+static Pool batch_pool = POOL(CT_Batch, CT_MEMORY_BATCH);
+
+CT_Batch* ct_batch_create(unsigned size_hint)
+{
+	CT_Batch* batch = pool_alloc(&batch_pool);
+	batch->vector  = dv_vector_new(16, size_hint);
+	batch->version        = next_version();
+	batch->baked          = NULL;
+	batch->baked_capacity = 0;
+	batch->baked_version  = 0;
+	batch->is_baked       = 0;
+	batch->indices = smalloc_tag(sizeof(unsigned short)*size_hint*6,
+				     CT_MEMORY_INDICES);
+	unsigned i;
+	for (i=0; i<size_hint; i++) {
+		batch->indices[(i*6)+0] = 0 + (i*4);
+		batch->indices[(i*6)+1] = 1 + (i*4);
+		batch->indices[(i*6)+2] = 2 + (i*4);
+		batch->indices[(i*6)+3] = 0 + (i*4);
+		batch->indices[(i*6)+4] = 2 + (i*4);
+		batch->indices[(i*6)+5] = 3 + (i*4);
+	}
+	return batch;
+}
+
+void ct_batch_free(CT_Batch* batch)
+{
+	layer_forget(&batch->version);
+	dv_vector_free(batch->vector);
+	sfree(batch->indices);
+	sfree(batch->baked);
+	pool_free(&batch_pool, batch);
+}
+
+unsigned ct_batch_push(CT_Batch* batch, CT_Transformation* trans)
+{
+	
+	unsigned grown_by;
+	float data[16]; vertex_data(trans, data);
+	unsigned id = dv_vector_push(batch->vector, data, &grown_by);
+	batch->version = next_version();
+	/* If vector has grown, grow indices array with it. */
+	if (grown_by)
+	{
+		unsigned size = dv_vector_current_capacity(batch->vector);
+		batch->indices = srealloc(batch->indices, 
+					  sizeof(unsigned short)*size*6);
+		unsigned i;
+		/* Populate new indicies */
+		for (i=size-grown_by; i<size; i++) {
+			batch->indices[(i*6)+0] = 0 + (i*4);
+			batch->indices[(i*6)+1] = 1 + (i*4);
+			batch->indices[(i*6)+2] = 2 + (i*4);
+			batch->indices[(i*6)+3] = 0 + (i*4);
+			batch->indices[(i*6)+4] = 2 + (i*4);
+			batch->indices[(i*6)+5] = 3 + (i*4);
+		}
+	}
+	return id;
+}
+
+void ct_batch_remove(CT_Batch* batch, unsigned id)
+{
+	dv_vector_remove(batch->vector, id);
+	batch->version = next_version();
+}
+
+void ct_batch_change(CT_Batch* batch, unsigned id, CT_Transformation* trans)
+{
+	vertex_data(trans, dv_vector_ref(batch->vector, id));
+	batch->version = next_version();
+}
+
+static float* current_affine();
+
+static void affine_to_matrix(const float* m, float* r);
+
+static void batch_bounds(const float* data, unsigned count, unsigned stride,
+			 float* rect)
+{
+	rect[0] = rect[2] =  INFINITY;
+	rect[1] = rect[3] = -INFINITY;
+	unsigned i;
+	for (i=0; i<count; i++, data+=stride)
+	{
+		if (data[0] < rect[0]) rect[0] = data[0];
+		if (data[0] > rect[1]) rect[1] = data[0];
+		if (data[1] < rect[2]) rect[2] = data[1];
+		if (data[1] > rect[3]) rect[3] = data[1];
+	}
+	if (!count) rect[0] = rect[1] = rect[2] = rect[3] = 0;
+}
+
+/* Gathers the positions into `baked` and transforms them there. The
+   texture coordinates are still read from the vector. */
+static void batch_bake(CT_Batch* batch)
+{
+	DV_Vector* vector = batch->vector;
+	unsigned count = vector->size * 4;
+	if (count*2 > batch->baked_capacity)
+	{
+		batch->baked_capacity = dv_vector_current_capacity(vector) * 8;
+		sfree(batch->baked);
+		batch->baked = smalloc_tag(sizeof(float) * batch->baked_capacity,
+					   CT_MEMORY_BATCH);
+	}
+	unsigned i;
+	for (i=0; i<count; i++)
+	{
+		batch->baked[i*2+0] = vector->data[i*4+0];
+		batch->baked[i*2+1] = vector->data[i*4+1];
+	}
+	hpmMat4Vec2ArrayMult(current_matrix(), batch->baked, count);
+	batch_bounds(batch->baked, count, 2, batch->bounds);
+	memcpy(batch->baked_transform, current_affine(), sizeof(float)*6);
+	batch->baked_version = batch->version;
+}
+
+static int batch_is_bake_stale(CT_Batch* batch)
+{
+	return batch->baked_version != batch->version ||
+		memcmp(batch->baked_transform, current_affine(), sizeof(float)*6);
+}
+
+void ct_batch_bake(CT_Batch* batch)
+{
+	batch->is_baked = 1;
+	if (batch_is_bake_stale(batch)) batch_bake(batch);
+}
+
+void ct_batch_unbake(CT_Batch* batch)
+{
+	batch->is_baked = 0;
+	sfree(batch->baked);
+	batch->baked = NULL;
+	batch->baked_capacity = 0;
+	batch->baked_version  = 0;
+}
+
+void ct_batch_bounds(CT_Batch* batch, float* rect)
+{
+	if (batch->is_baked)
+	{
+		memcpy(rect, batch->bounds, sizeof(float)*4);
+	} else
+	{
+		batch_bounds(batch->vector->data, batch->vector->size*4, 4, rect);
+	}
+}
+
+static int dirty_record_batch(CT_Batch* batch, CT_Texture* atlas);
+
+void ct_batch_render(CT_Batch* batch, CT_Texture* atlas)
+{
+	CT_PROFILE_BEGIN("ct_batch_render");
+	DV_Vector* vector = batch->vector;
+	layer_depend(&batch->version);
+	layer_depend(&atlas->version);
+	if (dirty_record_batch(batch, atlas))
+	{
+		CT_PROFILE_END();
+		return;
+	}
+	if (batch->is_baked)
+	{
+		if (batch_is_bake_stale(batch)) batch_bake(batch);
+		draw_quads(current_shader(), matrix_identity, current_colour(),
+			   atlas, batch->baked, 8, vector->data+2,
+			   vector->size, batch->indices);
+	} else
+	{
+		draw_quads(current_shader(), current_matrix(), current_colour(),
+			   atlas, vector->data, 16, vector->data+2,
+			   vector->size, batch->indices);
+	}
+	CT_PROFILE_END();
+}
+
+unsigned ct_batch_size(CT_Batch* batch)
+{
+	return batch->vector->size;
+}
+
+/* Cached layers */
+
+typedef struct
+{
+	const unsigned* version;
+	unsigned value;
+} CT_LayerDependency;
+
+struct _CT_Layer
+{
+	CT_Texture* texture;
+	CT_LayerDependency* dependencies;
+	unsigned dependency_count;
+	unsigned dependency_capacity;
+	int is_valid;
+	struct _CT_Layer* next; /* All layers, see layer_forget */
+};
+
+static CT_Layer* first_layer = NULL;
+
+/* Layers being drawn, innermost last. */
+static struct
+{
+	CT_Layer* stack[CT_STACK_SIZE];
+	unsigned size;
+} layer_stack;
+
+static int layer_has_dependency(CT_Layer* layer, const unsigned* version)
+{
+	/* Recent ones first, draws tend to repeat */
+	unsigned i = layer->dependency_count;
+	while (i--)
+	{
+		if (layer->dependencies[i].version == version) return 1;
+	}
+	return 0;
+}
+
+/* What is drawn into a layer is drawn into the layers around it too,
+   so they depend on it as well. */
+static void layer_depend(const unsigned* version)
 {
-	void* pixels = image->sdl_surface->pixels;
-	unsigned w = image->sdl_surface->w;
-	unsigned h = image->sdl_surface->h;
-	CT_Texture* tex = new_texture(w, h);
-	glBindTexture(GL_TEXTURE_2D, tex->gl_texture_id);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8,
-		     w, h,
-		     0, format, GL_UNSIGNED_BYTE, pixels);
-	return tex;
+	unsigned i;
+	for (i=0; i<layer_stack.size; i++)
+	{
+		CT_Layer* layer = layer_stack.stack[i];
+		if (layer_has_dependency(layer, version)) continue;
+		if (layer->dependency_count >= layer->dependency_capacity)
+		{
+			layer->dependency_capacity = layer->dependency_capacity
+				? layer->dependency_capacity * 2 : 16;
+			layer->dependencies = srealloc(layer->dependencies,
+				sizeof(CT_LayerDependency) * layer->dependency_capacity);
+		}
+		CT_LayerDependency* dep = layer->dependencies + layer->dependency_count++;
+		dep->version = version;
+		dep->value   = *version;
+	}
 }
 
-CT_Texture* ct_image_to_texture(CT_Image* image)
+/* Called before the texture or batch owning `version` is freed. Layers
+   it was drawn into are invalidated and lose the dependency, so none
+   keeps pointing into the freed pool slot. */
+static void layer_forget(const unsigned* version)
 {
-	return texture_init(image, ct_image_gl_format(image));
+	CT_Layer* layer;
+	for (layer=first_layer; layer; layer=layer->next)
+	{
+		unsigned i = layer->dependency_count;
+		while (i--)
+		{
+			if (layer->dependencies[i].version != version) continue;
+			layer->dependencies[i] =
+				layer->dependencies[--layer->dependency_count];
+			layer->is_valid = 0;
+		}
+	}
 }
 
-CT_Texture* ct_texture_create(unsigned w, unsigned h)
+static int layer_is_stale(CT_Layer* layer)
 {
-	CT_Image* image = ct_image_create(w, h);
-	CT_Texture* tex = ct_image_to_texture(image);
-	if (!image) return NULL; /* ct_image_create already prints error message. */
-	ct_image_free(image);
-	return tex;
+	if (!layer->is_valid) return 1;
+	unsigned i;
+	for (i=0; i<layer->dependency_count; i++)
+	{
+		CT_LayerDependency* dep = layer->dependencies + i;
+		if (*dep->version != dep->value) return 1;
+	}
+	return 0;
 }
 
-CT_Texture* ct_texture_load(const char* filename)
+CT_Layer* ct_layer_create(unsigned w, unsigned h)
 {
-	CT_Image* image = ct_image_load(filename);
-	if (!image) return NULL; /* ct_image_load already prints error message. */
-	CT_Texture* tex = ct_image_to_texture(image);
-	ct_image_free(image);
-	return tex;
+	CT_Texture* tex = target_pool_acquire(w, h, 0);
+	if (!tex) return NULL;
+	CT_Layer* layer = smalloc(sizeof(CT_Layer));
+	layer->texture = tex;
+	layer->dependencies = NULL;
+	layer->dependency_count = 0;
+	layer->dependency_capacity = 0;
+	layer->is_valid = 0;
+	layer->next = first_layer;
+	first_layer = layer;
+	return layer;
 }
 
-CT_Texture* ct_texture_copy(CT_Texture* texture)
+void ct_layer_free(CT_Layer* layer)
 {
-	/* TODO */
-	CT_Texture* tex = ct_texture_create(texture->w, texture->h);
-	/**/
-	CT_Transformation trans = {
-		{ 0, 1, 0, 1 },
-		{ 0, 1, 0, 1 },
-		{ 0, 0 }, 0,
-		-1, -1 };
-	float idem[16]; hpmIdentityMat4(idem);
-	float pos[] = {0, 0};
-	push_everything(tex, 
-			colour_white, 
-			pos, 1, 0,
-			CT_BLEND_MODE_NORMAL);
-	ct_texture_render(texture, &trans);
-	pop_everything();
-	return tex;
+	CT_Layer** link = &first_layer;
+	while (*link != layer) link = &(*link)->next;
+	*link = layer->next;
+	target_pool_release(layer->texture);
+	sfree(layer->dependencies);
+	sfree(layer);
 }
 
-void ct_texture_free(CT_Texture* tex)
+int ct_layer_begin(CT_Layer* layer)
 {
-	glDeleteTextures(1, &tex->gl_texture_id);
-	glDeleteBuffers(1, &tex->gl_buffer_id);
-	CHECK_GL();
-	free(tex);
+	if (!layer_is_stale(layer)) return 0;
+	if (layer_stack.size >= CT_STACK_SIZE)
+	{
+		ct_set_error("Stack overflow");
+		return 0;
+	}
+	layer->dependency_count = 0;
+	layer->is_valid = 0;
+	layer_stack.stack[layer_stack.size++] = layer;
+	ct_target_push(layer->texture);
+	float transparent[4] = { 0, 0, 0, 0 };
+	target_clear(transparent);
+	return 1;
 }
 
-int ct_is_texture_screen(CT_Texture* tex)
+void ct_layer_end(CT_Layer* layer)
 {
-	return tex->gl_buffer_id == 0;
+	if (layer_stack.size == 0 ||
+	    layer_stack.stack[layer_stack.size-1] != layer)
+	{
+		ct_set_error("Layer ended out of order.");
+		return;
+	}
+	layer_stack.size--;
+	ct_target_pop();
+	layer->is_valid = 1;
 }
 
-void ct_texture_size(CT_Texture* tex, float* vect)
+void ct_layer_invalidate(CT_Layer* layer)
 {
-	if (ct_is_texture_screen(tex)) {
-	}
-	vect[0] = (float)tex->w;
-	vect[1] = (float)tex->h;
+	layer->is_valid = 0;
 }
 
-static float project_matrix[16];
-
-static void texture_bind(CT_Texture* tex)
+int ct_is_layer_valid(CT_Layer* layer)
 {
-	glViewport(0, 0, tex->w, tex->h);
-	hpmOrthoFloat(1, ct_is_texture_screen(tex) ? -1 : 1, -100, 100, project_matrix);
-	/* Put origin origin at 0,0 */
-	hpmTranslation(-.5, -.5, 0, project_matrix);
-	hpmScale2D(2, ct_is_texture_screen(tex) ? -2 : 2, project_matrix);
-	shader_upload_projection_matrix(current_shader(), project_matrix);
-	glBindFramebuffer(GL_FRAMEBUFFER, tex->gl_buffer_id);
-	CHECK_GL();
+	return !layer_is_stale(layer);
 }
 
+CT_Texture* ct_layer_texture(CT_Layer* layer)
+{
+	return layer->texture;
+}
 
-void ct_target_push(CT_Texture* tex);
+/* Dirty rectangles */
 
-void ct_target_pop();
+/* More damaged regions than this are merged into their bounding box. */
+#define DAMAGE_MAX_RECTS 8
 
-void ct_texture_clear(CT_Texture* tex, float* colour)
+enum
 {
-	ct_target_push(tex);
-	glClearBufferfv(GL_COLOR, 0, colour);
-	ct_target_pop();
-	CHECK_GL();
-}
+	DRAW_CLEAR,
+	DRAW_TEXTURE,
+	DRAW_BATCH
+};
 
-static GLushort rect_index_order[] = { 0, 1, 2, 0, 2, 3 };
+typedef struct
+{
+	int type;
+	CT_Shader* shader;
+	CT_Texture* texture;
+	CT_Batch* batch; /* Only signed, it may change before the replay */
+	float* vertices; /* The batch's quads as they were recorded */
+	unsigned short* indices;
+	unsigned quads;
+	CT_BlendMode blend;
+	float colour[4];
+	float transform[6];
+	float data[16]; /* Vertices, or the colour of a clear */
+	int bounds[4];  /* Pixels: left, right, top, bottom */
+	unsigned long long signature;
+} CT_DrawCommand;
+
+/* Lives in the frame arena of the frame it records. */
+typedef struct
+{
+	CT_DrawCommand* commands;
+	unsigned size;
+	unsigned capacity;
+} CT_DrawList;
 
-static void vertex_data(CT_Transformation* tran, float* data);
+static struct
+{
+	int enabled;
+	CT_DrawList lists[2];
+	unsigned current;
+	CT_Texture* back_buffer;
+	int rects[DAMAGE_MAX_RECTS][4];
+	unsigned rect_count;
+	int is_all_damaged;
+	unsigned area;
+} dirty;
 
-static float* current_matrix();
+static float affine_identity[6] = { 1, 0, 0, 1, 0, 0 };
 
-void ct_texture_render(CT_Texture* tex, CT_Transformation* trans)
+static int dirty_is_recording()
 {
-	float data[16]; vertex_data(trans, data);
-	glUseProgram(current_shader()->gl_program_id);
-	glBindTexture(GL_TEXTURE_2D, tex->gl_texture_id);
-	shader_upload_modelview_matrix(current_shader(), current_matrix());
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 16, data);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 16, data+2);
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, rect_index_order);
-	CHECK_GL();
+	return dirty.enabled && ct_is_texture_screen(current_target());
 }
 
-/* Target */
+static CT_DrawCommand* dirty_command(int type, CT_Texture* tex)
+{
+	CT_DrawList* list = dirty.lists + dirty.current;
+	if (list->size >= list->capacity)
+	{
+		/* The arena can't grow in place, the old array is
+		   reclaimed with the rest of the frame. */
+		CT_DrawCommand* old = list->commands;
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->commands = ct_frame_alloc(sizeof(CT_DrawCommand) * list->capacity);
+		if (old) memcpy(list->commands, old, sizeof(CT_DrawCommand) * list->size);
+	}
+	CT_DrawCommand* cmd = list->commands + list->size++;
+	cmd->type    = type;
+	cmd->shader  = current_shader();
+	cmd->texture = tex;
+	cmd->batch   = NULL;
+	cmd->vertices = NULL;
+	cmd->indices  = NULL;
+	cmd->quads    = 0;
+	cmd->blend   = current_blend_mode();
+	memcpy(cmd->colour, current_colour(), sizeof(float)*4);
+	memcpy(cmd->transform, current_affine(), sizeof(float)*6);
+	return cmd;
+}
+
+/* Everything that affects the pixels a command produces. */
+static void dirty_sign(CT_DrawCommand* cmd)
+{
+	unsigned versions[2] = {
+		cmd->texture ? cmd->texture->version : 0,
+		cmd->batch ? cmd->batch->version : 0 };
+	unsigned long long hash = FNV1A_SEED;
+	hash = fnv1a(&cmd->type, sizeof(cmd->type), hash);
+	hash = fnv1a(&cmd->shader, sizeof(cmd->shader), hash);
+	hash = fnv1a(&cmd->texture, sizeof(cmd->texture), hash);
+	hash = fnv1a(&cmd->batch, sizeof(cmd->batch), hash);
+	hash = fnv1a(versions, sizeof(versions), hash);
+	hash = fnv1a(&cmd->blend, sizeof(cmd->blend), hash);
+	hash = fnv1a(cmd->colour, sizeof(cmd->colour), hash);
+	hash = fnv1a(cmd->transform, sizeof(cmd->transform), hash);
+	hash = fnv1a(cmd->data, sizeof(cmd->data), hash);
+	cmd->signature = hash;
+}
+
+/* Screen pixels covered by `count` points, transformed by the command,
+   with a pixel to spare for filtering. */
+static void dirty_bounds(CT_DrawCommand* cmd, const float* points,
+			 unsigned count, unsigned stride)
+{
+	CT_Texture* screen = ct_screen_texture();
+	float* m = cmd->transform;
+	float l = INFINITY, r = -INFINITY, t = INFINITY, b = -INFINITY;
+	unsigned i;
+	for (i=0; i<count; i++, points+=stride)
+	{
+		float x = m[0]*points[0] + m[2]*points[1] + m[4];
+		float y = m[1]*points[0] + m[3]*points[1] + m[5];
+		if (x < l) l = x;
+		if (x > r) r = x;
+		if (y < t) t = y;
+		if (y > b) b = y;
+	}
+	cmd->bounds[0] = floor(l * screen->w) - 1;
+	cmd->bounds[1] = ceil(r * screen->w) + 1;
+	cmd->bounds[2] = floor(t * screen->h) - 1;
+	cmd->bounds[3] = ceil(b * screen->h) + 1;
+}
+
+static int dirty_record_clear(float* colour)
+{
+	if (!dirty.enabled) return 0;
+	CT_DrawCommand* cmd = dirty_command(DRAW_CLEAR, NULL);
+	memcpy(cmd->transform, affine_identity, sizeof(float)*6);
+	memset(cmd->data, 0, sizeof(cmd->data));
+	memcpy(cmd->data, colour, sizeof(float)*4);
+	float corners[4] = { 0, 0, 1, 1 };
+	dirty_bounds(cmd, corners, 2, 2);
+	dirty_sign(cmd);
+	return 1;
+}
+
+static int dirty_record_texture(CT_Texture* tex, float* data)
+{
+	if (!dirty_is_recording()) return 0;
+	CT_DrawCommand* cmd = dirty_command(DRAW_TEXTURE, tex);
+	memcpy(cmd->data, data, sizeof(cmd->data));
+	dirty_bounds(cmd, data, 4, 4);
+	dirty_sign(cmd);
+	return 1;
+}
+
+/* The quads are copied into the frame arena, as is, so later changes,
+   bakes or a free of the batch in the same frame don't change what an
+   earlier command draws. */
+static int dirty_record_batch(CT_Batch* batch, CT_Texture* atlas)
+{
+	if (!dirty_is_recording()) return 0;
+	CT_DrawCommand* cmd = dirty_command(DRAW_BATCH, atlas);
+	unsigned quads = batch->vector->size;
+	cmd->batch = batch;
+	cmd->quads = quads;
+	cmd->vertices = ct_frame_alloc(sizeof(float) * 16 * (quads ? quads : 1));
+	cmd->indices = ct_frame_alloc(sizeof(unsigned short) * 6 * (quads ? quads : 1));
+	memcpy(cmd->vertices, batch->vector->data, sizeof(float) * 16 * quads);
+	memcpy(cmd->indices, batch->indices, sizeof(unsigned short) * 6 * quads);
+	memset(cmd->data, 0, sizeof(cmd->data));
+	float rect[4];
+	batch_bounds(cmd->vertices, quads*4, 4, rect);
+	float corners[8] = {
+		rect[0], rect[2], rect[1], rect[2],
+		rect[1], rect[3], rect[0], rect[3] };
+	dirty_bounds(cmd, corners, 4, 2);
+	dirty_sign(cmd);
+	return 1;
+}
+
+/* Called before `tex` is drawn or copied into. Commands of this frame
+   that sample it are pointed at a copy of its current contents, which
+   goes back to the target pool with the frame's transient targets. */
+static void dirty_preserve(CT_Texture* tex)
+{
+	if (!dirty.enabled || ct_is_texture_screen(tex)) return;
+	CT_DrawList* list = dirty.lists + dirty.current;
+	CT_Texture* copy = NULL;
+	unsigned i;
+	for (i=0; i<list->size; i++)
+	{
+		CT_DrawCommand* cmd = list->commands + i;
+		if (cmd->texture != tex) continue;
+		if (!copy)
+		{
+			float src_rect[4] = { 0, 1, 0, 1 };
+			float dst_pos[2] = { 0, 0 };
+			copy = target_pool_acquire(tex->w, tex->h, 1);
+			if (!copy) return;
+			copy->wrap = tex->wrap;
+			ct_texture_filter_set(copy, tex->filter);
+			ct_texture_copy_rect(tex, src_rect, copy, dst_pos);
+		}
+		cmd->texture = copy;
+	}
+}
 
-static struct
+static int rects_overlap(const int* a, const int* b)
 {
-	CT_Texture* stack[CT_STACK_SIZE];
-	unsigned size;
-} target_stack;
+	return a[0] < b[1] && b[0] < a[1] && a[2] < b[3] && b[2] < a[3];
+}
 
-static CT_Texture* current_target()
+static void rect_union(int* a, const int* b)
 {
-	return target_stack.size
-		? target_stack.stack[target_stack.size-1]
-		: ct_screen_texture();
+	if (b[0] < a[0]) a[0] = b[0];
+	if (b[1] > a[1]) a[1] = b[1];
+	if (b[2] < a[2]) a[2] = b[2];
+	if (b[3] > a[3]) a[3] = b[3];
 }
 
-void ct_target_push(CT_Texture* tex)
+/* Adds a pixel rectangle, merging it with the regions it overlaps. */
+static void damage_add_pixels(const int* rect)
 {
-	if (target_stack.size >= CT_STACK_SIZE)
+	CT_Texture* screen = ct_screen_texture();
+	int r[4] = {
+		rect[0] < 0 ? 0 : rect[0],
+		rect[1] > (int)screen->w ? (int)screen->w : rect[1],
+		rect[2] < 0 ? 0 : rect[2],
+		rect[3] > (int)screen->h ? (int)screen->h : rect[3] };
+	if (r[0] >= r[1] || r[2] >= r[3]) return;
+	unsigned i = 0;
+	while (i < dirty.rect_count)
 	{
-		/* Stack overflow, resetting stack to prevent
-		   crashing if this error is ignored. */
-		ct_set_error("Stack overflow");
-		target_stack.size = 0;
+		if (rects_overlap(dirty.rects[i], r))
+		{
+			/* The merged rectangle may now overlap others */
+			rect_union(r, dirty.rects[i]);
+			memcpy(dirty.rects[i], dirty.rects[--dirty.rect_count],
+			       sizeof(int)*4);
+			i = 0;
+		} else i++;
 	}
-	texture_bind(tex);
-	target_stack.stack[target_stack.size++] = tex;
+	if (dirty.rect_count == DAMAGE_MAX_RECTS)
+	{
+		for (i=1; i<dirty.rect_count; i++)
+			rect_union(dirty.rects[0], dirty.rects[i]);
+		rect_union(dirty.rects[0], r);
+		dirty.rect_count = 1;
+		return;
+	}
+	memcpy(dirty.rects[dirty.rect_count++], r, sizeof(int)*4);
 }
 
-void ct_target_pop()
+static void dirty_lists_clear()
 {
-	if (target_stack.size == 0)
+	memset(dirty.lists, 0, sizeof(dirty.lists));
+}
+
+void ct_dirty_rects_set(int enabled)
+{
+	if (enabled == dirty.enabled) return;
+	dirty.enabled = enabled;
+	dirty_lists_clear();
+	dirty.rect_count = 0;
+	dirty.is_all_damaged = 1;
+	if (!enabled)
 	{
-		/* Stack underflow, setting stack to one
-		   so it will set to default value if this
-		   error is ignored. */
-		ct_set_error("Stack underflow");
-		target_stack.size = 1;
+		if (dirty.back_buffer) target_pool_release(dirty.back_buffer);
+		dirty.back_buffer = NULL;
 	}
-	target_stack.size--;
-	texture_bind(target_stack.size
-		     ? target_stack.stack[target_stack.size-1]
-		     : ct_screen_texture());
 }
 
-/* Batch */
-
-CT_Batch* ct_batch_create(unsigned size_hint)
+int ct_dirty_rects()
 {
-	CT_Batch* batch = smalloc(sizeof(CT_Batch));
-	batch->vector  = dv_vector_new(16, size_hint);
-	batch->indices = smalloc(sizeof(unsigned short)*size_hint*6);
-	unsigned i;
-	for (i=0; i<size_hint; i++) {
-		batch->indices[(i*6)+0] = 0 + (i*4);
-		batch->indices[(i*6)+1] = 1 + (i*4);
-		batch->indices[(i*6)+2] = 2 + (i*4);
-		batch->indices[(i*6)+3] = 0 + (i*4);
-		batch->indices[(i*6)+4] = 2 + (i*4);
-		batch->indices[(i*6)+5] = 3 + (i*4);
-	}
-	return batch;
+	return dirty.enabled;
 }
 
-void ct_batch_free(CT_Batch* batch)
+void ct_damage_add(float* rect)
 {
-	dv_vector_free(batch->vector);
-	free(batch->indices);
-	free(batch);
+	CT_Texture* screen = ct_screen_texture();
+	int r[4] = {
+		floor(rect[0] * screen->w), ceil(rect[1] * screen->w),
+		floor(rect[2] * screen->h), ceil(rect[3] * screen->h) };
+	damage_add_pixels(r);
 }
 
-unsigned ct_batch_push(CT_Batch* batch, CT_Transformation* trans)
+void ct_damage_all()
 {
-	
-	unsigned grown_by;
-	float data[16]; vertex_data(trans, data);
-	unsigned id = dv_vector_push(batch->vector, data, &grown_by);
-	/* If vector has grown, grow indices array with it. */
-	if (grown_by)
-	{
-		unsigned size = dv_vector_current_capacity(batch->vector);
-		batch->indices = srealloc(batch->indices, 
-					  sizeof(unsigned short)*size*6);
-		unsigned i;
-		/* Populate new indicies */
-		for (i=size-grown_by; i<size; i++) {
-			batch->indices[(i*6)+0] = 0 + (i*4);
-			batch->indices[(i*6)+1] = 1 + (i*4);
-			batch->indices[(i*6)+2] = 2 + (i*4);
-			batch->indices[(i*6)+3] = 0 + (i*4);
-			batch->indices[(i*6)+4] = 2 + (i*4);
-			batch->indices[(i*6)+5] = 3 + (i*4);
-		}
-	}
-	return id;
+	dirty.is_all_damaged = 1;
 }
 
-void ct_batch_remove(CT_Batch* batch, unsigned id)
+unsigned ct_damage_area()
 {
-	dv_vector_remove(batch->vector, id);
+	return dirty.area;
 }
 
-void ct_batch_change(CT_Batch* batch, unsigned id, CT_Transformation* trans)
+static void dirty_replay(CT_DrawCommand* cmd)
 {
-	vertex_data(trans, dv_vector_ref(batch->vector, id));
+	float m[16];
+	memcpy(m, matrix_identity, sizeof(m));
+	affine_to_matrix(cmd->transform, m);
+	set_blend_mode(cmd->blend);
+	switch (cmd->type)
+	{
+	case DRAW_CLEAR:
+		target_clear(cmd->data);
+		break;
+	case DRAW_TEXTURE:
+		draw_quads(cmd->shader, m, cmd->colour, cmd->texture,
+			   cmd->data, 16, cmd->data+2, 1, rect_index_order);
+		break;
+	case DRAW_BATCH:
+		draw_quads(cmd->shader, m, cmd->colour, cmd->texture,
+			   cmd->vertices, 16, cmd->vertices+2,
+			   cmd->quads, cmd->indices);
+		break;
+	}
 }
 
-void ct_batch_render(CT_Batch* batch, CT_Texture* atlas)
+/* Limits drawing and clearing to the pixel rectangle (left, right, top,
+   bottom), NULL lifts the limit. Blits are limited too. */
+static void scissor_set(const int* rect)
 {
-	DV_Vector* vector = batch->vector;
-	glUseProgram(current_shader()->gl_program_id);
-	glBindTexture(GL_TEXTURE_2D, atlas->gl_texture_id);
-	shader_upload_modelview_matrix(current_shader(), current_matrix());
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 16, vector->data);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 16, vector->data+2);
-	glDrawElements(GL_TRIANGLES, vector->size*6, GL_UNSIGNED_SHORT, batch->indices);
-	CHECK_GL();
+	if (is_software())
+	{
+		sw_scissor(rect);
+	} else if (rect)
+	{
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(rect[0], rect[2], rect[1] - rect[0], rect[3] - rect[2]);
+	} else
+	{
+		glDisable(GL_SCISSOR_TEST);
+	}
 }
 
-unsigned ct_batch_size(CT_Batch* batch)
+/* Damages what changed since the previous frame, redraws it into the
+   back buffer and presents that. An unchanged frame is skipped. */
+static void dirty_present()
 {
-	return batch->vector->size;
+	CT_Texture* screen = ct_screen_texture();
+	CT_DrawList* list = dirty.lists + dirty.current;
+	CT_DrawList* previous = dirty.lists + !dirty.current;
+	unsigned i, j;
+
+	if (!dirty.back_buffer ||
+	    dirty.back_buffer->w != screen->w || dirty.back_buffer->h != screen->h)
+	{
+		if (dirty.back_buffer) target_pool_release(dirty.back_buffer);
+		dirty.back_buffer = target_pool_acquire(screen->w, screen->h, 0);
+		dirty.is_all_damaged = 1;
+	}
+
+	/* Commands are compared in order, so an inserted command damages
+	   everything drawn after it. */
+	unsigned size = list->size > previous->size ? list->size : previous->size;
+	for (i=0; i<size && !dirty.is_all_damaged; i++)
+	{
+		CT_DrawCommand* a = i < previous->size ? previous->commands + i : NULL;
+		CT_DrawCommand* b = i < list->size ? list->commands + i : NULL;
+		if (a && b && a->signature == b->signature) continue;
+		if (a) damage_add_pixels(a->bounds);
+		if (b) damage_add_pixels(b->bounds);
+	}
+	if (dirty.is_all_damaged)
+	{
+		int all[4] = { 0, screen->w, 0, screen->h };
+		dirty.rect_count = 0;
+		damage_add_pixels(all);
+	}
+
+	dirty.area = 0;
+	if (dirty.back_buffer && dirty.rect_count)
+	{
+		/* The back buffer is a texture, its rows run top to bottom
+		   like the engine's, so the rectangles need no flipping. */
+		ct_target_push(dirty.back_buffer);
+		if (!is_software()) glEnable(GL_BLEND);
+		for (i=0; i<dirty.rect_count; i++)
+		{
+			int* r = dirty.rects[i];
+			dirty.area += (r[1] - r[0]) * (r[3] - r[2]);
+			scissor_set(r);
+			for (j=0; j<list->size; j++)
+			{
+				CT_DrawCommand* cmd = list->commands + j;
+				if (rects_overlap(cmd->bounds, r)) dirty_replay(cmd);
+			}
+		}
+		scissor_set(NULL);
+		set_blend_mode(current_blend_mode());
+		ct_target_pop();
+		float src_rect[4] = { 0, 1, 0, 1 };
+		float dst_pos[2] = { 0, 0 };
+		ct_texture_copy_rect(dirty.back_buffer, src_rect, screen, dst_pos);
+		if (!is_software()) SDL_GL_SwapWindow(window.sdl_window);
+	} else if (!is_software())
+	{
+		/* Nothing to show, wait a refresh instead of spinning. */
+		SDL_DisplayMode mode;
+		int rate = 60;
+		if (SDL_GetWindowDisplayMode(window.sdl_window, &mode) == 0 &&
+		    mode.refresh_rate > 0)
+			rate = mode.refresh_rate;
+		SDL_Delay(1000 / rate);
+	}
+	/* The back buffer holds the whole frame, even when nothing was
+	   swapped. */
+	capture_frame(dirty.back_buffer);
+
+	/* The list two frames back goes with its arena */
+	dirty.current = !dirty.current;
+	memset(dirty.lists + dirty.current, 0, sizeof(CT_DrawList));
+	dirty.rect_count = 0;
+	dirty.is_all_damaged = 0;
 }
 
 /* Font */
 
+static Pool font_link_pool = POOL(struct CT_FontMapLink, CT_MEMORY_FONT);
+
+static CT_Font* font_alloc(FILE* file, SDL_RWops* rw)
+{
+	CT_Font* font = smalloc_tag(sizeof(CT_Font), CT_MEMORY_FONT);
+	font->file = file;
+	font->rw = rw;
+	font->first = NULL;
+	return font;
+}
+
 CT_Font* ct_font_load(const char* filename)
 {
 	FILE* file = fopen(filename, "r");
@@ -831,28 +3829,30 @@ CT_Font* ct_font_load(const char* filename)
 		ct_set_error(str);
 		return NULL;
 	}
-	CT_Font* font = smalloc(sizeof(CT_Font));
-	font->file = file;
-	font->rw = rw;
-	font->first = NULL;
-	return font;
+	return font_alloc(file, rw);
+}
+
+CT_Font* ct_font_load_packed(CT_Pack* pack, const char* name)
+{
+	SDL_RWops* rw = ct_pack_rw(pack, name);
+	if (!rw) return NULL; /* ct_pack_rw already sets the error. */
+	return font_alloc(NULL, rw);
 }
 
 void ct_font_free(CT_Font* font)
 {
-	SDL_FreeRW(font->rw);
 	/* Free font map */
 	struct CT_FontMapLink* last = font->first, *tmp;
-	if (last)
+	while (last)
 	{
-		while (last)
-		{
-			tmp = last;
-			last = last->next;
-			free(tmp);
-		}
+		tmp = last;
+		last = last->next;
+		TTF_CloseFont(tmp->value);
+		pool_free(&font_link_pool, tmp);
 	}
-	free(font);
+	/* Also closes the file, if any. */
+	SDL_RWclose(font->rw);
+	sfree(font);
 }
 
 static TTF_Font* load_font_size(CT_Font* font, unsigned size)
@@ -864,18 +3864,12 @@ static TTF_Font* load_font_size(CT_Font* font, unsigned size)
 		ct_set_error(TTF_GetError());
 		return NULL;
 	}
-	struct CT_FontMapLink* link = smalloc(sizeof(struct CT_FontMapLink));
+	/* Remember this size so it is only opened once. */
+	struct CT_FontMapLink* link = pool_alloc(&font_link_pool);
 	link->size  = size;
 	link->value = ttf_font;
-	link->next  = NULL;
-	struct CT_FontMapLink* last = font->first;
-	while (last)
-	{
-		last = last->next;
-	}
-
-	last = smalloc(sizeof(struct CT_FontMapLink));
-	last->next = link;
+	link->next  = font->first;
+	font->first = link;
 	return ttf_font;
 }
 
@@ -902,6 +3896,7 @@ extern CT_Texture* ct_string_to_texture(CT_Font* font,
 {
 	TTF_Font* ttf_font = get_ttf_font(font, size);
 	if (!ttf_font) return NULL; /* Error already reported. */
+	CT_PROFILE_BEGIN("ct_string_to_texture");
 	SDL_Color sdl_colour = { 255*colour[0],
 				 255*colour[1],
 				 255*colour[2],
@@ -909,9 +3904,13 @@ extern CT_Texture* ct_string_to_texture(CT_Font* font,
 	int w, h;
 	TTF_SizeText(ttf_font, string, &w, &h);
 	SDL_Surface* sur = TTF_RenderText_Blended(ttf_font, string, sdl_colour);
-	CT_Image* image = image_alloc(sur);
-	CT_Texture* tex = ct_image_to_texture(image);
-	ct_image_free(image);
+	/* The image only lives for the upload, so it stays on the stack. */
+	CT_Image image = { sur };
+	/* Text is usually drawn the frame it is created,
+	   so never defer it to the upload queue. */
+	CT_Texture* tex = texture_init(&image, ct_image_gl_format(&image), 0);
+	SDL_FreeSurface(sur);
+	CT_PROFILE_END();
 	return tex;
 }
 
@@ -967,24 +3966,58 @@ static void vertex_data(CT_Transformation* tran, float* data)
 
 /* Translation */
 
+/* Every level holds the accumulated 2D affine transform
+     x' = a*x + c*y + e
+     y' = b*x + d*y + f
+   as { a, b, c, d, e, f }, so popping is just going back a level.
+   Level 0 is the identity. */
 static struct
 {
-	float stack[16][CT_STACK_SIZE];
+	float stack[CT_STACK_SIZE+1][6];
 	unsigned size;
-} matrix_stack;
-
-float _current_matrix[16] = {
-	1, 0, 0, 0,
-	0, 1, 0, 0,
-	0, 0, 1, 0,
-	0, 0, 0, 1
+	float matrix[16];
+	int is_matrix_dirty;
+} matrix_stack = {
+	{ { 1, 0, 0, 1, 0, 0 } },
+	0,
+	{ 1, 0, 0, 0,
+	  0, 1, 0, 0,
+	  0, 0, 1, 0,
+	  0, 0, 0, 1 },
+	0
 };
 
-float* current_matrix()
+static float* current_affine()
+{
+	return matrix_stack.stack[matrix_stack.size];
+}
+
+/* Fills in the 2D part of the column major 4x4 matrix `r`, which must
+   otherwise be the identity. */
+static void affine_to_matrix(const float* m, float* r)
+{
+	r[0]  = m[0];
+	r[1]  = m[1];
+	r[4]  = m[2];
+	r[5]  = m[3];
+	r[12] = m[4];
+	r[13] = m[5];
+}
+
+/* The current level as a column major 4x4 matrix for the shaders. */
+static float* current_matrix()
 {
-	return _current_matrix;
+	if (matrix_stack.is_matrix_dirty)
+	{
+		affine_to_matrix(matrix_stack.stack[matrix_stack.size],
+				 matrix_stack.matrix);
+		matrix_stack.is_matrix_dirty = 0;
+	}
+	return matrix_stack.matrix;
 }
 
+/* Same as T(.5) * S(scale) * Rz(rotation) * T(position - .5) applied
+   after the current level. */
 void ct_translation_push(float* position, float scale, float rotation)
 {
 	if (matrix_stack.size >= CT_STACK_SIZE)
@@ -994,35 +4027,43 @@ void ct_translation_push(float* position, float scale, float rotation)
 		ct_set_error("Stack overflow");
 		matrix_stack.size = 0;
 	}
-	float* trans = matrix_stack.stack[++matrix_stack.size];
+	float* m = matrix_stack.stack[matrix_stack.size];
+	float* r = matrix_stack.stack[++matrix_stack.size];
+
+	float px = position[0] - .5;
+	float py = position[1] - .5;
+	float a, b;
+	if (rotation == 0)
+	{
+		a = scale;
+		b = 0;
+	} else
+	{
+		a = cos(rotation) * scale;
+		b = sin(rotation) * scale;
+	}
+	/* c = -b, d = a */
+	float e = a*px - b*py + .5;
+	float f = b*px + a*py + .5;
 
-	hpmIdentityMat4(trans);
-	hpmTranslate(position[0]-.5, position[1]-.5, 0, trans);
-	hpmRotateZ(rotation, trans);
-	hpmScale2D(scale, scale, trans);
-	hpmTranslate(.5, .5, 0, trans);
-	float r[16];
-	hpmMultMat4(_current_matrix, trans, r);
-	memcpy(_current_matrix, r, sizeof(float)*16);
+	r[0] = m[0]*a + m[2]*b;
+	r[1] = m[1]*a + m[3]*b;
+	r[2] = m[2]*a - m[0]*b;
+	r[3] = m[3]*a - m[1]*b;
+	r[4] = m[0]*e + m[2]*f + m[4];
+	r[5] = m[1]*e + m[3]*f + m[5];
+	matrix_stack.is_matrix_dirty = 1;
 }
 
 void ct_translation_pop()
 {
-	
 	if (matrix_stack.size == 0)
 	{
-		/* Stack underflow, setting stack to one
-		   so it will set to default value if this
-		   error is ignored. */
+		/* Stack underflow, the identity stays
+		   if this error is ignored. */
 		ct_set_error("Stack underflow");
-		matrix_stack.size = 1;
+		return;
 	}
-	float* trans = matrix_stack.stack[matrix_stack.size];
 	matrix_stack.size--;
-
-	float r1[16];
-	float r2[16];
-	hpmInverse(trans, r1);
-	hpmMultMat4(_current_matrix, r1, r2);
-	memcpy(_current_matrix, r2, sizeof(float)*16);
+	matrix_stack.is_matrix_dirty = 1;
 }
@@ -29,25 +29,74 @@ OTHER DEALINGS IN THE SOFTWARE.
 #define CT_STACK_SIZE 32
 
 #include <stdio.h>
+#include <stddef.h>
 
 typedef struct _DV_Vector DV_Vector;
 typedef struct SDL_Surface SDL_Surface;
 typedef struct SDL_Window SDL_Window;
 typedef struct SDL_RWops SDL_RWops;
 typedef struct _TTF_Font TTF_Font;
+typedef struct _CT_Pack CT_Pack;
 
 typedef struct _CT_Image
 {
 	SDL_Surface* sdl_surface;
 } CT_Image;
 
+typedef enum _CT_TextureFilter
+{
+	CT_TEXTURE_FILTER_NEAREST,
+	CT_TEXTURE_FILTER_LINEAR,
+	CT_TEXTURE_FILTER_NEAREST_MIPMAP,
+	CT_TEXTURE_FILTER_LINEAR_MIPMAP
+} CT_TextureFilter;
+
+typedef enum _CT_TextureWrap
+{
+	CT_TEXTURE_WRAP_REPEAT,
+	CT_TEXTURE_WRAP_CLAMP,
+	CT_TEXTURE_WRAP_MIRROR
+} CT_TextureWrap;
+
 typedef struct _CT_Texture
 {
 	unsigned w, h;
 	unsigned gl_texture_id;
 	unsigned gl_buffer_id;
+	unsigned levels;
+	int has_file_mipmaps; /* Levels past the first came with the file */
+	int is_compressed;    /* Cannot generate its own mipmaps */
+	CT_TextureFilter filter;
+	CT_TextureWrap wrap;
+	unsigned version; /* Bumped whenever the contents change */
+	unsigned vram;    /* Estimated bytes of video memory */
+	unsigned char* pixels; /* Software backend only, see ct_texture_pixels */
 } CT_Texture;
 
+/* Uniform block binding point of the engine's ct_state block. */
+#define CT_STATE_BINDING 0
+
+typedef struct _CT_Shader
+{
+	unsigned gl_program_id;
+	unsigned gl_vertex_id;
+	unsigned gl_fragment_id;
+	/* Plain colour, modelview and projection uniforms, for shaders
+	   that don't use the ct_state block; -1 when absent. */
+	int colour_location;
+	int modelview_location;
+	int projection_location;
+	unsigned state_version;
+} CT_Shader;
+
+typedef int CT_Uniform;
+
+typedef struct _CT_UniformBuffer
+{
+	unsigned gl_buffer_id;
+	unsigned size;
+} CT_UniformBuffer;
+
 typedef struct
 {
 	SDL_Window* sdl_window;
@@ -60,6 +109,14 @@ typedef struct _CT_Batch
 {
 	DV_Vector* vector;
 	unsigned short* indices;
+	unsigned version; /* Bumped on every change */
+	/* Positions transformed by the translation stack, see ct_batch_bake. */
+	float* baked;
+	unsigned baked_capacity;
+	unsigned baked_version;
+	float baked_transform[6];
+	int is_baked;
+	float bounds[4];
 } CT_Batch;
 
 typedef struct _CT_Transformation
@@ -93,14 +150,129 @@ extern const char* ct_get_error();
 
 extern void ct_set_error(const char* str);
 
-/* Shader */
+/* Memory
+   Engine allocations are counted per tag, including the pixels and
+   samples the SDL libraries decode for us. Video memory is estimated
+   from the textures and buffers the engine creates. ct_window_quit
+   reports whatever is still allocated on stderr. */
+
+typedef enum _CT_MemoryTag
+{
+	CT_MEMORY_GENERAL,
+	CT_MEMORY_BATCH,
+	CT_MEMORY_INDICES,
+	CT_MEMORY_FONT,
+	CT_MEMORY_IMAGE,
+	CT_MEMORY_AUDIO,
+	CT_MEMORY_TEXTURE,
+	CT_MEMORY_SHADER,
+	CT_MEMORY_TAG_COUNT
+} CT_MemoryTag;
+
+extern size_t ct_memory_usage(CT_MemoryTag tag);
+
+extern size_t ct_memory_peak(CT_MemoryTag tag);
+
+extern unsigned ct_memory_allocations(CT_MemoryTag tag);
+
+extern size_t ct_memory_total();
+
+extern size_t ct_memory_total_peak();
+
+extern const char* ct_memory_tag_name(CT_MemoryTag tag);
+
+extern size_t ct_vram_usage();
+
+extern size_t ct_vram_peak();
+
+/* Prints a table of the above. */
+extern void ct_memory_report(FILE* file);
+
+/* Shader
+   The engine hands its projection, modelview and colour to shaders in
+
+     layout (std140) uniform ct_state {
+         mat4 projection;
+         mat4 modelview;
+         vec4 colour;
+     };
+
+   and sends it again only when something in it changed. Shaders with
+   plain uniforms of those names get them as well. A NULL vertex source
+   uses the default vertex shader. */
+
+extern CT_Shader* ct_shader_create(const char* vertex_source,
+				   const char* fragment_source);
+
+extern void ct_shader_free(CT_Shader* shader);
+
+extern void ct_shader_push(CT_Shader* shader);
 
 extern void ct_push_default_shader();
 
 extern void ct_shader_pop();
 
+/* Keeps linked program binaries in `directory` (which must exist) so
+   later runs on the same driver skip the GLSL compiler. Call it before
+   ct_window_init to cover the default shader too; NULL turns it off,
+   and so does ct_window_quit. */
+extern void ct_shader_cache_set(const char* directory);
+
+/* Returns -1 if the shader has no active uniform called `name`, which
+   the setters quietly ignore. */
+extern CT_Uniform ct_shader_uniform(CT_Shader* shader, const char* name);
+
+extern void ct_shader_uniform_int(CT_Shader* shader, CT_Uniform uniform, int value);
+
+extern void ct_shader_uniform_float(CT_Shader* shader, CT_Uniform uniform, float value);
+
+extern void ct_shader_uniform_vec2(CT_Shader* shader, CT_Uniform uniform, float* value);
+
+extern void ct_shader_uniform_vec3(CT_Shader* shader, CT_Uniform uniform, float* value);
+
+extern void ct_shader_uniform_vec4(CT_Shader* shader, CT_Uniform uniform, float* value);
+
+extern void ct_shader_uniform_mat4(CT_Shader* shader, CT_Uniform uniform, float* value);
+
+/* Returns 1 if the shader has no uniform block called `name`. */
+extern int ct_shader_uniform_block_bind(CT_Shader* shader, const char* name,
+					unsigned binding);
+
+/* Uniform buffer
+   Backing store for std140 uniform blocks. Binding points other than
+   CT_STATE_BINDING are free to use. */
+
+extern CT_UniformBuffer* ct_uniform_buffer_create(unsigned size);
+
+extern void ct_uniform_buffer_free(CT_UniformBuffer* buffer);
+
+extern void ct_uniform_buffer_update(CT_UniformBuffer* buffer, unsigned offset,
+				     unsigned size, const void* data);
+
+extern void ct_uniform_buffer_bind(CT_UniformBuffer* buffer, unsigned binding);
+
 /* Window */
 
+typedef enum _CT_Backend
+{
+	CT_BACKEND_GL,
+	CT_BACKEND_SOFTWARE
+} CT_Backend;
+
+/* What ct_window_init opens, GL by default. The software backend needs
+   no display or GPU: the screen is an 800x600 texture in memory that
+   the CPU draws into with the default shader's semantics. Shaders are
+   accepted but not run, post-processing passes are skipped and only
+   the first mipmap level is sampled. Returns 1 while a window is open. */
+extern int ct_window_backend_set(CT_Backend backend);
+
+extern CT_Backend ct_window_backend();
+
+/* Threads the software backend rasterises with, counting the one
+   drawing: the screen is split into tiles drawn in parallel. 0, the
+   default, is one per CPU and 1 keeps to the calling thread. */
+extern void ct_window_backend_threads_set(unsigned count);
+
 extern int ct_window_init();
 
 extern void ct_window_quit();
@@ -117,10 +289,55 @@ extern void ct_window_update();
 
 extern void ct_window_clear(float* colour);
 
+/* The screen as a texture, to read back or copy from. */
+extern CT_Texture* ct_screen_texture();
+
+/* Frame statistics
+   Counted as the engine calls GL, and reset by ct_window_update. Uploads
+   include vertex and index data, uniforms and texture pixels. */
+
+typedef struct _CT_FrameStats
+{
+	unsigned draw_calls;
+	unsigned quads;
+	unsigned vertices;
+	unsigned upload_bytes;
+	unsigned program_changes;
+	unsigned texture_binds;
+	unsigned framebuffer_binds;
+	unsigned blend_changes;
+	unsigned uniform_uploads;
+	unsigned textures_created;
+	unsigned textures_deleted;
+	unsigned framebuffers_created;
+	unsigned framebuffers_deleted;
+} CT_FrameStats;
+
+/* The last frame finished by ct_window_update. */
+extern const CT_FrameStats* ct_frame_stats();
+
+/* The frame being drawn so far. */
+extern const CT_FrameStats* ct_frame_stats_current();
+
+/* Frame arena
+   Scratch memory without freeing: it is released in bulk by the
+   ct_window_update after the next, so it lasts this frame and the one
+   after. The engine keeps its own per-frame data there too. */
+
+extern void* ct_frame_alloc(size_t size);
+
+/* Bytes allocated so far this frame. */
+extern size_t ct_frame_arena_used();
+
+/* Most bytes any frame has used. */
+extern size_t ct_frame_arena_high_water();
+
 /* Image */
 
 extern CT_Image* ct_image_load(const char* filename);
 
+extern CT_Image* ct_image_load_packed(CT_Pack* pack, const char* name);
+
 extern CT_Image* ct_image_create(unsigned w, unsigned h);
 
 extern void ct_image_free(CT_Image* image);
@@ -140,7 +357,8 @@ typedef enum _CT_BlendMode
 	CT_BLEND_MODE_NORMAL,
 	CT_BLEND_MODE_ADD,
 	CT_BLEND_MODE_TRANS,
-	CT_BLEND_MODE_ONE_ONE
+	CT_BLEND_MODE_ONE_ONE,
+	CT_BLEND_MODE_PREMULTIPLIED
 } CT_BlendMode;
 
 extern void ct_blend_mode_push(CT_BlendMode mode);
@@ -155,24 +373,275 @@ extern CT_Texture* ct_texture_create(unsigned w, unsigned h);
 
 extern CT_Texture* ct_texture_copy(CT_Texture* texture);
 
+/* Copies the `src_rect` (left, right, top, bottom) part of `src` to `dst`
+   with its top left corner at `dst_pos`, all in 0-1 texture units. This
+   is a plain pixel copy, the stacks are not used. */
+extern void ct_texture_copy_rect(CT_Texture* src, float* src_rect,
+				 CT_Texture* dst, float* dst_pos);
+
 extern CT_Texture* ct_texture_load(const char* filename);
 
+extern CT_Texture* ct_texture_load_packed(CT_Pack* pack, const char* name);
+
+/* KTX and KTX2 files with BCn, ETC2, ASTC or RGBA8 data. Formats the driver
+   lacks are decompressed on load, except ASTC. ct_texture_load and
+   ct_texture_load_packed use this for .ktx/.ktx2 files too. */
+extern CT_Texture* ct_texture_load_ktx(const char* filename);
+
 extern void ct_texture_free(CT_Texture* tex);
 
 extern int ct_is_texture_screen(CT_Texture* tex);
 
 extern void ct_texture_size(CT_Texture* tex, float* vect);
 
+/* RGBA8 pixels of a software backend texture, the screen too, with the
+   top row first. NULL with GL. */
+extern const unsigned char* ct_texture_pixels(CT_Texture* tex);
+
 extern void ct_texture_clear(CT_Texture* tex, float* colour);
 
 extern void ct_texture_render(CT_Texture* tex, CT_Transformation* trans);
 
+/* Sampling
+   Textures sample with the default filter and wrap mode at creation,
+   nearest and repeat unless changed. Mipmapped filters generate the
+   mipmaps when needed: on upload and when the texture is popped off the
+   target stack. */
+
+extern void ct_texture_default_sampling_set(CT_TextureFilter filter,
+					    CT_TextureWrap wrap);
+
+extern void ct_texture_filter_set(CT_Texture* tex, CT_TextureFilter filter);
+
+extern CT_TextureFilter ct_texture_filter(CT_Texture* tex);
+
+extern void ct_texture_wrap_set(CT_Texture* tex, CT_TextureWrap wrap);
+
+extern CT_TextureWrap ct_texture_wrap(CT_Texture* tex);
+
+extern void ct_texture_mipmaps_generate(CT_Texture* tex);
+
+/* Texture cache
+   When a cache directory is set ct_texture_load stores each image, decoded
+   to RGBA8, in the directory keyed by a hash of the source file. Later
+   loads map that file and upload it directly without decoding. Draw
+   textures cached with CT_TEXTURE_CACHE_PREMULTIPLY using
+   CT_BLEND_MODE_PREMULTIPLIED. Pass NULL to disable the cache, which
+   ct_window_quit also does. */
+
+typedef enum _CT_TextureCacheFlags
+{
+	CT_TEXTURE_CACHE_PREMULTIPLY = 1,
+	CT_TEXTURE_CACHE_MIPMAPS = 2
+} CT_TextureCacheFlags;
+
+extern void ct_texture_cache_set(const char* directory, unsigned flags);
+
+/* Writes a single cache file, e.g. to put in a pack. Returns 0 on success. */
+extern int ct_texture_cache_write(const char* filename,
+				  const char* cache_filename,
+				  unsigned flags);
+
+/* Upload queue
+   When the budget is non-zero ct_image_to_texture (and ct_texture_load)
+   copy the pixels into a pixel buffer object and return right away. The
+   texture's contents then arrive over the next frames, at most `bytes`
+   per ct_window_update. A budget of 0 (the default) uploads immediately. */
+
+extern void ct_upload_budget_set(unsigned bytes);
+
+extern unsigned ct_upload_budget();
+
+extern unsigned ct_upload_queue_depth();
+
+extern unsigned ct_upload_queue_bytes();
+
+extern int ct_is_texture_ready(CT_Texture* tex);
+
+extern void ct_upload_flush();
+
+/* Readback
+   Reads a texture back without stalling the pipeline: the GPU copies it
+   into a pixel buffer object behind the frame's draws and a fence tells
+   when it's done, usually one or two frames later. Pixels are RGBA8,
+   rows from the top, the screen included. With the software backend
+   they are there at once. */
+
+typedef struct _CT_Readback CT_Readback;
+
+/* Returns NULL on failure. */
+extern CT_Readback* ct_readback_begin(CT_Texture* tex);
+
+/* NULL while the GPU isn't done yet, never waits. */
+extern const unsigned char* ct_readback_pixels(CT_Readback* readback);
+
+/* Waits for the GPU if needed. */
+extern const unsigned char* ct_readback_wait(CT_Readback* readback);
+
+extern void ct_readback_size(CT_Readback* readback, unsigned* ret);
+
+extern void ct_readback_free(CT_Readback* readback);
+
+/* Capture
+   Records what ct_window_update shows, frame by frame. The frames are
+   read back as above and written to disk by a background thread, so
+   the game keeps its pace. No frame is dropped: if the disk can't keep
+   up, ct_window_update waits for it once too many frames are queued. */
+
+typedef enum _CT_CaptureFormat
+{
+	CT_CAPTURE_PNG, /* One file per frame */
+	CT_CAPTURE_RAW  /* RGBA8 frames one after another in a single file */
+} CT_CaptureFormat;
+
+/* Captures every frame from the next ct_window_update on. For PNG
+   `path` is a printf pattern with exactly one integer conversion for
+   the frame number, such as "capture/%05u.png", and "%%" for any other
+   percent sign; for RAW it's the file. Returns 1 on error. */
+extern int ct_capture_start(const char* path, CT_CaptureFormat format);
+
+/* Writes out the frames still on their way and ends the capture,
+   returns 1 if any couldn't be written. */
+extern int ct_capture_stop();
+
+/* A PNG of the next frame shown, written in the background. Returns 1
+   on error, e.g. while a capture is running. */
+extern int ct_capture_screenshot(const char* filename);
+
+extern int ct_is_capturing();
+
+/* Frames shown but not yet on disk. */
+extern unsigned ct_capture_pending();
+
+/* Target pool
+   Transient targets are for intermediate results within a frame. They
+   come from a pool of textures of the same size and go back to it at
+   ct_window_update, or earlier with ct_texture_transient_release. Never
+   ct_texture_free them, and don't expect their contents to survive. */
+
+extern CT_Texture* ct_texture_transient(unsigned w, unsigned h);
+
+extern void ct_texture_transient_release(CT_Texture* tex);
+
+extern unsigned ct_target_pool_size();
+
+/* Frees every pooled target that is not in use. */
+extern void ct_target_pool_clear();
+
 /* Target */
 
 extern void ct_target_push(CT_Texture* tex);
 
 extern void ct_target_pop();
 
+/* Post-processing
+   A chain renders what is drawn between ct_postfx_begin and ct_postfx_end
+   through its passes, ping-ponging between two targets of its own. A pass
+   with a scale below 1 runs at that fraction of the chain's resolution on
+   transient targets; the passes after it read the smaller result.
+
+   Built-in effects and their params (NULL picks the defaults):
+     CT_POSTFX_BLUR         radius in texels                  { 1 }
+     CT_POSTFX_BLOOM        threshold, radius, intensity       { .7, 1, 1 }
+     CT_POSTFX_COLOUR_GRADE brightness, contrast, saturation   { 0, 1, 1 }
+     CT_POSTFX_CRT          curvature, scanlines, vignette     { .1, .3, .5 }
+
+   Fragment shaders given to ct_postfx_add_shader run on the default
+   vertex shader and get `uniform sampler2D texture`, `uniform vec2 texel`
+   (the size of a source texel) and `uniform vec4 params`. */
+
+typedef struct _CT_PostFX CT_PostFX;
+
+typedef enum _CT_PostFXEffect
+{
+	CT_POSTFX_BLUR,
+	CT_POSTFX_BLOOM,
+	CT_POSTFX_COLOUR_GRADE,
+	CT_POSTFX_CRT,
+	CT_POSTFX_SHADER
+} CT_PostFXEffect;
+
+#define CT_POSTFX_MAX_PASSES 16
+
+extern CT_PostFX* ct_postfx_create(unsigned w, unsigned h);
+
+extern void ct_postfx_free(CT_PostFX* fx);
+
+/* Both return the index of the new pass, or -1 on error. */
+extern int ct_postfx_add(CT_PostFX* fx, CT_PostFXEffect effect,
+			 float scale, float* params);
+
+extern int ct_postfx_add_shader(CT_PostFX* fx, const char* fragment_source,
+				float scale, float* params);
+
+extern void ct_postfx_params_set(CT_PostFX* fx, unsigned pass, float* params);
+
+extern void ct_postfx_enabled_set(CT_PostFX* fx, unsigned pass, int enabled);
+
+/* Pushes the chain's first target. */
+extern void ct_postfx_begin(CT_PostFX* fx);
+
+/* Pops the target pushed by ct_postfx_begin and runs the passes. The
+   result stays valid until the next ct_postfx_begin, or when the last
+   pass is scaled, until ct_window_update. */
+extern CT_Texture* ct_postfx_end(CT_PostFX* fx);
+
+/* Cached layers
+   A layer keeps a drawing in a pooled target so it can be shown with a
+   single ct_texture_render of ct_layer_texture. ct_layer_begin returns 1
+   when the layer has to be drawn again: draw it, then call ct_layer_end.
+   That happens after ct_layer_invalidate, or when a texture or batch that
+   was rendered into it (or into a layer inside it) changed since. Other
+   changes, such as to colours or translations used inside the layer,
+   need ct_layer_invalidate. Freeing a texture or batch that was drawn
+   into a layer invalidates the layer.
+
+     if (ct_layer_begin(panel))
+     {
+         draw_panel();
+         ct_layer_end(panel);
+     }
+     ct_texture_render(ct_layer_texture(panel), &trans); */
+
+typedef struct _CT_Layer CT_Layer;
+
+extern CT_Layer* ct_layer_create(unsigned w, unsigned h);
+
+extern void ct_layer_free(CT_Layer* layer);
+
+extern int ct_layer_begin(CT_Layer* layer);
+
+extern void ct_layer_end(CT_Layer* layer);
+
+extern void ct_layer_invalidate(CT_Layer* layer);
+
+extern int ct_is_layer_valid(CT_Layer* layer);
+
+extern CT_Texture* ct_layer_texture(CT_Layer* layer);
+
+/* Dirty rectangles
+   Once enabled, draws to the screen are recorded instead of drawn. At
+   ct_window_update the frame is compared with the previous one, and only
+   the regions where something changed (a different draw, a batch change
+   or new texture contents) are drawn again, scissored, into a back buffer
+   that is then presented. Frames without any change are not presented at
+   all. Because drawing happens at ct_window_update, whatever is drawn to
+   the screen must stay alive until then. Uniforms set on a custom shader
+   and copies to the screen are not tracked, use ct_damage_add or
+   ct_damage_all for those. */
+
+extern void ct_dirty_rects_set(int enabled);
+
+extern int ct_dirty_rects();
+
+/* Marks `rect` (left, right, top, bottom in 0-1 units) to be redrawn. */
+extern void ct_damage_add(float* rect);
+
+extern void ct_damage_all();
+
+/* Pixels redrawn by the last ct_window_update. */
+extern unsigned ct_damage_area();
+
 /* Batch */
 
 extern CT_Batch* ct_batch_create(unsigned size_hint);
@@ -189,10 +658,26 @@ extern void ct_batch_render(CT_Batch* batch, CT_Texture* atlas);
 
 extern unsigned ct_batch_size(CT_Batch* batch);
 
+/* A baked batch keeps its positions transformed by the translation stack
+   and draws those with an identity modelview. They are transformed again
+   only when the batch changes or is rendered under another translation,
+   which pays off for batches that stay put for many frames or are drawn
+   into many targets. Baking happens right away too, so ct_batch_bounds
+   is up to date. */
+extern void ct_batch_bake(CT_Batch* batch);
+
+extern void ct_batch_unbake(CT_Batch* batch);
+
+/* Left, right, top and bottom of the batch, transformed as of the last
+   bake when baked. */
+extern void ct_batch_bounds(CT_Batch* batch, float* rect);
+
 /* Font */
 
 extern CT_Font* ct_font_load(const char* filename);
 
+extern CT_Font* ct_font_load_packed(CT_Pack* pack, const char* name);
+
 extern void ct_font_free(CT_Font* font);
 
 /* TODO: Use colour stack? */
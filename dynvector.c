@@ -28,6 +28,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include <string.h>
 #include <assert.h>
 #include "dynvector.h"
+#include "core.h"
 #include "aux.h"
 
 typedef struct _DV_IndexStack
@@ -39,8 +40,8 @@ typedef struct _DV_IndexStack
 
 DV_IndexStack* new_index_stack(unsigned size_hint)
 {
-	DV_IndexStack* is = smalloc(sizeof(DV_IndexStack));
-	is->data = smalloc(sizeof(unsigned) * size_hint);
+	DV_IndexStack* is = smalloc_tag(sizeof(DV_IndexStack), CT_MEMORY_BATCH);
+	is->data = smalloc_tag(sizeof(unsigned) * size_hint, CT_MEMORY_BATCH);
 	is->size_hint = size_hint;
 	is->size = 0;
 	return is;
@@ -48,8 +49,8 @@ DV_IndexStack* new_index_stack(unsigned size_hint)
 
 void free_index_stack(DV_IndexStack* is)
 {
-	free(is->data);
-	free(is);
+	sfree(is->data);
+	sfree(is);
 }
 
 void index_stack_grow(DV_IndexStack* is)
@@ -80,27 +81,28 @@ unsigned index_stack_pop(DV_IndexStack* is)
 
 DV_Vector* dv_vector_new(unsigned chunk_size, unsigned size_hint)
 {
-	DV_Vector* dv = smalloc(sizeof(DV_Vector));
+	DV_Vector* dv = smalloc_tag(sizeof(DV_Vector), CT_MEMORY_BATCH);
 	assert(dv);
-	dv->indices = smalloc(sizeof(unsigned)*size_hint);
+	dv->indices = smalloc_tag(sizeof(unsigned)*size_hint, CT_MEMORY_BATCH);
 	memset(dv->indices, 0, sizeof(unsigned)*size_hint);
 	dv->available_stack = new_index_stack(size_hint);
 	dv->last_stack = new_index_stack(size_hint);
 	dv->size = 0;
 	dv->size_hint = size_hint;
 	dv->chunk_size = chunk_size;
-	dv->data = smalloc(dv->chunk_size * sizeof(float) * size_hint);
+	dv->data = smalloc_tag(dv->chunk_size * sizeof(float) * size_hint,
+			       CT_MEMORY_BATCH);
 	memset(dv->data, 0, dv->chunk_size * sizeof(float) * size_hint);
 	return dv;
 }
 
 void dv_vector_free(DV_Vector* dv)
 {
-	free(dv->data);
-	free(dv->indices);
+	sfree(dv->data);
+	sfree(dv->indices);
 	free_index_stack(dv->available_stack);
 	free_index_stack(dv->last_stack);
-	free(dv);
+	sfree(dv);
 }
 
 unsigned vector_grow(DV_Vector* dv)
@@ -0,0 +1,664 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+/* Golden images
+   Every scene is drawn headlessly by the software backend and its last
+   frame is compared with golden/images/<scene>.png, which are kept in
+   the repository. A scene without a golden image fails. One tab
+   separated line per scene:
+
+     scene  result  differing_pixels  worst_delta  median_ms_per_frame
+
+   Pixels are compared perceptually, by their distance in YIQ after
+   blending over white, so rounding differences too small to see pass.
+   A scene fails when more than --pixels of its pixels (a fraction,
+   0 by default) differ by more than --threshold (0 to 1, default
+   0.1). Failures leave the frame and a diff, red where pixels differ,
+   in golden/out.
+
+   Usage: golden [--record] [--threshold t] [--pixels f] [scene-prefix]
+   --record writes the golden images of the scenes that run instead,
+   after a deliberate change to what they draw. */
+
+#include "core.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+#define GOLDEN_DIR "golden/images"
+#define OUT_DIR "golden/out"
+#define GOLDEN_W 320
+#define GOLDEN_H 240
+#define GOLDEN_SAMPLES 5
+
+typedef struct
+{
+	const char* name;
+	unsigned frames;   /* Shown per sample, the last one is compared */
+	void (*prepare)(); /* May be NULL */
+	void (*frame)(unsigned frame);
+	void (*finish)();  /* May be NULL */
+} Scene;
+
+static unsigned seed;
+
+static float random_float()
+{
+	seed = seed * 1664525 + 1013904223;
+	return (float)(seed >> 8) / (float)(1 << 24);
+}
+
+/* Textures */
+
+/* A `w` by `h` texture with `pattern` giving the RGBA of each texel. */
+static CT_Texture* pattern_texture(unsigned w, unsigned h,
+				   void (*pattern)(unsigned x, unsigned y,
+						   unsigned char* rgba))
+{
+	CT_Image* image = ct_image_create(w, h);
+	SDL_Surface* sur = image->sdl_surface;
+	unsigned x, y;
+	/* 32 bit images are read as RGBA in memory order */
+	for (y=0; y<h; y++)
+		for (x=0; x<w; x++)
+			pattern(x, y, (unsigned char*)sur->pixels + y*sur->pitch + x*4);
+	CT_Texture* tex = ct_image_to_texture(image);
+	ct_image_free(image);
+	return tex;
+}
+
+static void checker(unsigned x, unsigned y, unsigned char* rgba)
+{
+	int on = ((x / 4) + (y / 4)) & 1;
+	rgba[0] = on ? 240 : 30;
+	rgba[1] = x * 255 / 31;
+	rgba[2] = y * 255 / 31;
+	rgba[3] = 255;
+}
+
+/* A disc fading out to transparent edges. */
+static void disc(unsigned x, unsigned y, unsigned char* rgba)
+{
+	float dx = x - 15.5f, dy = y - 15.5f;
+	float d = 1 - (dx*dx + dy*dy) / (16*16);
+	if (d < 0) d = 0;
+	rgba[0] = 255;
+	rgba[1] = 160 + x * 3;
+	rgba[2] = 40 + y * 6;
+	rgba[3] = d * 255;
+}
+
+/* The same disc with its colour premultiplied by its alpha. */
+static void disc_premultiplied(unsigned x, unsigned y, unsigned char* rgba)
+{
+	int i;
+	disc(x, y, rgba);
+	for (i=0; i<3; i++) rgba[i] = rgba[i] * rgba[3] / 255;
+}
+
+static CT_Texture* checker_tex;
+static CT_Texture* disc_tex;
+static CT_Texture* premultiplied_tex;
+
+static void textures_prepare()
+{
+	checker_tex = pattern_texture(32, 32, checker);
+	disc_tex = pattern_texture(32, 32, disc);
+	premultiplied_tex = pattern_texture(32, 32, disc_premultiplied);
+}
+
+static void textures_finish()
+{
+	ct_texture_free(checker_tex);
+	ct_texture_free(disc_tex);
+	ct_texture_free(premultiplied_tex);
+}
+
+static void transformation(CT_Transformation* trans, float x, float y,
+			   float w, float h, float rotation)
+{
+	CT_Transformation t = {
+		{ 0, 1, 0, 1 },
+		{ x, x + w, y, y + h },
+		{ w / 2, h / 2 },
+		rotation,
+		-1, -1
+	};
+	*trans = t;
+}
+
+static void clear(float r, float g, float b)
+{
+	float colour[4] = { r, g, b, 1 };
+	ct_window_clear(colour);
+}
+
+/* Scenes */
+
+static void clear_frame(unsigned frame)
+{
+	clear(0.2f, 0.4f, 0.6f);
+}
+
+static void sprites_frame(unsigned frame)
+{
+	CT_Transformation trans;
+	unsigned i;
+	clear(0, 0, 0);
+	seed = 12345;
+	ct_blend_mode_push(CT_BLEND_MODE_TRANS);
+	for (i=0; i<200; i++)
+	{
+		float x = random_float() * 0.9f, y = random_float() * 0.9f;
+		float size = 0.05f + random_float() * 0.1f;
+		transformation(&trans, x, y, size, size * 4 / 3,
+			       random_float() * 360);
+		ct_texture_render(i & 1 ? disc_tex : checker_tex, &trans);
+	}
+	ct_blend_mode_pop();
+}
+
+/* Every blend mode in its own column, over a checker background. */
+static void blend_modes_frame(unsigned frame)
+{
+	static const CT_BlendMode modes[] = {
+		CT_BLEND_MODE_NORMAL, CT_BLEND_MODE_ADD, CT_BLEND_MODE_TRANS,
+		CT_BLEND_MODE_ONE_ONE, CT_BLEND_MODE_PREMULTIPLIED
+	};
+	float half[4] = { 1, 1, 1, 0.5f };
+	CT_Transformation trans;
+	unsigned i, j;
+	clear(0.1f, 0.1f, 0.1f);
+	ct_blend_mode_push(CT_BLEND_MODE_NORMAL);
+	transformation(&trans, 0, 0, 1, 1, 0);
+	ct_texture_render(checker_tex, &trans);
+	ct_blend_mode_pop();
+	for (i=0; i<5; i++)
+	{
+		CT_Texture* tex = modes[i] == CT_BLEND_MODE_PREMULTIPLIED ?
+			premultiplied_tex : disc_tex;
+		ct_blend_mode_push(modes[i]);
+		for (j=0; j<3; j++)
+		{
+			if (j == 2) ct_colour_push(half);
+			transformation(&trans, i * 0.2f, 0.1f + j * 0.25f,
+				       0.2f, 0.35f, 0);
+			ct_texture_render(tex, &trans);
+			if (j == 2) ct_colour_pop();
+		}
+		ct_blend_mode_pop();
+	}
+}
+
+/* Magnified and repeated past its edges with each filter and wrap. */
+static void sampling_frame(unsigned frame)
+{
+	static const CT_TextureWrap wraps[] = {
+		CT_TEXTURE_WRAP_REPEAT, CT_TEXTURE_WRAP_CLAMP, CT_TEXTURE_WRAP_MIRROR
+	};
+	CT_Transformation trans;
+	unsigned i, j;
+	clear(0, 0, 0);
+	ct_blend_mode_push(CT_BLEND_MODE_NORMAL);
+	for (i=0; i<2; i++)
+	{
+		ct_texture_filter_set(checker_tex, i ? CT_TEXTURE_FILTER_LINEAR
+				      : CT_TEXTURE_FILTER_NEAREST);
+		for (j=0; j<3; j++)
+		{
+			ct_texture_wrap_set(checker_tex, wraps[j]);
+			transformation(&trans, j / 3.0f, i / 2.0f,
+				       1 / 3.0f, 0.5f, 0);
+			trans.src_rect[0] = -0.7f;
+			trans.src_rect[1] = 1.6f;
+			trans.src_rect[2] = -0.4f;
+			trans.src_rect[3] = 1.3f;
+			ct_texture_render(checker_tex, &trans);
+		}
+	}
+	ct_blend_mode_pop();
+	ct_texture_filter_set(checker_tex, CT_TEXTURE_FILTER_NEAREST);
+	ct_texture_wrap_set(checker_tex, CT_TEXTURE_WRAP_REPEAT);
+}
+
+/* Colours scale the texels, beyond 1 too. */
+static void colours_frame(unsigned frame)
+{
+	CT_Transformation trans;
+	unsigned i;
+	clear(0.5f, 0.5f, 0.5f);
+	ct_blend_mode_push(CT_BLEND_MODE_TRANS);
+	for (i=0; i<8; i++)
+	{
+		float colour[4] = { (i & 1) ? 2.0f : 1.0f, (i & 2) ? 0.3f : 1.0f,
+				    (i & 4) ? 0.6f : 1.0f, 1 - i * 0.1f };
+		ct_colour_push(colour);
+		transformation(&trans, (i % 4) * 0.25f, (i / 4) * 0.5f,
+			       0.25f, 0.5f, i * 10.0f);
+		ct_texture_render(disc_tex, &trans);
+		ct_colour_pop();
+	}
+	ct_blend_mode_pop();
+}
+
+static CT_Texture* target_tex;
+
+static void targets_prepare()
+{
+	textures_prepare();
+	target_tex = ct_texture_create(64, 48);
+}
+
+static void targets_finish()
+{
+	ct_texture_free(target_tex);
+	textures_finish();
+}
+
+/* Drawn into a texture, which is then drawn and copied to the screen. */
+static void targets_frame(unsigned frame)
+{
+	float blue[4] = { 0, 0, 0.5f, 1 };
+	float src_rect[4] = { 0.25f, 0.75f, 0.25f, 0.75f };
+	float dst_pos[2] = { 0.7f, 0.7f };
+	CT_Transformation trans;
+	ct_texture_clear(target_tex, blue);
+	ct_target_push(target_tex);
+	ct_blend_mode_push(CT_BLEND_MODE_TRANS);
+	transformation(&trans, 0.1f, 0.1f, 0.5f, 0.5f, 30);
+	ct_texture_render(disc_tex, &trans);
+	transformation(&trans, 0.4f, 0.4f, 0.5f, 0.5f, 0);
+	ct_texture_render(checker_tex, &trans);
+	ct_blend_mode_pop();
+	ct_target_pop();
+	clear(0.3f, 0, 0);
+	ct_blend_mode_push(CT_BLEND_MODE_NORMAL);
+	transformation(&trans, 0.05f, 0.05f, 0.6f, 0.6f, -15);
+	ct_texture_render(target_tex, &trans);
+	ct_blend_mode_pop();
+	ct_texture_copy_rect(target_tex, src_rect, ct_screen_texture(), dst_pos);
+}
+
+/* Nested translations, scaled and rotated. */
+static void translation_frame(unsigned frame)
+{
+	float position[2] = { 0.5f, 0.5f };
+	float step[2] = { 0.1f, 0 };
+	CT_Transformation trans;
+	unsigned i;
+	clear(0, 0.2f, 0);
+	ct_blend_mode_push(CT_BLEND_MODE_TRANS);
+	ct_translation_push(position, 1, 0);
+	for (i=0; i<12; i++)
+	{
+		ct_translation_push(step, 0.9f, 30);
+		transformation(&trans, -0.05f, -0.05f, 0.1f, 0.1f, 0);
+		ct_texture_render(i & 1 ? checker_tex : disc_tex, &trans);
+	}
+	for (i=0; i<13; i++) ct_translation_pop();
+	ct_blend_mode_pop();
+}
+
+static CT_Batch* batch;
+
+static void batch_prepare()
+{
+	CT_Transformation trans;
+	unsigned i;
+	textures_prepare();
+	batch = ct_batch_create(400);
+	seed = 777;
+	for (i=0; i<400; i++)
+	{
+		float size = 0.03f + random_float() * 0.05f;
+		transformation(&trans, random_float() * 0.95f,
+			       random_float() * 0.95f, size, size,
+			       random_float() * 360);
+		ct_batch_push(batch, &trans);
+	}
+}
+
+static void batch_finish()
+{
+	ct_batch_free(batch);
+	textures_finish();
+}
+
+static void batch_frame(unsigned frame)
+{
+	clear(0.1f, 0, 0.1f);
+	ct_blend_mode_push(CT_BLEND_MODE_TRANS);
+	ct_batch_render(batch, disc_tex);
+	ct_blend_mode_pop();
+}
+
+static void dirty_prepare()
+{
+	textures_prepare();
+	ct_dirty_rects_set(1);
+}
+
+static void dirty_finish()
+{
+	ct_dirty_rects_set(0);
+	textures_finish();
+}
+
+/* One sprite moves while the rest stay, so only part is redrawn. */
+static void dirty_frame(unsigned frame)
+{
+	CT_Transformation trans;
+	unsigned i;
+	clear(0, 0, 0.2f);
+	ct_blend_mode_push(CT_BLEND_MODE_TRANS);
+	for (i=0; i<10; i++)
+	{
+		transformation(&trans, i * 0.09f, 0.2f, 0.15f, 0.2f, i * 20.0f);
+		ct_texture_render(disc_tex, &trans);
+	}
+	transformation(&trans, 0.1f + frame * 0.15f, 0.6f, 0.2f, 0.25f, 0);
+	ct_texture_render(checker_tex, &trans);
+	ct_blend_mode_pop();
+}
+
+/* Seven segment digits, bit 0 the top segment then clockwise, with
+   the middle one last. */
+static const unsigned char digit_segments[10] = {
+	0x3f, 0x06, 0x5b, 0x4f, 0x66, 0x6d, 0x7d, 0x07, 0x7f, 0x6f };
+
+static unsigned score;
+static CT_Texture* score_tex;
+
+/* `score` in three 8 by 12 digits, white on transparent. */
+static void score_digits(unsigned x, unsigned y, unsigned char* rgba)
+{
+	static const unsigned tens[3] = { 100, 10, 1 };
+	unsigned segments = digit_segments[score / tens[x / 8] % 10];
+	unsigned cx = x % 8, on = 0;
+	if (cx >= 1 && cx <= 6)
+	{
+		on |= (segments & 0x01) && y == 1 && cx >= 2 && cx <= 5;
+		on |= (segments & 0x40) && y == 6 && cx >= 2 && cx <= 5;
+		on |= (segments & 0x08) && y == 11 && cx >= 2 && cx <= 5;
+		on |= (segments & 0x20) && cx == 1 && y >= 1 && y <= 6;
+		on |= (segments & 0x02) && cx == 6 && y >= 1 && y <= 6;
+		on |= (segments & 0x10) && cx == 1 && y >= 6 && y <= 11;
+		on |= (segments & 0x04) && cx == 6 && y >= 6 && y <= 11;
+	}
+	rgba[0] = rgba[1] = rgba[2] = 255;
+	rgba[3] = on ? 255 : 0;
+}
+
+static void text_finish()
+{
+	ct_texture_free(score_tex);
+	score_tex = NULL;
+	dirty_finish();
+}
+
+/* A score drawn into a new texture every frame, like text, freeing the
+   last one first so the new texture takes its place in the pool. */
+static void text_frame(unsigned frame)
+{
+	CT_Transformation trans;
+	clear(0, 0, 0.2f);
+	if (score_tex) ct_texture_free(score_tex);
+	score = 107 + frame * 111;
+	score_tex = pattern_texture(24, 12, score_digits);
+	ct_blend_mode_push(CT_BLEND_MODE_TRANS);
+	transformation(&trans, 0.3f, 0.25f, 0.45f, 0.3f, 0);
+	ct_texture_render(score_tex, &trans);
+	transformation(&trans, 0.6f, 0.6f, 0.2f, 0.25f, 0);
+	ct_texture_render(disc_tex, &trans);
+	ct_blend_mode_pop();
+}
+
+static const Scene scenes[] = {
+	{ "clear",       1, NULL, clear_frame, NULL },
+	{ "sprites",     1, textures_prepare, sprites_frame, textures_finish },
+	{ "blend_modes", 1, textures_prepare, blend_modes_frame, textures_finish },
+	{ "sampling",    1, textures_prepare, sampling_frame, textures_finish },
+	{ "colours",     1, textures_prepare, colours_frame, textures_finish },
+	{ "targets",     1, targets_prepare, targets_frame, targets_finish },
+	{ "translation", 1, textures_prepare, translation_frame, textures_finish },
+	{ "batch",       1, batch_prepare, batch_frame, batch_finish },
+	{ "dirty_rects", 4, dirty_prepare, dirty_frame, dirty_finish },
+	{ "dirty_text",  4, dirty_prepare, text_frame, text_finish }
+};
+
+/* Comparing */
+
+static struct
+{
+	int is_recording;
+	double threshold;
+	double pixels;
+} options = { 0, 0.1, 0 };
+
+/* The largest delta, between black and white. */
+#define DELTA_MAX 35215.0
+
+static void yiq(const unsigned char* rgba, double* ret)
+{
+	/* Over white, so transparency counts */
+	double a = rgba[3] / 255.0;
+	double r = 255 + (rgba[0] - 255) * a;
+	double g = 255 + (rgba[1] - 255) * a;
+	double b = 255 + (rgba[2] - 255) * a;
+	ret[0] = r * 0.29889531 + g * 0.58662247 + b * 0.11448223;
+	ret[1] = r * 0.59597799 - g * 0.27417610 - b * 0.32180189;
+	ret[2] = r * 0.21147017 - g * 0.52261711 + b * 0.31114694;
+}
+
+/* Perceived difference, 0 to DELTA_MAX. */
+static double colour_delta(const unsigned char* a, const unsigned char* b)
+{
+	double p[3], q[3];
+	if (memcmp(a, b, 4) == 0) return 0;
+	yiq(a, p);
+	yiq(b, q);
+	double y = p[0] - q[0], i = p[1] - q[1], k = p[2] - q[2];
+	return 0.5053 * y*y + 0.299 * i*i + 0.1957 * k*k;
+}
+
+/* Counts the pixels that differ visibly and marks them red in `diff`,
+   over a faded copy of the golden image. */
+static unsigned compare(const unsigned char* frame, const unsigned char* golden,
+			unsigned count, unsigned char* diff, double* worst)
+{
+	double limit = DELTA_MAX * options.threshold * options.threshold;
+	unsigned i, differing = 0;
+	*worst = 0;
+	for (i=0; i<count; i++, frame+=4, golden+=4, diff+=4)
+	{
+		double delta = colour_delta(frame, golden);
+		if (delta > *worst) *worst = delta;
+		if (delta > limit)
+		{
+			diff[0] = 255; diff[1] = 0; diff[2] = 0;
+			differing++;
+		} else
+		{
+			double p[3];
+			yiq(golden, p);
+			diff[0] = diff[1] = diff[2] = 255 - (255 - p[0]) * 0.1;
+		}
+		diff[3] = 255;
+	}
+	*worst = sqrt(*worst / DELTA_MAX);
+	return differing;
+}
+
+static int save_png(const char* filename, const unsigned char* pixels,
+		    unsigned w, unsigned h)
+{
+	SDL_Surface* sur = SDL_CreateRGBSurfaceWithFormatFrom((void*)pixels,
+		w, h, 32, w * 4, SDL_PIXELFORMAT_RGBA32);
+	if (!sur) return 1;
+	int ret = IMG_SavePNG(sur, filename) != 0;
+	SDL_FreeSurface(sur);
+	return ret;
+}
+
+/* Returns the golden image as RGBA, NULL if there is none. */
+static SDL_Surface* load_golden(const char* filename)
+{
+	SDL_Surface* sur = IMG_Load(filename);
+	if (!sur) return NULL;
+	SDL_Surface* rgba = SDL_ConvertSurfaceFormat(sur, SDL_PIXELFORMAT_RGBA32, 0);
+	SDL_FreeSurface(sur);
+	return rgba;
+}
+
+/* Running */
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* Returns 1 if the scene failed. */
+static int scene_run(const Scene* scene)
+{
+	double samples[GOLDEN_SAMPLES];
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	unsigned i, j;
+	if (scene->prepare) scene->prepare();
+	for (i=0; i<GOLDEN_SAMPLES; i++)
+	{
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (j=0; j<scene->frames; j++)
+		{
+			scene->frame(j);
+			ct_window_update();
+		}
+		Uint64 end = SDL_GetPerformanceCounter();
+		samples[i] = (end - start) * 1e3 / frequency / scene->frames;
+	}
+	qsort(samples, GOLDEN_SAMPLES, sizeof(double), compare_double);
+	/* Without a swap the software screen keeps the frame shown. */
+	CT_Readback* readback = ct_readback_begin(ct_screen_texture());
+	const unsigned char* frame = ct_readback_wait(readback);
+	unsigned size[2];
+	ct_readback_size(readback, size);
+	if (scene->finish) scene->finish();
+
+	char golden_name[256], out_name[256];
+	snprintf(golden_name, sizeof(golden_name), GOLDEN_DIR "/%s.png", scene->name);
+	SDL_Surface* golden = options.is_recording ? NULL : load_golden(golden_name);
+	const char* result = "pass";
+	unsigned differing = 0;
+	double worst = 0;
+	int failed = 0;
+	if (options.is_recording)
+	{
+		result = "recorded";
+		if (save_png(golden_name, frame, size[0], size[1]))
+		{
+			result = "unwritable";
+			failed = 1;
+		}
+	} else if (!golden)
+	{
+		result = "missing";
+		failed = 1;
+		snprintf(out_name, sizeof(out_name), OUT_DIR "/%s.png", scene->name);
+		save_png(out_name, frame, size[0], size[1]);
+	} else if ((unsigned)golden->w != size[0] || (unsigned)golden->h != size[1] ||
+		   golden->pitch != golden->w * 4)
+	{
+		result = "size";
+		failed = 1;
+	} else
+	{
+		unsigned char* diff = malloc(size[0] * size[1] * 4);
+		SDL_LockSurface(golden);
+		differing = compare(frame, golden->pixels, size[0] * size[1],
+				    diff, &worst);
+		SDL_UnlockSurface(golden);
+		if (differing > options.pixels * size[0] * size[1])
+		{
+			result = "FAIL";
+			failed = 1;
+			snprintf(out_name, sizeof(out_name), OUT_DIR "/%s.png", scene->name);
+			save_png(out_name, frame, size[0], size[1]);
+			snprintf(out_name, sizeof(out_name), OUT_DIR "/%s_diff.png", scene->name);
+			save_png(out_name, diff, size[0], size[1]);
+		}
+		free(diff);
+	}
+	if (golden) SDL_FreeSurface(golden);
+	ct_readback_free(readback);
+	printf("%s\t%s\t%u\t%.4f\t%.3f\n", scene->name, result, differing, worst,
+	       samples[GOLDEN_SAMPLES/2]);
+	fflush(stdout);
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	const char* prefix = "";
+	int i, failures = 0;
+	for (i=1; i<argc; i++)
+	{
+		if (strcmp(argv[i], "--record") == 0)
+			options.is_recording = 1;
+		else if (strcmp(argv[i], "--threshold") == 0 && i+1 < argc)
+			options.threshold = atof(argv[++i]);
+		else if (strcmp(argv[i], "--pixels") == 0 && i+1 < argc)
+			options.pixels = atof(argv[++i]);
+		else
+			prefix = argv[i];
+	}
+
+	ct_window_backend_set(CT_BACKEND_SOFTWARE);
+	if (ct_window_init() != 0)
+	{
+		fprintf(stderr, "golden: %s\n", ct_get_error());
+		return 1;
+	}
+	unsigned resolution[2] = { GOLDEN_W, GOLDEN_H };
+	ct_window_resolution_set(resolution);
+	mkdir(GOLDEN_DIR, 0755);
+	mkdir(OUT_DIR, 0755);
+
+	printf("# light_engine golden 1\n");
+	printf("# threshold\t%g\n", options.threshold);
+	printf("# scene\tresult\tdiffering_pixels\tworst_delta\tmedian_ms\n");
+	for (i=0; i<(int)(sizeof(scenes)/sizeof(Scene)); i++)
+	{
+		const Scene* scene = scenes + i;
+		if (strncmp(scene->name, prefix, strlen(prefix)) != 0) continue;
+		failures += scene_run(scene);
+	}
+	ct_window_quit();
+	if (failures) printf("# %d failed\n", failures);
+	return failures != 0;
+}
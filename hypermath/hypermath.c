@@ -51,7 +51,7 @@ float hpmDot(float ax, float ay, float az, float bx, float by, float bz){
     return ax*bx + ay*by + az*bz;
 }
 
-void hpmMat4VecMult(const float *mat, float *vec){
+void hpmMat4VecMultScalar(const float *mat, float *vec){
     HPMmat4 *m = (HPMmat4 *) mat;
     float x, y, z;
     x = vec[0]; y = vec[1]; z = vec[2];
@@ -60,15 +60,26 @@ void hpmMat4VecMult(const float *mat, float *vec){
     vec[2] = m->_31*x + m->_32*y + m->_33*z + m->_34;
 }
 
-void hpmMat4VecArrayMult(const float *mat, float *vec, size_t length, size_t stride){
+void hpmMat4VecArrayMultScalar(const float *mat, float *vec, size_t length, size_t stride){
     int i;
     stride = (stride) ? stride : 3 * sizeof(float);
     for (i = 0; i < length; i++){
-        hpmMat4VecMult(mat, vec);
+        hpmMat4VecMultScalar(mat, vec);
         vec = ((float *) ((char *) vec + stride));
     }
 }
 
+void hpmMat4Vec2ArrayMultScalar(const float *mat, float *vec, size_t length){
+    HPMmat4 *m = (HPMmat4 *) mat;
+    size_t i;
+    for (i = 0; i < length; i++){
+        float x = vec[0], y = vec[1];
+        vec[0] = m->_11*x + m->_12*y + m->_14;
+        vec[1] = m->_21*x + m->_22*y + m->_24;
+        vec += 2;
+    }
+}
+
 // Matrix operations
 static void initMat4(HPMmat4 *m){
   memset(m, 0, sizeof(HPMmat4));
@@ -95,7 +106,7 @@ void hpmIdentityMat4(float *mat){
     m->_44 = 1.0;
 }
 
-void hpmMultMat4(const float *matA, const float *matB, float *result){
+void hpmMultMat4Scalar(const float *matA, const float *matB, float *result){
     HPMmat4 *a = (HPMmat4 *) matA;
     HPMmat4 *b = (HPMmat4 *) matB;
     HPMmat4 *r = (HPMmat4 *) result;
@@ -423,7 +434,7 @@ void hpmTranspose(const float *mat, float *result){
     r->_44 = m->_44;
 }
 
-void hpmInverse(const float *mat, float *result){
+void hpmInverseScalar(const float *mat, float *result){
     HPMmat4 *m = (HPMmat4 *) mat;
     HPMmat4 inv;
     float det;
@@ -542,14 +553,13 @@ void hpmInverse(const float *mat, float *result){
         m->_31 * m->_13 * m->_22;
 
     det = m->_11 * inv._11 + m->_12 * inv._21 + m->_13 * inv._31 + m->_14 * inv._41;
-    det = 1.0 / det;
-
     float *in = (float *) &inv;
 
     if (det == 0){
         for (i = 0; i < 16; i++)
             result[i] = 0;
     } else {
+        det = 1.0 / det;
         for (i = 0; i < 16; i++)
             result[i] = in[i] * det;
     }
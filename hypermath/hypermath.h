@@ -102,6 +102,27 @@ void hpmMat4VecMult(const float *mat, float *vec);
 
 void hpmMat4VecArrayMult(const float *mat, float *vec, size_t length, size_t stride);
 
+// Transforms `length` packed x, y pairs in place, ignoring z. Aligning
+// `vec` to 32 bytes lets the vector paths use aligned loads.
+void hpmMat4Vec2ArrayMult(const float *mat, float *vec, size_t length);
+
+// SIMD
+// hpmMultMat4, hpmInverse and the hpmMat4Vec* functions pick an SSE, AVX
+// or NEON implementation on first use. Setting HPM_SIMD to "scalar",
+// "sse" or "avx" caps the choice. The scalar versions stay available
+// as a reference.
+const char *hpmSimdLevel(void);
+
+void hpmMultMat4Scalar(const float *matA, const float *matB, float *result);
+
+void hpmInverseScalar(const float *mat, float *result);
+
+void hpmMat4VecMultScalar(const float *mat, float *vec);
+
+void hpmMat4VecArrayMultScalar(const float *mat, float *vec, size_t length, size_t stride);
+
+void hpmMat4Vec2ArrayMultScalar(const float *mat, float *vec, size_t length);
+
 // Projection
 void hpmOrtho(int width, int height, float near, float far, float *mat);
 
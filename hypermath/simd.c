@@ -0,0 +1,441 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hypermath.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HPM_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define HPM_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Kernels are picked once, on the first call of any of them. Until then
+// every pointer leads to a stub that resolves all of them.
+
+typedef void (*MultMat4Fn)(const float *, const float *, float *);
+typedef void (*InverseFn)(const float *, float *);
+typedef void (*VecMultFn)(const float *, float *);
+typedef void (*VecArrayMultFn)(const float *, float *, size_t, size_t);
+typedef void (*Vec2ArrayMultFn)(const float *, float *, size_t);
+
+static void resolve(void);
+
+static void multMat4Resolve(const float *a, const float *b, float *r);
+static void inverseResolve(const float *m, float *r);
+static void vecMultResolve(const float *m, float *v);
+static void vecArrayMultResolve(const float *m, float *v, size_t l, size_t s);
+static void vec2ArrayMultResolve(const float *m, float *v, size_t l);
+
+static struct {
+    MultMat4Fn multMat4;
+    InverseFn inverse;
+    VecMultFn vecMult;
+    VecArrayMultFn vecArrayMult;
+    Vec2ArrayMultFn vec2ArrayMult;
+    const char *level;
+} kernels = {
+    multMat4Resolve,
+    inverseResolve,
+    vecMultResolve,
+    vecArrayMultResolve,
+    vec2ArrayMultResolve,
+    NULL
+};
+
+#ifdef HPM_X86
+
+// SSE
+
+// Columns are contiguous, so column j of the result is the columns of
+// `a` weighted by column j of `b`.
+__attribute__((target("sse2")))
+static void multMat4SSE(const float *a, const float *b, float *r){
+    __m128 c0 = _mm_loadu_ps(a);
+    __m128 c1 = _mm_loadu_ps(a + 4);
+    __m128 c2 = _mm_loadu_ps(a + 8);
+    __m128 c3 = _mm_loadu_ps(a + 12);
+    __m128 out[4];
+    int j;
+    for (j = 0; j < 4; j++){
+        const float *bj = b + j*4;
+        __m128 v = _mm_mul_ps(c0, _mm_set1_ps(bj[0]));
+        v = _mm_add_ps(v, _mm_mul_ps(c1, _mm_set1_ps(bj[1])));
+        v = _mm_add_ps(v, _mm_mul_ps(c2, _mm_set1_ps(bj[2])));
+        v = _mm_add_ps(v, _mm_mul_ps(c3, _mm_set1_ps(bj[3])));
+        out[j] = v;
+    }
+    // `r` may alias `a` or `b`
+    _mm_storeu_ps(r,      out[0]);
+    _mm_storeu_ps(r + 4,  out[1]);
+    _mm_storeu_ps(r + 8,  out[2]);
+    _mm_storeu_ps(r + 12, out[3]);
+}
+
+#define SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x))
+#define SWIZZLE(a, x, y, z, w) SHUFFLE(a, a, x, y, z, w)
+
+// 2x2 blocks stored as (m00, m01, m10, m11)
+__attribute__((target("sse2")))
+static inline __m128 mat2Mul(__m128 a, __m128 b){
+    return _mm_add_ps(_mm_mul_ps(a, SWIZZLE(b, 0, 3, 0, 3)),
+                      _mm_mul_ps(SWIZZLE(a, 1, 0, 3, 2), SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+// adj(a) * b
+__attribute__((target("sse2")))
+static inline __m128 mat2AdjMul(__m128 a, __m128 b){
+    return _mm_sub_ps(_mm_mul_ps(SWIZZLE(a, 3, 3, 0, 0), b),
+                      _mm_mul_ps(SWIZZLE(a, 1, 1, 2, 2), SWIZZLE(b, 2, 3, 0, 1)));
+}
+
+// a * adj(b)
+__attribute__((target("sse2")))
+static inline __m128 mat2MulAdj(__m128 a, __m128 b){
+    return _mm_sub_ps(_mm_mul_ps(a, SWIZZLE(b, 3, 0, 3, 0)),
+                      _mm_mul_ps(SWIZZLE(a, 1, 0, 3, 2), SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+// Block wise inverse of | A B |
+//                       | C D | with 2x2 blocks. Inverting the transpose
+// gives the transposed inverse, so the storage order doesn't matter.
+__attribute__((target("sse2")))
+static void inverseSSE(const float *mat, float *result){
+    __m128 m0 = _mm_loadu_ps(mat);
+    __m128 m1 = _mm_loadu_ps(mat + 4);
+    __m128 m2 = _mm_loadu_ps(mat + 8);
+    __m128 m3 = _mm_loadu_ps(mat + 12);
+
+    __m128 A = _mm_movelh_ps(m0, m1);
+    __m128 B = _mm_movehl_ps(m1, m0);
+    __m128 C = _mm_movelh_ps(m2, m3);
+    __m128 D = _mm_movehl_ps(m3, m2);
+
+    // (|A|, |B|, |C|, |D|)
+    __m128 detSub = _mm_sub_ps(
+        _mm_mul_ps(SHUFFLE(m0, m2, 0, 2, 0, 2), SHUFFLE(m1, m3, 1, 3, 1, 3)),
+        _mm_mul_ps(SHUFFLE(m0, m2, 1, 3, 1, 3), SHUFFLE(m1, m3, 0, 2, 0, 2)));
+    __m128 detA = SWIZZLE(detSub, 0, 0, 0, 0);
+    __m128 detB = SWIZZLE(detSub, 1, 1, 1, 1);
+    __m128 detC = SWIZZLE(detSub, 2, 2, 2, 2);
+    __m128 detD = SWIZZLE(detSub, 3, 3, 3, 3);
+
+    __m128 DC = mat2AdjMul(D, C);
+    __m128 AB = mat2AdjMul(A, B);
+    __m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), mat2Mul(B, DC));
+    __m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), mat2Mul(C, AB));
+    __m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), mat2MulAdj(D, AB));
+    __m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), mat2MulAdj(A, DC));
+
+    // |M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+    __m128 tr = _mm_mul_ps(AB, SWIZZLE(DC, 0, 2, 1, 3));
+    tr = _mm_add_ps(tr, SWIZZLE(tr, 1, 0, 3, 2));
+    tr = _mm_add_ps(tr, SWIZZLE(tr, 2, 3, 0, 1));
+    __m128 detM = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(detA, detD),
+                                        _mm_mul_ps(detB, detC)), tr);
+
+    if (_mm_cvtss_f32(detM) == 0){
+        memset(result, 0, sizeof(float) * 16);
+        return;
+    }
+    __m128 rDetM = _mm_div_ps(_mm_setr_ps(1.f, -1.f, -1.f, 1.f), detM);
+    X = _mm_mul_ps(X, rDetM);
+    Y = _mm_mul_ps(Y, rDetM);
+    Z = _mm_mul_ps(Z, rDetM);
+    W = _mm_mul_ps(W, rDetM);
+
+    _mm_storeu_ps(result,      SHUFFLE(X, Y, 3, 1, 3, 1));
+    _mm_storeu_ps(result + 4,  SHUFFLE(X, Y, 2, 0, 2, 0));
+    _mm_storeu_ps(result + 8,  SHUFFLE(Z, W, 3, 1, 3, 1));
+    _mm_storeu_ps(result + 12, SHUFFLE(Z, W, 2, 0, 2, 0));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 vecMulSSE(__m128 c0, __m128 c1, __m128 c2, __m128 c3,
+                               const float *vec){
+    __m128 v = _mm_add_ps(c3, _mm_mul_ps(c0, _mm_set1_ps(vec[0])));
+    v = _mm_add_ps(v, _mm_mul_ps(c1, _mm_set1_ps(vec[1])));
+    return _mm_add_ps(v, _mm_mul_ps(c2, _mm_set1_ps(vec[2])));
+}
+
+__attribute__((target("sse2")))
+static void vecMultSSE(const float *mat, float *vec){
+    float out[4];
+    _mm_storeu_ps(out, vecMulSSE(_mm_loadu_ps(mat), _mm_loadu_ps(mat + 4),
+                                 _mm_loadu_ps(mat + 8), _mm_loadu_ps(mat + 12),
+                                 vec));
+    memcpy(vec, out, sizeof(float) * 3);
+}
+
+__attribute__((target("sse2")))
+static void vecArrayMultSSE(const float *mat, float *vec, size_t length, size_t stride){
+    __m128 c0 = _mm_loadu_ps(mat);
+    __m128 c1 = _mm_loadu_ps(mat + 4);
+    __m128 c2 = _mm_loadu_ps(mat + 8);
+    __m128 c3 = _mm_loadu_ps(mat + 12);
+    float out[4];
+    size_t i;
+    stride = (stride) ? stride : 3 * sizeof(float);
+    for (i = 0; i < length; i++){
+        _mm_storeu_ps(out, vecMulSSE(c0, c1, c2, c3, vec));
+        memcpy(vec, out, sizeof(float) * 3);
+        vec = ((float *) ((char *) vec + stride));
+    }
+}
+
+// Two interleaved points per register:
+// (x0, y0, x1, y1) -> (x0, x0, x1, x1) * (m11, m21, m11, m21)
+//                   + (y0, y0, y1, y1) * (m12, m22, m12, m22) + translation
+__attribute__((target("sse2")))
+static void vec2ArrayMultSSE(const float *mat, float *vec, size_t length){
+    __m128 cx = _mm_setr_ps(mat[0], mat[1], mat[0], mat[1]);
+    __m128 cy = _mm_setr_ps(mat[4], mat[5], mat[4], mat[5]);
+    __m128 t  = _mm_setr_ps(mat[12], mat[13], mat[12], mat[13]);
+    // A single point brings an 8 byte aligned array to 16 bytes.
+    if (length && ((uintptr_t)vec & 15) == 8){
+        hpmMat4Vec2ArrayMultScalar(mat, vec, 1);
+        vec += 2; length--;
+    }
+    size_t i, n = length / 2;
+    if (((uintptr_t)vec & 15) == 0){
+        for (i = 0; i < n; i++, vec += 4){
+            __m128 v = _mm_load_ps(vec);
+            __m128 r = _mm_add_ps(t, _mm_mul_ps(SWIZZLE(v, 0, 0, 2, 2), cx));
+            _mm_store_ps(vec, _mm_add_ps(r, _mm_mul_ps(SWIZZLE(v, 1, 1, 3, 3), cy)));
+        }
+    } else {
+        for (i = 0; i < n; i++, vec += 4){
+            __m128 v = _mm_loadu_ps(vec);
+            __m128 r = _mm_add_ps(t, _mm_mul_ps(SWIZZLE(v, 0, 0, 2, 2), cx));
+            _mm_storeu_ps(vec, _mm_add_ps(r, _mm_mul_ps(SWIZZLE(v, 1, 1, 3, 3), cy)));
+        }
+    }
+    hpmMat4Vec2ArrayMultScalar(mat, vec, length & 1);
+}
+
+// AVX
+
+// Two result columns per register, each lane half broadcasting its own
+// column of `b`.
+__attribute__((target("avx")))
+static void multMat4AVX(const float *a, const float *b, float *r){
+    __m256 c0 = _mm256_broadcast_ps((const __m128 *) a);
+    __m256 c1 = _mm256_broadcast_ps((const __m128 *) (a + 4));
+    __m256 c2 = _mm256_broadcast_ps((const __m128 *) (a + 8));
+    __m256 c3 = _mm256_broadcast_ps((const __m128 *) (a + 12));
+    __m256 out[2];
+    int j;
+    for (j = 0; j < 2; j++){
+        __m256 bj = _mm256_loadu_ps(b + j*8);
+        __m256 v = _mm256_mul_ps(c0, _mm256_permute_ps(bj, 0x00));
+        v = _mm256_add_ps(v, _mm256_mul_ps(c1, _mm256_permute_ps(bj, 0x55)));
+        v = _mm256_add_ps(v, _mm256_mul_ps(c2, _mm256_permute_ps(bj, 0xaa)));
+        v = _mm256_add_ps(v, _mm256_mul_ps(c3, _mm256_permute_ps(bj, 0xff)));
+        out[j] = v;
+    }
+    _mm256_storeu_ps(r,     out[0]);
+    _mm256_storeu_ps(r + 8, out[1]);
+}
+
+__attribute__((target("avx")))
+static void vec2ArrayMultAVX(const float *mat, float *vec, size_t length){
+    __m256 cx = _mm256_setr_ps(mat[0], mat[1], mat[0], mat[1],
+                               mat[0], mat[1], mat[0], mat[1]);
+    __m256 cy = _mm256_setr_ps(mat[4], mat[5], mat[4], mat[5],
+                               mat[4], mat[5], mat[4], mat[5]);
+    __m256 t  = _mm256_setr_ps(mat[12], mat[13], mat[12], mat[13],
+                               mat[12], mat[13], mat[12], mat[13]);
+    // Up to three points bring an 8 byte aligned array to 32 bytes.
+    while (length && ((uintptr_t)vec & 31) && !((uintptr_t)vec & 7)){
+        hpmMat4Vec2ArrayMultScalar(mat, vec, 1);
+        vec += 2; length--;
+    }
+    size_t i, n = length / 4;
+    if (((uintptr_t)vec & 31) == 0){
+        for (i = 0; i < n; i++, vec += 8){
+            __m256 v = _mm256_load_ps(vec);
+            __m256 r = _mm256_add_ps(t, _mm256_mul_ps(_mm256_moveldup_ps(v), cx));
+            _mm256_store_ps(vec, _mm256_add_ps(r, _mm256_mul_ps(_mm256_movehdup_ps(v), cy)));
+        }
+    } else {
+        for (i = 0; i < n; i++, vec += 8){
+            __m256 v = _mm256_loadu_ps(vec);
+            __m256 r = _mm256_add_ps(t, _mm256_mul_ps(_mm256_moveldup_ps(v), cx));
+            _mm256_storeu_ps(vec, _mm256_add_ps(r, _mm256_mul_ps(_mm256_movehdup_ps(v), cy)));
+        }
+    }
+    hpmMat4Vec2ArrayMultScalar(mat, vec, length & 3);
+}
+
+#endif // HPM_X86
+
+#ifdef HPM_NEON
+
+static void multMat4NEON(const float *a, const float *b, float *r){
+    float32x4_t c0 = vld1q_f32(a);
+    float32x4_t c1 = vld1q_f32(a + 4);
+    float32x4_t c2 = vld1q_f32(a + 8);
+    float32x4_t c3 = vld1q_f32(a + 12);
+    float32x4_t out[4];
+    int j;
+    for (j = 0; j < 4; j++){
+        float32x4_t bj = vld1q_f32(b + j*4);
+        float32x4_t v = vmulq_lane_f32(c0, vget_low_f32(bj), 0);
+        v = vmlaq_lane_f32(v, c1, vget_low_f32(bj), 1);
+        v = vmlaq_lane_f32(v, c2, vget_high_f32(bj), 0);
+        v = vmlaq_lane_f32(v, c3, vget_high_f32(bj), 1);
+        out[j] = v;
+    }
+    vst1q_f32(r,      out[0]);
+    vst1q_f32(r + 4,  out[1]);
+    vst1q_f32(r + 8,  out[2]);
+    vst1q_f32(r + 12, out[3]);
+}
+
+static void vecMultNEON(const float *mat, float *vec){
+    float32x4_t v = vld1q_f32(mat + 12);
+    v = vmlaq_n_f32(v, vld1q_f32(mat), vec[0]);
+    v = vmlaq_n_f32(v, vld1q_f32(mat + 4), vec[1]);
+    v = vmlaq_n_f32(v, vld1q_f32(mat + 8), vec[2]);
+    vec[0] = vgetq_lane_f32(v, 0);
+    vec[1] = vgetq_lane_f32(v, 1);
+    vec[2] = vgetq_lane_f32(v, 2);
+}
+
+static void vecArrayMultNEON(const float *mat, float *vec, size_t length, size_t stride){
+    size_t i;
+    stride = (stride) ? stride : 3 * sizeof(float);
+    for (i = 0; i < length; i++){
+        vecMultNEON(mat, vec);
+        vec = ((float *) ((char *) vec + stride));
+    }
+}
+
+// vld2q splits four points into their x and y parts.
+static void vec2ArrayMultNEON(const float *mat, float *vec, size_t length){
+    size_t i, n = length / 4;
+    for (i = 0; i < n; i++, vec += 8){
+        float32x4x2_t v = vld2q_f32(vec);
+        float32x4x2_t r;
+        r.val[0] = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(mat[12]), v.val[0], mat[0]),
+                               v.val[1], mat[4]);
+        r.val[1] = vmlaq_n_f32(vmlaq_n_f32(vdupq_n_f32(mat[13]), v.val[0], mat[1]),
+                               v.val[1], mat[5]);
+        vst2q_f32(vec, r);
+    }
+    hpmMat4Vec2ArrayMultScalar(mat, vec, length & 3);
+}
+
+#endif // HPM_NEON
+
+// Dispatch
+
+static void resolve(void){
+    const char *cap = getenv("HPM_SIMD");
+    int scalar = cap && strcmp(cap, "scalar") == 0;
+    kernels.multMat4      = hpmMultMat4Scalar;
+    kernels.inverse       = hpmInverseScalar;
+    kernels.vecMult       = hpmMat4VecMultScalar;
+    kernels.vecArrayMult  = hpmMat4VecArrayMultScalar;
+    kernels.vec2ArrayMult = hpmMat4Vec2ArrayMultScalar;
+    kernels.level         = "scalar";
+    if (scalar) return;
+#if defined(HPM_X86)
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("sse2")) return;
+    kernels.multMat4      = multMat4SSE;
+    kernels.inverse       = inverseSSE;
+    kernels.vecMult       = vecMultSSE;
+    kernels.vecArrayMult  = vecArrayMultSSE;
+    kernels.vec2ArrayMult = vec2ArrayMultSSE;
+    kernels.level         = "sse";
+    if (cap && strcmp(cap, "sse") == 0) return;
+    if (!__builtin_cpu_supports("avx")) return;
+    kernels.multMat4      = multMat4AVX;
+    kernels.vec2ArrayMult = vec2ArrayMultAVX;
+    kernels.level         = "avx";
+#elif defined(HPM_NEON)
+    kernels.multMat4      = multMat4NEON;
+    kernels.vecMult       = vecMultNEON;
+    kernels.vecArrayMult  = vecArrayMultNEON;
+    kernels.vec2ArrayMult = vec2ArrayMultNEON;
+    kernels.level         = "neon";
+#endif
+}
+
+static void multMat4Resolve(const float *a, const float *b, float *r){
+    resolve();
+    kernels.multMat4(a, b, r);
+}
+
+static void inverseResolve(const float *m, float *r){
+    resolve();
+    kernels.inverse(m, r);
+}
+
+static void vecMultResolve(const float *m, float *v){
+    resolve();
+    kernels.vecMult(m, v);
+}
+
+static void vecArrayMultResolve(const float *m, float *v, size_t l, size_t s){
+    resolve();
+    kernels.vecArrayMult(m, v, l, s);
+}
+
+static void vec2ArrayMultResolve(const float *m, float *v, size_t l){
+    resolve();
+    kernels.vec2ArrayMult(m, v, l);
+}
+
+const char *hpmSimdLevel(void){
+    if (!kernels.level) resolve();
+    return kernels.level;
+}
+
+void hpmMultMat4(const float *matA, const float *matB, float *result){
+    kernels.multMat4(matA, matB, result);
+}
+
+void hpmInverse(const float *mat, float *result){
+    kernels.inverse(mat, result);
+}
+
+void hpmMat4VecMult(const float *mat, float *vec){
+    kernels.vecMult(mat, vec);
+}
+
+void hpmMat4VecArrayMult(const float *mat, float *vec, size_t length, size_t stride){
+    kernels.vecArrayMult(mat, vec, length, stride);
+}
+
+void hpmMat4Vec2ArrayMult(const float *mat, float *vec, size_t length){
+    kernels.vec2ArrayMult(mat, vec, length);
+}
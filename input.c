@@ -24,6 +24,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 **/
 
 #include "input.h"
+#include "profile.h"
 #include <SDL2/SDL.h>
 
 typedef struct
@@ -141,6 +142,7 @@ unsigned ct_holded_keys(CT_Key* ret)
 
 void ct_poll_input()
 {
+	CT_PROFILE_BEGIN("ct_poll_input");
 	reset_stacks();
 
 	SDL_Event event;
@@ -164,6 +166,7 @@ void ct_poll_input()
 			break;
 		}
 	}
+	CT_PROFILE_END();
 }
 
 static const char* key_names[] = {
@@ -0,0 +1,635 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#include "ktx.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <GL/glew.h>
+
+/* No need to bring in the whole of core.h */
+extern void ct_set_error(const char* str);
+
+#ifndef GL_ETC1_RGB8_OES
+#define GL_ETC1_RGB8_OES 0x8D64
+#endif
+
+static const unsigned char ktx1_identifier[12] = {
+	0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31, 0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+static const unsigned char ktx2_identifier[12] = {
+	0xAB, 0x4B, 0x54, 0x58, 0x20, 0x32, 0x30, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A };
+
+/* Formats */
+
+/* The engine does no gamma correction, images are sampled as stored. So
+   sRGB formats are uploaded as their linear twin, the same way a PNG
+   would be. */
+static unsigned linear_format(unsigned format)
+{
+	switch (format)
+	{
+	case GL_SRGB8_ALPHA8: return GL_RGBA8;
+	case GL_COMPRESSED_SRGB_S3TC_DXT1_EXT: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT1_EXT: return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+	case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT3_EXT: return GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+	case GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case GL_COMPRESSED_SRGB8_ETC2: return GL_COMPRESSED_RGB8_ETC2;
+	case GL_COMPRESSED_SRGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+		return GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2;
+	case GL_COMPRESSED_SRGB8_ALPHA8_ETC2_EAC: return GL_COMPRESSED_RGBA8_ETC2_EAC;
+	/* ETC2 decoders read ETC1 as well */
+	case GL_ETC1_RGB8_OES: return GL_COMPRESSED_RGB8_ETC2;
+	}
+	if (format >= GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR &&
+	    format <= GL_COMPRESSED_SRGB8_ALPHA8_ASTC_12x12_KHR)
+	{
+		return format - GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR
+			+ GL_COMPRESSED_RGBA_ASTC_4x4_KHR;
+	}
+	return format;
+}
+
+static const unsigned astc_blocks[14][2] = {
+	{ 4, 4 }, { 5, 4 }, { 5, 5 }, { 6, 5 }, { 6, 6 }, { 8, 5 }, { 8, 6 },
+	{ 8, 8 }, { 10, 5 }, { 10, 6 }, { 10, 8 }, { 10, 10 }, { 12, 10 }, { 12, 12 } };
+
+/* Block footprint in texels and bytes, returns 0 for unknown formats. */
+static int block_info(unsigned format, unsigned* bw, unsigned* bh, unsigned* size)
+{
+	*bw = *bh = 4;
+	switch (format)
+	{
+	case GL_RGBA8:
+		*bw = *bh = 1; *size = 4; return 1;
+	case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RGB8_ETC2:
+	case GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2:
+		*size = 8; return 1;
+	case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+	case GL_COMPRESSED_RGBA8_ETC2_EAC:
+		*size = 16; return 1;
+	}
+	if (format >= GL_COMPRESSED_RGBA_ASTC_4x4_KHR &&
+	    format <= GL_COMPRESSED_RGBA_ASTC_12x12_KHR)
+	{
+		*bw = astc_blocks[format - GL_COMPRESSED_RGBA_ASTC_4x4_KHR][0];
+		*bh = astc_blocks[format - GL_COMPRESSED_RGBA_ASTC_4x4_KHR][1];
+		*size = 16;
+		return 1;
+	}
+	return 0;
+}
+
+static unsigned vk_format_to_gl(unsigned vk)
+{
+	switch (vk)
+	{
+	case 37: case 43: return GL_RGBA8;
+	case 131: case 132: return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case 133: case 134: return GL_COMPRESSED_RGBA_S3TC_DXT1_EXT;
+	case 135: case 136: return GL_COMPRESSED_RGBA_S3TC_DXT3_EXT;
+	case 137: case 138: return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	case 147: case 148: return GL_COMPRESSED_RGB8_ETC2;
+	case 149: case 150: return GL_COMPRESSED_RGB8_PUNCHTHROUGH_ALPHA1_ETC2;
+	case 151: case 152: return GL_COMPRESSED_RGBA8_ETC2_EAC;
+	}
+	/* VK_FORMAT_ASTC_4x4_UNORM_BLOCK up to 12x12, unorm and srgb interleaved */
+	if (vk >= 157 && vk <= 184) return GL_COMPRESSED_RGBA_ASTC_4x4_KHR + (vk - 157) / 2;
+	return 0;
+}
+
+static unsigned level_size(unsigned size, unsigned level)
+{
+	size >>= level;
+	return size ? size : 1;
+}
+
+static size_t level_bytes(unsigned format, unsigned w, unsigned h)
+{
+	unsigned bw, bh, size;
+	block_info(format, &bw, &bh, &size);
+	return (size_t)((w + bw - 1) / bw) * ((h + bh - 1) / bh) * size;
+}
+
+/* Parsing */
+
+static uint32_t read_u32(const unsigned char* p)
+{
+	uint32_t v; memcpy(&v, p, 4); return v;
+}
+
+static uint64_t read_u64(const unsigned char* p)
+{
+	uint64_t v; memcpy(&v, p, 8); return v;
+}
+
+static int parse_error(const char* message)
+{
+	char str[1024];
+	sprintf(str, "KTX: %s", message);
+	ct_set_error(str);
+	return 1;
+}
+
+int ktx_is_ktx(const void* data, size_t size)
+{
+	return size >= 12 &&
+		(memcmp(data, ktx1_identifier, 12) == 0 ||
+		 memcmp(data, ktx2_identifier, 12) == 0);
+}
+
+static int parse_ktx1(const unsigned char* data, size_t size, KTX_Texture* ktx)
+{
+	if (size < 64) return parse_error("truncated header.");
+	if (read_u32(data+12) != 0x04030201)
+	{
+		return parse_error("files of the other byte order are not supported.");
+	}
+	uint32_t gl_type     = read_u32(data+16);
+	uint32_t gl_format   = read_u32(data+24);
+	uint32_t gl_internal = read_u32(data+28);
+	uint32_t depth       = read_u32(data+44);
+	uint32_t elements    = read_u32(data+48);
+	uint32_t faces       = read_u32(data+52);
+	uint32_t levels      = read_u32(data+56);
+	uint32_t kv_bytes    = read_u32(data+60);
+	if (levels > KTX_MAX_LEVELS) return parse_error("too many levels.");
+	if (depth > 1 || elements > 0 || faces != 1)
+	{
+		return parse_error("only 2D textures are supported.");
+	}
+	if (gl_type != 0)
+	{
+		/* Uncompressed, which is only useful as RGBA8 */
+		if (gl_type != GL_UNSIGNED_BYTE || gl_format != GL_RGBA)
+		{
+			return parse_error("only RGBA8 uncompressed data is supported.");
+		}
+		gl_internal = GL_RGBA8;
+	}
+	ktx->gl_internal_format = linear_format(gl_internal);
+	ktx->w      = read_u32(data+36);
+	ktx->h      = read_u32(data+40);
+	ktx->levels = levels ? levels : 1;
+	size_t offset = 64 + (size_t)kv_bytes;
+	unsigned i;
+	for (i=0; i<ktx->levels; i++)
+	{
+		if (offset > size || size - offset < 4)
+		{
+			return parse_error("truncated file.");
+		}
+		KTX_Level* level = ktx->level + i;
+		level->size = read_u32(data+offset);
+		/* The padding after the last level may be missing */
+		if (level->size > size - offset - 4)
+		{
+			return parse_error("truncated file.");
+		}
+		level->data = data + offset + 4;
+		offset += 4 + ((level->size + 3) & ~(size_t)3);
+	}
+	return 0;
+}
+
+static int parse_ktx2(const unsigned char* data, size_t size, KTX_Texture* ktx)
+{
+	if (size < 80) return parse_error("truncated header.");
+	uint32_t vk_format = read_u32(data+12);
+	uint32_t depth     = read_u32(data+28);
+	uint32_t layers    = read_u32(data+32);
+	uint32_t faces     = read_u32(data+36);
+	uint32_t levels    = read_u32(data+40);
+	uint32_t scheme    = read_u32(data+44);
+	if (depth > 0 || layers > 0 || faces != 1)
+	{
+		return parse_error("only 2D textures are supported.");
+	}
+	if (scheme != 0)
+	{
+		return parse_error("supercompressed files are not supported.");
+	}
+	ktx->gl_internal_format = vk_format_to_gl(vk_format);
+	ktx->w      = read_u32(data+20);
+	ktx->h      = read_u32(data+24);
+	ktx->levels = levels ? levels : 1;
+	if (ktx->levels > KTX_MAX_LEVELS) return parse_error("too many levels.");
+	if (80 + ktx->levels * 24 > size) return parse_error("truncated file.");
+	unsigned i;
+	for (i=0; i<ktx->levels; i++)
+	{
+		uint64_t offset = read_u64(data + 80 + i*24);
+		uint64_t length = read_u64(data + 88 + i*24);
+		if (offset > size || length > size - offset)
+		{
+			return parse_error("truncated file.");
+		}
+		ktx->level[i].data = data + offset;
+		ktx->level[i].size = length;
+	}
+	return 0;
+}
+
+int ktx_parse(const void* data, size_t size, KTX_Texture* ktx)
+{
+	int failed;
+	memset(ktx, 0, sizeof(KTX_Texture));
+	if (!ktx_is_ktx(data, size)) return parse_error("not a KTX file.");
+	if (memcmp(data, ktx1_identifier, 12) == 0)
+	{
+		failed = parse_ktx1(data, size, ktx);
+	} else
+	{
+		failed = parse_ktx2(data, size, ktx);
+	}
+	if (failed) return 1;
+	unsigned bw, bh, block_size;
+	if (!block_info(ktx->gl_internal_format, &bw, &bh, &block_size))
+	{
+		return parse_error("unsupported texture format.");
+	}
+	if (ktx->w == 0 || ktx->h == 0) return parse_error("empty texture.");
+	ktx->compressed = ktx->gl_internal_format != GL_RGBA8;
+	unsigned i;
+	for (i=0; i<ktx->levels; i++)
+	{
+		KTX_Level* level = ktx->level + i;
+		level->w = level_size(ktx->w, i);
+		level->h = level_size(ktx->h, i);
+		if (level->size < level_bytes(ktx->gl_internal_format, level->w, level->h))
+		{
+			return parse_error("level is smaller than its format requires.");
+		}
+	}
+	return 0;
+}
+
+/* Decoding
+   Used when the driver does not support a format. Each decoder writes
+   a 4x4 block of RGBA8 texels in row order. */
+
+static void rgb565(unsigned c, unsigned char* rgb)
+{
+	unsigned r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+/* Colour block shared by BC1, BC2 and BC3 */
+static void decode_bc1_colours(const unsigned char* src, unsigned char* out,
+			       int has_alpha, int four_colour)
+{
+	unsigned c0 = src[0] | (src[1] << 8);
+	unsigned c1 = src[2] | (src[3] << 8);
+	unsigned char palette[4][4];
+	rgb565(c0, palette[0]);
+	rgb565(c1, palette[1]);
+	palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+	int i;
+	for (i=0; i<3; i++)
+	{
+		if (four_colour || c0 > c1)
+		{
+			palette[2][i] = (2*palette[0][i] + palette[1][i] + 1) / 3;
+			palette[3][i] = (palette[0][i] + 2*palette[1][i] + 1) / 3;
+		} else
+		{
+			palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+			palette[3][i] = 0;
+		}
+	}
+	if (!four_colour && c0 <= c1 && has_alpha) palette[3][3] = 0;
+	uint32_t indices = read_u32(src+4);
+	for (i=0; i<16; i++)
+	{
+		memcpy(out + i*4, palette[(indices >> (i*2)) & 3], 4);
+	}
+}
+
+static void decode_bc1(const unsigned char* src, unsigned char* out, int has_alpha)
+{
+	decode_bc1_colours(src, out, has_alpha, 0);
+}
+
+static void decode_bc2(const unsigned char* src, unsigned char* out)
+{
+	decode_bc1_colours(src+8, out, 0, 1);
+	uint64_t alpha = read_u64(src);
+	int i;
+	for (i=0; i<16; i++)
+	{
+		out[i*4+3] = ((alpha >> (i*4)) & 15) * 17;
+	}
+}
+
+static void decode_bc3(const unsigned char* src, unsigned char* out)
+{
+	decode_bc1_colours(src+8, out, 0, 1);
+	unsigned a0 = src[0], a1 = src[1];
+	unsigned char palette[8];
+	palette[0] = a0;
+	palette[1] = a1;
+	int i;
+	if (a0 > a1)
+	{
+		for (i=1; i<7; i++) palette[i+1] = ((7-i)*a0 + i*a1 + 3) / 7;
+	} else
+	{
+		for (i=1; i<5; i++) palette[i+1] = ((5-i)*a0 + i*a1 + 2) / 5;
+		palette[6] = 0;
+		palette[7] = 255;
+	}
+	uint64_t indices = 0;
+	for (i=0; i<6; i++) indices |= (uint64_t)src[2+i] << (i*8);
+	for (i=0; i<16; i++)
+	{
+		out[i*4+3] = palette[(indices >> (i*3)) & 7];
+	}
+}
+
+static uint64_t read_be64(const unsigned char* p)
+{
+	uint64_t v = 0;
+	int i;
+	for (i=0; i<8; i++) v = (v << 8) | p[i];
+	return v;
+}
+
+static unsigned char clamp255(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static unsigned extend4(unsigned v) { return (v << 4) | v; }
+static unsigned extend5(unsigned v) { return (v << 3) | (v >> 2); }
+static unsigned extend6(unsigned v) { return (v << 2) | (v >> 4); }
+static unsigned extend7(unsigned v) { return (v << 1) | (v >> 6); }
+
+static const int etc1_modifiers[8][2] = {
+	{ 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 },
+	{ 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 } };
+
+static const int etc2_distances[8] = { 3, 6, 11, 16, 23, 32, 41, 64 };
+
+/* ETC pixel indices are stored column by column. */
+static unsigned etc_index(uint64_t block, unsigned x, unsigned y)
+{
+	unsigned bit = x*4 + y;
+	return (((block >> (bit + 16)) & 1) << 1) | ((block >> bit) & 1);
+}
+
+static void etc2_planar(uint64_t b, unsigned char* out)
+{
+	int o[3], h[3], v[3];
+	o[0] = extend6((b >> 57) & 63);
+	o[1] = extend7((((b >> 56) & 1) << 6) | ((b >> 49) & 63));
+	o[2] = extend6((((b >> 48) & 1) << 5) | (((b >> 43) & 3) << 3) | ((b >> 39) & 7));
+	h[0] = extend6((((b >> 34) & 31) << 1) | ((b >> 32) & 1));
+	h[1] = extend7((b >> 25) & 127);
+	h[2] = extend6((b >> 19) & 63);
+	v[0] = extend6((b >> 13) & 63);
+	v[1] = extend7((b >> 6) & 127);
+	v[2] = extend6(b & 63);
+	unsigned x, y, c;
+	for (y=0; y<4; y++)
+	{
+		for (x=0; x<4; x++)
+		{
+			unsigned char* p = out + (y*4+x)*4;
+			for (c=0; c<3; c++)
+			{
+				p[c] = clamp255((x*(h[c]-o[c]) + y*(v[c]-o[c]) + 4*o[c] + 2) >> 2);
+			}
+			p[3] = 255;
+		}
+	}
+}
+
+static void etc2_paint(uint64_t b, int paint[4][3], unsigned char* out)
+{
+	unsigned x, y, c;
+	for (y=0; y<4; y++)
+	{
+		for (x=0; x<4; x++)
+		{
+			unsigned char* p = out + (y*4+x)*4;
+			int* colour = paint[etc_index(b, x, y)];
+			for (c=0; c<3; c++) p[c] = clamp255(colour[c]);
+			p[3] = 255;
+		}
+	}
+}
+
+/* ETC2 RGB8, which includes ETC1 */
+static void decode_etc2_rgb(const unsigned char* src, unsigned char* out)
+{
+	uint64_t b = read_be64(src);
+	int base[2][3];
+	int c;
+	if ((b >> 33) & 1)
+	{
+		/* Differential mode, unless a channel overflows in which
+		   case the block uses one of the ETC2 modes. */
+		int overflow = -1;
+		for (c=0; c<3; c++)
+		{
+			int v = (b >> (59 - c*8)) & 31;
+			int d = (b >> (56 - c*8)) & 7;
+			if (d >= 4) d -= 8;
+			if (v + d < 0 || v + d > 31)
+			{
+				overflow = c;
+				break;
+			}
+			base[0][c] = extend5(v);
+			base[1][c] = extend5(v + d);
+		}
+		if (overflow == 0)
+		{
+			/* T mode */
+			int c0[3], c1[3];
+			c0[0] = extend4((((b >> 59) & 3) << 2) | ((b >> 56) & 3));
+			c0[1] = extend4((b >> 52) & 15);
+			c0[2] = extend4((b >> 48) & 15);
+			c1[0] = extend4((b >> 44) & 15);
+			c1[1] = extend4((b >> 40) & 15);
+			c1[2] = extend4((b >> 36) & 15);
+			int d = etc2_distances[(((b >> 34) & 3) << 1) | ((b >> 32) & 1)];
+			int paint[4][3];
+			for (c=0; c<3; c++)
+			{
+				paint[0][c] = c0[c];
+				paint[1][c] = c1[c] + d;
+				paint[2][c] = c1[c];
+				paint[3][c] = c1[c] - d;
+			}
+			etc2_paint(b, paint, out);
+			return;
+		}
+		if (overflow == 1)
+		{
+			/* H mode */
+			int c0[3], c1[3];
+			c0[0] = extend4((b >> 59) & 15);
+			c0[1] = extend4((((b >> 56) & 7) << 1) | ((b >> 52) & 1));
+			c0[2] = extend4((((b >> 51) & 1) << 3) | ((b >> 47) & 7));
+			c1[0] = extend4((b >> 43) & 15);
+			c1[1] = extend4((b >> 39) & 15);
+			c1[2] = extend4((b >> 35) & 15);
+			int order = ((c0[0] << 16) | (c0[1] << 8) | c0[2]) >=
+				((c1[0] << 16) | (c1[1] << 8) | c1[2]);
+			int d = etc2_distances[(((b >> 34) & 1) << 2) |
+					       (((b >> 32) & 1) << 1) | order];
+			int paint[4][3];
+			for (c=0; c<3; c++)
+			{
+				paint[0][c] = c0[c] + d;
+				paint[1][c] = c0[c] - d;
+				paint[2][c] = c1[c] + d;
+				paint[3][c] = c1[c] - d;
+			}
+			etc2_paint(b, paint, out);
+			return;
+		}
+		if (overflow == 2)
+		{
+			etc2_planar(b, out);
+			return;
+		}
+	} else
+	{
+		/* Individual mode */
+		for (c=0; c<3; c++)
+		{
+			base[0][c] = extend4((b >> (60 - c*8)) & 15);
+			base[1][c] = extend4((b >> (56 - c*8)) & 15);
+		}
+	}
+	unsigned table[2] = { (b >> 37) & 7, (b >> 34) & 7 };
+	int flip = (b >> 32) & 1;
+	unsigned x, y;
+	for (y=0; y<4; y++)
+	{
+		for (x=0; x<4; x++)
+		{
+			unsigned sub = flip ? y >= 2 : x >= 2;
+			unsigned index = etc_index(b, x, y);
+			int modifier = etc1_modifiers[table[sub]][index & 1];
+			if (index & 2) modifier = -modifier;
+			unsigned char* p = out + (y*4+x)*4;
+			for (c=0; c<3; c++) p[c] = clamp255(base[sub][c] + modifier);
+			p[3] = 255;
+		}
+	}
+}
+
+static const int eac_modifiers[16][8] = {
+	{ -3, -6, -9, -15, 2, 5, 8, 14 },
+	{ -3, -7, -10, -13, 2, 6, 9, 12 },
+	{ -2, -5, -8, -13, 1, 4, 7, 12 },
+	{ -2, -4, -6, -13, 1, 3, 5, 12 },
+	{ -3, -6, -8, -12, 2, 5, 7, 11 },
+	{ -3, -7, -9, -11, 2, 6, 8, 10 },
+	{ -4, -7, -8, -11, 3, 6, 7, 10 },
+	{ -3, -5, -8, -11, 2, 4, 7, 10 },
+	{ -2, -6, -8, -10, 1, 5, 7, 9 },
+	{ -2, -5, -8, -10, 1, 4, 7, 9 },
+	{ -2, -4, -8, -10, 1, 3, 7, 9 },
+	{ -2, -5, -7, -10, 1, 4, 6, 9 },
+	{ -3, -4, -7, -10, 2, 3, 6, 9 },
+	{ -1, -2, -3, -10, 0, 1, 2, 9 },
+	{ -4, -6, -8, -9, 3, 5, 7, 8 },
+	{ -3, -5, -7, -9, 2, 4, 6, 8 } };
+
+static void decode_etc2_rgba(const unsigned char* src, unsigned char* out)
+{
+	decode_etc2_rgb(src+8, out);
+	uint64_t b = read_be64(src);
+	int base = (b >> 56) & 255;
+	int multiplier = (b >> 52) & 15;
+	const int* modifiers = eac_modifiers[(b >> 48) & 15];
+	unsigned x, y;
+	for (x=0; x<4; x++)
+	{
+		for (y=0; y<4; y++)
+		{
+			unsigned index = (b >> (45 - (x*4+y)*3)) & 7;
+			out[(y*4+x)*4+3] = clamp255(base + modifiers[index] * multiplier);
+		}
+	}
+}
+
+int ktx_can_decode(unsigned gl_internal_format)
+{
+	switch (gl_internal_format)
+	{
+	case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT:
+	case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+	case GL_COMPRESSED_RGB8_ETC2:
+	case GL_COMPRESSED_RGBA8_ETC2_EAC:
+		return 1;
+	}
+	return 0;
+}
+
+void ktx_decode(KTX_Texture* ktx, unsigned level, unsigned char* rgba)
+{
+	KTX_Level* l = ktx->level + level;
+	unsigned format = ktx->gl_internal_format;
+	unsigned bw, bh, block_size;
+	block_info(format, &bw, &bh, &block_size);
+	const unsigned char* src = l->data;
+	unsigned char block[16*4];
+	unsigned bx, by, y;
+	for (by=0; by<l->h; by+=4)
+	{
+		for (bx=0; bx<l->w; bx+=4, src+=block_size)
+		{
+			switch (format)
+			{
+			case GL_COMPRESSED_RGB_S3TC_DXT1_EXT: decode_bc1(src, block, 0); break;
+			case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT: decode_bc1(src, block, 1); break;
+			case GL_COMPRESSED_RGBA_S3TC_DXT3_EXT: decode_bc2(src, block); break;
+			case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT: decode_bc3(src, block); break;
+			case GL_COMPRESSED_RGB8_ETC2: decode_etc2_rgb(src, block); break;
+			case GL_COMPRESSED_RGBA8_ETC2_EAC: decode_etc2_rgba(src, block); break;
+			default: memset(block, 0, sizeof(block));
+			}
+			/* Clip blocks that hang over the edge */
+			unsigned w = l->w - bx < 4 ? l->w - bx : 4;
+			unsigned h = l->h - by < 4 ? l->h - by : 4;
+			for (y=0; y<h; y++)
+			{
+				memcpy(rgba + ((by+y)*l->w + bx)*4, block + y*16, w*4);
+			}
+		}
+	}
+}
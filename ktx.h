@@ -0,0 +1,60 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#ifndef __ktx_h_
+#define __ktx_h_
+
+#include <stddef.h>
+
+#define KTX_MAX_LEVELS 16
+
+typedef struct _KTX_Level
+{
+	const unsigned char* data;
+	size_t size;
+	unsigned w, h;
+} KTX_Level;
+
+/* A parsed KTX or KTX2 file, the levels point into the file's bytes. */
+typedef struct _KTX_Texture
+{
+	unsigned gl_internal_format;
+	int compressed;
+	unsigned w, h;
+	unsigned levels;
+	KTX_Level level[KTX_MAX_LEVELS];
+} KTX_Texture;
+
+extern int ktx_is_ktx(const void* data, size_t size);
+
+/* Returns 0 on success, sets the error otherwise. */
+extern int ktx_parse(const void* data, size_t size, KTX_Texture* ktx);
+
+extern int ktx_can_decode(unsigned gl_internal_format);
+
+/* Decompresses a level to tightly packed RGBA8. */
+extern void ktx_decode(KTX_Texture* ktx, unsigned level, unsigned char* rgba);
+
+#endif /* __ktx_h_ */
@@ -0,0 +1,320 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#include "pack.h"
+#include "aux.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+
+/* No need to bring in the whole of core.h */
+extern void ct_set_error(const char* str);
+
+#define PACK_MAGIC "LEPK"
+#define PACK_VERSION 1
+/* Asset data is aligned so it can be handed to the GPU as is. */
+#define PACK_ALIGN 16
+
+typedef struct
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t reserved;
+} PackHeader;
+
+typedef struct
+{
+	uint64_t hash;
+	uint64_t offset;
+	uint64_t size;
+	uint32_t name_offset;
+	uint32_t name_size;
+} PackEntry;
+
+static const PackEntry* pack_entries(CT_Pack* pack)
+{
+	return (const PackEntry*)(pack->data + sizeof(PackHeader));
+}
+
+/* Whether the header and every entry fit in the `size` bytes mapped,
+   so ct_pack_find can trust the table. */
+static int is_pack_valid(const void* data, size_t size)
+{
+	const PackHeader* header = data;
+	if (memcmp(header->magic, PACK_MAGIC, 4) != 0 ||
+	    header->version != PACK_VERSION ||
+	    (uint64_t)header->count * sizeof(PackEntry) > size - sizeof(PackHeader))
+	{
+		return 0;
+	}
+	const PackEntry* entries =
+		(const PackEntry*)((const char*)data + sizeof(PackHeader));
+	uint32_t i;
+	for (i=0; i<header->count; i++)
+	{
+		const PackEntry* entry = entries + i;
+		if (entry->offset > size || entry->size > size - entry->offset ||
+		    entry->name_offset > size ||
+		    entry->name_size > size - entry->name_offset)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+CT_Pack* ct_pack_open(const char* filename)
+{
+	char str[1024];
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		sprintf(str, "%s: file not found.", filename);
+		ct_set_error(str);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(PackHeader))
+	{
+		close(fd);
+		sprintf(str, "%s: not a pack file.", filename);
+		ct_set_error(str);
+		return NULL;
+	}
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	/* The mapping keeps the file alive. */
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		sprintf(str, "%s: could not map file.", filename);
+		ct_set_error(str);
+		return NULL;
+	}
+	const PackHeader* header = data;
+	if (!is_pack_valid(data, st.st_size))
+	{
+		munmap(data, st.st_size);
+		sprintf(str, "%s: not a pack file.", filename);
+		ct_set_error(str);
+		return NULL;
+	}
+	/* Assets are usually loaded in one go at startup. */
+	madvise(data, st.st_size, MADV_WILLNEED);
+	CT_Pack* pack = smalloc(sizeof(CT_Pack));
+	pack->data  = data;
+	pack->size  = st.st_size;
+	pack->count = header->count;
+	return pack;
+}
+
+void ct_pack_close(CT_Pack* pack)
+{
+	munmap((void*)pack->data, pack->size);
+	sfree(pack);
+}
+
+unsigned ct_pack_count(CT_Pack* pack)
+{
+	return pack->count;
+}
+
+const void* ct_pack_find(CT_Pack* pack, const char* name, size_t* size)
+{
+	size_t name_size = strlen(name);
+	uint64_t hash = fnv1a(name, name_size, FNV1A_SEED);
+	const PackEntry* entries = pack_entries(pack);
+	/* Binary search for the first entry with this hash */
+	unsigned lo = 0, hi = pack->count;
+	while (lo < hi)
+	{
+		unsigned mid = lo + (hi - lo) / 2;
+		if (entries[mid].hash < hash) lo = mid + 1;
+		else hi = mid;
+	}
+	/* Walk over collisions */
+	for (; lo < pack->count && entries[lo].hash == hash; lo++)
+	{
+		const PackEntry* entry = entries + lo;
+		if (entry->name_size == name_size &&
+		    memcmp(pack->data + entry->name_offset, name, name_size) == 0)
+		{
+			if (size) *size = entry->size;
+			return pack->data + entry->offset;
+		}
+	}
+	return NULL;
+}
+
+SDL_RWops* ct_pack_rw(CT_Pack* pack, const char* name)
+{
+	size_t size;
+	const void* data = ct_pack_find(pack, name, &size);
+	if (!data)
+	{
+		char str[1024];
+		sprintf(str, "%s: not found in pack.", name);
+		ct_set_error(str);
+		return NULL;
+	}
+	return SDL_RWFromConstMem(data, size);
+}
+
+/* Pack building */
+
+typedef struct
+{
+	PackEntry entry;
+	const char* name;
+	const char* path;
+} BuildEntry;
+
+static int compare_build_entries(const void* a, const void* b)
+{
+	uint64_t ha = ((const BuildEntry*)a)->entry.hash;
+	uint64_t hb = ((const BuildEntry*)b)->entry.hash;
+	return ha < hb ? -1 : ha > hb;
+}
+
+static uint64_t align_up(uint64_t v)
+{
+	return (v + PACK_ALIGN - 1) & ~(uint64_t)(PACK_ALIGN - 1);
+}
+
+static int copy_file(FILE* out, const char* path, uint64_t size)
+{
+	FILE* in = fopen(path, "rb");
+	if (!in) return 1;
+	char buffer[1 << 16];
+	while (size)
+	{
+		size_t n = size < sizeof(buffer) ? size : sizeof(buffer);
+		if (fread(buffer, 1, n, in) != n || fwrite(buffer, 1, n, out) != n)
+		{
+			fclose(in);
+			return 1;
+		}
+		size -= n;
+	}
+	fclose(in);
+	return 0;
+}
+
+int ct_pack_build(const char* filename,
+		  const char** names,
+		  const char** paths,
+		  unsigned count)
+{
+	char str[1024];
+	BuildEntry* entries = smalloc(sizeof(BuildEntry) * (count ? count : 1));
+	uint64_t names_size = 0;
+	unsigned i;
+	for (i=0; i<count; i++)
+	{
+		FILE* file = fopen(paths[i], "rb");
+		if (!file)
+		{
+			sfree(entries);
+			sprintf(str, "%s: file not found.", paths[i]);
+			ct_set_error(str);
+			return 1;
+		}
+		fseek(file, 0, SEEK_END);
+		entries[i].entry.size = ftell(file);
+		fclose(file);
+		entries[i].name = names[i];
+		entries[i].path = paths[i];
+		entries[i].entry.name_size = strlen(names[i]);
+		entries[i].entry.hash = fnv1a(names[i],
+					      entries[i].entry.name_size,
+					      FNV1A_SEED);
+		names_size += entries[i].entry.name_size;
+	}
+	qsort(entries, count, sizeof(BuildEntry), compare_build_entries);
+	/* Lay out names right after the table, then the aligned data. */
+	uint64_t offset = sizeof(PackHeader) + sizeof(PackEntry) * count;
+	for (i=0; i<count; i++)
+	{
+		entries[i].entry.name_offset = offset;
+		offset += entries[i].entry.name_size;
+	}
+	for (i=0; i<count; i++)
+	{
+		offset = align_up(offset);
+		entries[i].entry.offset = offset;
+		offset += entries[i].entry.size;
+	}
+	/**/
+	FILE* out = fopen(filename, "wb");
+	if (!out)
+	{
+		sfree(entries);
+		sprintf(str, "%s: could not create file.", filename);
+		ct_set_error(str);
+		return 1;
+	}
+	PackHeader header;
+	memcpy(header.magic, PACK_MAGIC, 4);
+	header.version  = PACK_VERSION;
+	header.count    = count;
+	header.reserved = 0;
+	int failed = fwrite(&header, sizeof(header), 1, out) != 1;
+	for (i=0; i<count; i++)
+	{
+		failed |= fwrite(&entries[i].entry, sizeof(PackEntry), 1, out) != 1;
+	}
+	for (i=0; i<count; i++)
+	{
+		failed |= fwrite(entries[i].name, 1, entries[i].entry.name_size, out)
+			!= entries[i].entry.name_size;
+	}
+	for (i=0; i<count && !failed; i++)
+	{
+		static const char padding[PACK_ALIGN];
+		long pad = entries[i].entry.offset - ftell(out);
+		failed |= fwrite(padding, 1, pad, out) != (size_t)pad;
+		if (copy_file(out, entries[i].path, entries[i].entry.size))
+		{
+			sprintf(str, "%s: could not read file.", entries[i].path);
+			failed = 2;
+		}
+	}
+	fclose(out);
+	sfree(entries);
+	if (failed)
+	{
+		if (failed != 2) sprintf(str, "%s: could not write file.", filename);
+		ct_set_error(str);
+		remove(filename);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,67 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#ifndef __pack_h__
+#define __pack_h__
+
+#include <stddef.h>
+
+typedef struct SDL_RWops SDL_RWops;
+
+/*
+   Pack
+   A single read-only file holding many assets. The file is memory mapped
+   when opened, lookups go through a table of contents sorted by name hash
+   and the *_load_packed functions decode straight from the mapped bytes.
+   Packs are written by ct_pack_build and use the byte order of the
+   machine that built them.
+*/
+typedef struct _CT_Pack
+{
+	const unsigned char* data;
+	size_t size;
+	unsigned count;
+} CT_Pack;
+
+extern CT_Pack* ct_pack_open(const char* filename);
+
+extern void ct_pack_close(CT_Pack* pack);
+
+extern unsigned ct_pack_count(CT_Pack* pack);
+
+/* Returns NULL when there is no asset called `name`. */
+extern const void* ct_pack_find(CT_Pack* pack, const char* name, size_t* size);
+
+/* Read-only stream over the asset's bytes, valid while the pack is open. */
+extern SDL_RWops* ct_pack_rw(CT_Pack* pack, const char* name);
+
+/* Writes the files in `paths` to a new pack, stored under `names`.
+   Returns 0 on success. */
+extern int ct_pack_build(const char* filename,
+			 const char** names,
+			 const char** paths,
+			 unsigned count);
+
+#endif /* __pack_h__ */
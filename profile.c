@@ -0,0 +1,333 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#include "profile.h"
+#include "core.h"
+
+#ifdef CT_PROFILE
+
+#include <stdio.h>
+#include <string.h>
+#include <GL/glew.h>
+#include <SDL2/SDL.h>
+
+typedef struct
+{
+	CT_ProfileFrame frame;
+	int has_queries;
+	GLuint queries[CT_PROFILE_MAX_SCOPES*2];
+	int is_timed[CT_PROFILE_MAX_SCOPES];
+	int is_pending; /* Waiting for GPU results */
+	int last_query; /* Last query issued, -1 when none */
+} ProfileSlot;
+
+static struct
+{
+	ProfileSlot slots[CT_PROFILE_MAX_FRAMES];
+	unsigned number;        /* Frame being recorded */
+	unsigned first_pending; /* Oldest frame without results */
+	unsigned open[CT_PROFILE_MAX_DEPTH];
+	unsigned depth;
+	int is_frame_started;
+	int gpu_disabled;
+	Uint64 epoch;
+	Uint64 frame_start;
+} profile;
+
+static double ms_since(Uint64 start)
+{
+	return (double)(SDL_GetPerformanceCounter() - start) * 1000.0
+		/ SDL_GetPerformanceFrequency();
+}
+
+static ProfileSlot* slot_of(unsigned number)
+{
+	return profile.slots + (number % CT_PROFILE_MAX_FRAMES);
+}
+
+static int gpu_is_on()
+{
+	return !profile.gpu_disabled && GLEW_ARB_timer_query;
+}
+
+static void frame_start()
+{
+	if (!profile.epoch) profile.epoch = SDL_GetPerformanceCounter();
+	profile.frame_start = SDL_GetPerformanceCounter();
+	ProfileSlot* slot = slot_of(profile.number);
+	slot->frame.number = profile.number;
+	slot->frame.start = ms_since(profile.epoch);
+	slot->frame.scope_count = 0;
+	slot->frame.dropped = 0;
+	slot->frame.gpu_time = 0;
+	slot->last_query = -1;
+	slot->is_pending = 0;
+	profile.is_frame_started = 1;
+}
+
+void ct_profile_begin(const char* name)
+{
+	if (!profile.is_frame_started) frame_start();
+	ProfileSlot* slot = slot_of(profile.number);
+	CT_ProfileFrame* frame = &slot->frame;
+	if (frame->scope_count >= CT_PROFILE_MAX_SCOPES ||
+	    profile.depth >= CT_PROFILE_MAX_DEPTH)
+	{
+		/* Still counted, so ct_profile_end stays balanced */
+		frame->dropped++;
+		if (profile.depth < CT_PROFILE_MAX_DEPTH)
+			profile.open[profile.depth] = (unsigned)-1;
+		profile.depth++;
+		return;
+	}
+	unsigned index = frame->scope_count++;
+	CT_ProfileScope* scope = frame->scopes + index;
+	scope->name = name;
+	scope->depth = profile.depth;
+	scope->cpu_time = 0;
+	scope->gpu_start = -1;
+	scope->gpu_time = 0;
+	slot->is_timed[index] = gpu_is_on();
+	if (slot->is_timed[index])
+	{
+		if (!slot->has_queries)
+		{
+			glGenQueries(CT_PROFILE_MAX_SCOPES*2, slot->queries);
+			slot->has_queries = 1;
+		}
+		glQueryCounter(slot->queries[index*2], GL_TIMESTAMP);
+	}
+	profile.open[profile.depth++] = index;
+	scope->cpu_start = ms_since(profile.frame_start);
+}
+
+void ct_profile_end()
+{
+	if (profile.depth == 0)
+	{
+		ct_set_error("Profile scope ended twice.");
+		return;
+	}
+	profile.depth--;
+	if (profile.depth >= CT_PROFILE_MAX_DEPTH) return;
+	unsigned index = profile.open[profile.depth];
+	if (index == (unsigned)-1) return;
+	ProfileSlot* slot = slot_of(profile.number);
+	CT_ProfileScope* scope = slot->frame.scopes + index;
+	scope->cpu_time = ms_since(profile.frame_start) - scope->cpu_start;
+	if (slot->is_timed[index])
+	{
+		glQueryCounter(slot->queries[index*2+1], GL_TIMESTAMP);
+		slot->last_query = index*2+1;
+		slot->is_pending = 1;
+	}
+}
+
+/* GPU timestamps are lined up with the CPU clock at the first timed
+   scope of the frame. */
+static void frame_resolve(ProfileSlot* slot)
+{
+	CT_ProfileFrame* frame = &slot->frame;
+	GLuint64 first = 0;
+	double offset = 0;
+	int has_first = 0;
+	unsigned i;
+	for (i=0; i<frame->scope_count; i++)
+	{
+		CT_ProfileScope* scope = frame->scopes + i;
+		if (!slot->is_timed[i]) continue;
+		GLuint64 begin, end;
+		glGetQueryObjectui64v(slot->queries[i*2], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(slot->queries[i*2+1], GL_QUERY_RESULT, &end);
+		if (!has_first)
+		{
+			first = begin;
+			offset = scope->cpu_start;
+			has_first = 1;
+		}
+		scope->gpu_start = offset + (double)(begin - first) / 1e6;
+		scope->gpu_time = (double)(end - begin) / 1e6;
+		if (scope->depth == 0) frame->gpu_time += scope->gpu_time;
+	}
+	slot->is_pending = 0;
+}
+
+static int frame_is_ready(ProfileSlot* slot)
+{
+	if (!slot->is_pending) return 1;
+	GLuint available = 0;
+	glGetQueryObjectuiv(slot->queries[slot->last_query],
+			    GL_QUERY_RESULT_AVAILABLE, &available);
+	return available;
+}
+
+void ct_profile_frame_end()
+{
+	if (!profile.is_frame_started) frame_start();
+	/* Close whatever was left open */
+	while (profile.depth) ct_profile_end();
+	ProfileSlot* slot = slot_of(profile.number);
+	slot->frame.cpu_time = ms_since(profile.frame_start);
+	profile.number++;
+	profile.is_frame_started = 0;
+
+	/* The GPU finishes frames in order. A frame about to be reused has
+	   to be resolved now, even if that means waiting. */
+	while (profile.first_pending < profile.number)
+	{
+		ProfileSlot* pending = slot_of(profile.first_pending);
+		int is_reused = profile.number - profile.first_pending
+			>= CT_PROFILE_MAX_FRAMES;
+		if (pending->is_pending)
+		{
+			if (!is_reused && !frame_is_ready(pending)) break;
+			frame_resolve(pending);
+		}
+		profile.first_pending++;
+	}
+}
+
+int ct_is_profiling()
+{
+	return 1;
+}
+
+void ct_profile_gpu_set(int enabled)
+{
+	profile.gpu_disabled = !enabled;
+}
+
+unsigned ct_profile_frame_count()
+{
+	/* Skip the slot being recorded and those still waiting on the GPU */
+	unsigned count = profile.first_pending;
+	unsigned max = CT_PROFILE_MAX_FRAMES - 1
+		- (profile.number - profile.first_pending);
+	return count < max ? count : max;
+}
+
+const CT_ProfileFrame* ct_profile_frame(unsigned age)
+{
+	if (age >= ct_profile_frame_count()) return NULL;
+	return &slot_of(profile.first_pending - 1 - age)->frame;
+}
+
+static void dump_scope(FILE* file, const CT_ProfileScope* scope, double start,
+		       double time, int tid, int* is_first)
+{
+	fprintf(file, "%s\n{\"name\":\"", *is_first ? "" : ",");
+	const char* c;
+	for (c=scope->name; *c; c++)
+	{
+		if (*c == '"' || *c == '\\') fputc('\\', file);
+		if ((unsigned char)*c >= 0x20) fputc(*c, file);
+	}
+	fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+		"\"ts\":%.3f,\"dur\":%.3f}",
+		tid, start * 1000.0, time * 1000.0);
+	*is_first = 0;
+}
+
+int ct_profile_dump_chrome(const char* filename)
+{
+	FILE* file = fopen(filename, "w");
+	if (!file)
+	{
+		ct_set_error("Could not open profile dump.");
+		return 1;
+	}
+	int is_first = 1;
+	fprintf(file, "{\"traceEvents\":[");
+	fprintf(file, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+		"\"args\":{\"name\":\"CPU\"}},");
+	fprintf(file, "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,"
+		"\"args\":{\"name\":\"GPU\"}}");
+	is_first = 0;
+	unsigned age = ct_profile_frame_count();
+	while (age--)
+	{
+		const CT_ProfileFrame* frame = ct_profile_frame(age);
+		unsigned i;
+		for (i=0; i<frame->scope_count; i++)
+		{
+			const CT_ProfileScope* scope = frame->scopes + i;
+			dump_scope(file, scope, frame->start + scope->cpu_start,
+				   scope->cpu_time, 1, &is_first);
+			if (scope->gpu_start >= 0)
+			{
+				dump_scope(file, scope, frame->start + scope->gpu_start,
+					   scope->gpu_time, 2, &is_first);
+			}
+		}
+	}
+	fprintf(file, "\n]}\n");
+	if (fclose(file) != 0)
+	{
+		ct_set_error("Could not write profile dump.");
+		return 1;
+	}
+	return 0;
+}
+
+#else
+
+void ct_profile_begin(const char* name)
+{
+}
+
+void ct_profile_end()
+{
+}
+
+void ct_profile_frame_end()
+{
+}
+
+int ct_is_profiling()
+{
+	return 0;
+}
+
+void ct_profile_gpu_set(int enabled)
+{
+}
+
+unsigned ct_profile_frame_count()
+{
+	return 0;
+}
+
+const CT_ProfileFrame* ct_profile_frame(unsigned age)
+{
+	return NULL;
+}
+
+int ct_profile_dump_chrome(const char* filename)
+{
+	ct_set_error("Built without CT_PROFILE.");
+	return 1;
+}
+
+#endif /* CT_PROFILE */
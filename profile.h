@@ -0,0 +1,96 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#ifndef __profile_h__
+#define __profile_h__
+
+/* Profiler
+   Built with CT_PROFILE defined (make profile), the engine times its hot
+   paths as nested scopes: on the CPU, and on the GPU with a pair of
+   timestamp queries per scope. Without it the CT_PROFILE_* macros are
+   empty and the functions below do nothing, so code using them builds
+   either way.
+
+   GPU results arrive a few frames late. The frames that can be queried
+   are the ones whose results are all in; age 0 is the most recent. */
+
+#define CT_PROFILE_MAX_FRAMES 32
+#define CT_PROFILE_MAX_SCOPES 1024
+#define CT_PROFILE_MAX_DEPTH 32
+
+#ifdef CT_PROFILE
+#define CT_PROFILE_BEGIN(name) ct_profile_begin(name)
+#define CT_PROFILE_END() ct_profile_end()
+#define CT_PROFILE_FRAME_END() ct_profile_frame_end()
+#else
+#define CT_PROFILE_BEGIN(name) ((void)0)
+#define CT_PROFILE_END() ((void)0)
+#define CT_PROFILE_FRAME_END() ((void)0)
+#endif /* CT_PROFILE */
+
+typedef struct _CT_ProfileScope
+{
+	const char* name;
+	unsigned depth;
+	double cpu_start; /* Milliseconds since the start of the frame */
+	double cpu_time;  /* Milliseconds */
+	double gpu_start; /* Negative when the GPU was not timed */
+	double gpu_time;
+} CT_ProfileScope;
+
+typedef struct _CT_ProfileFrame
+{
+	unsigned number;
+	double start;    /* Milliseconds since the profiler started */
+	double cpu_time; /* From this frame's first scope to ct_window_update */
+	double gpu_time; /* Sum of the outermost scopes */
+	unsigned scope_count;
+	unsigned dropped; /* Scopes past CT_PROFILE_MAX_SCOPES */
+	CT_ProfileScope scopes[CT_PROFILE_MAX_SCOPES];
+} CT_ProfileFrame;
+
+/* `name` must stay valid, string literals are best. */
+extern void ct_profile_begin(const char* name);
+
+extern void ct_profile_end();
+
+/* Closes the frame, ct_window_update calls this. */
+extern void ct_profile_frame_end();
+
+extern int ct_is_profiling();
+
+/* GPU timing needs GL_ARB_timer_query and is on when available. */
+extern void ct_profile_gpu_set(int enabled);
+
+extern unsigned ct_profile_frame_count();
+
+/* Returns NULL if `age` is not available (anymore). */
+extern const CT_ProfileFrame* ct_profile_frame(unsigned age);
+
+/* Writes the available frames in the Chrome trace event format, for
+   chrome://tracing or Perfetto. Returns 0 on success. */
+extern int ct_profile_dump_chrome(const char* filename);
+
+#endif /* __profile_h__ */
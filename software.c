@@ -0,0 +1,848 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#include "software.h"
+#include "aux.h"
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+
+/* Four channels at once, in 0-255. */
+typedef float v4f __attribute__((vector_size(16)));
+typedef int v4i __attribute__((vector_size(16)));
+
+/* Vertices are snapped to 1/256th of a pixel so coverage can be decided
+   with exact integer edge functions: pixels on an edge shared by two
+   triangles are drawn exactly once, whatever order they come in. */
+#define SUBPIXEL_BITS 8
+#define SUBPIXEL (1 << SUBPIXEL_BITS)
+
+/* Pixels, keeps the edge functions well within 64 bits. */
+#define COORD_LIMIT 65536.0f
+
+static struct
+{
+	int rect[4];
+	int is_on;
+} scissor;
+
+/* Textures */
+
+void sw_texture_alloc(CT_Texture* tex)
+{
+	size_t size = (size_t)tex->w * tex->h * 4;
+	tex->pixels = smalloc_tag(size ? size : 4, CT_MEMORY_TEXTURE);
+	memset(tex->pixels, 0, size);
+}
+
+void sw_texture_free(CT_Texture* tex)
+{
+	sw_finish();
+	sfree(tex->pixels);
+	tex->pixels = NULL;
+}
+
+void sw_texture_upload(CT_Texture* tex, const unsigned char* pixels,
+		       unsigned pitch, unsigned bpp, int is_bgr)
+{
+	unsigned r = is_bgr ? 2 : 0;
+	unsigned b = is_bgr ? 0 : 2;
+	unsigned x, y;
+	sw_finish();
+	for (y=0; y<tex->h; y++)
+	{
+		const unsigned char* src = pixels + (size_t)y * pitch;
+		unsigned char* dst = tex->pixels + (size_t)y * tex->w * 4;
+		if (bpp == 4 && !is_bgr)
+		{
+			memcpy(dst, src, tex->w * 4);
+			continue;
+		}
+		for (x=0; x<tex->w; x++, src+=bpp, dst+=4)
+		{
+			dst[0] = src[r];
+			dst[1] = src[1];
+			dst[2] = src[b];
+			dst[3] = bpp == 4 ? src[3] : 255;
+		}
+	}
+}
+
+/* Targets */
+
+void sw_scissor(const int* rect)
+{
+	scissor.is_on = rect != NULL;
+	if (rect) memcpy(scissor.rect, rect, sizeof(scissor.rect));
+}
+
+/* The pixels of `target` that may be written: left, right, top, bottom. */
+static void target_clip(CT_Texture* target, int* clip)
+{
+	clip[0] = 0;
+	clip[1] = target->w;
+	clip[2] = 0;
+	clip[3] = target->h;
+	if (!scissor.is_on) return;
+	if (scissor.rect[0] > clip[0]) clip[0] = scissor.rect[0];
+	if (scissor.rect[1] < clip[1]) clip[1] = scissor.rect[1];
+	if (scissor.rect[2] > clip[2]) clip[2] = scissor.rect[2];
+	if (scissor.rect[3] < clip[3]) clip[3] = scissor.rect[3];
+}
+
+static unsigned char to_byte(float v)
+{
+	return v <= 0 ? 0 : v >= 255 ? 255 : (unsigned char)(v + .5f);
+}
+
+void sw_clear(CT_Texture* target, const float* colour)
+{
+	unsigned char bytes[4];
+	uint32_t value;
+	int clip[4], x, y, i;
+	sw_finish();
+	for (i=0; i<4; i++) bytes[i] = to_byte(colour[i] * 255);
+	memcpy(&value, bytes, 4);
+	target_clip(target, clip);
+	for (y=clip[2]; y<clip[3]; y++)
+	{
+		uint32_t* row = (uint32_t*)target->pixels + (size_t)y * target->w;
+		for (x=clip[0]; x<clip[1]; x++) row[x] = value;
+	}
+}
+
+void sw_copy(CT_Texture* src, int sx, int sy,
+	     CT_Texture* dst, int dx, int dy, int w, int h)
+{
+	/* Overlapping copies within a texture go against the direction
+	   they move in. */
+	int reverse = src == dst && dy > sy;
+	int i;
+	sw_finish();
+	for (i=0; i<h; i++)
+	{
+		int row = reverse ? h-1-i : i;
+		memmove(dst->pixels + ((size_t)(dy + row) * dst->w + dx) * 4,
+			src->pixels + ((size_t)(sy + row) * src->w + sx) * 4,
+			(size_t)w * 4);
+	}
+}
+
+/* Sampling */
+
+/* What a draw reads of its texture, copied so it stays in registers
+   while the target is written. Coordinates are in texels. */
+typedef struct
+{
+	const unsigned char* pixels;
+	int w, h;
+	CT_TextureWrap wrap;
+	int is_linear;
+} SW_Sampler;
+
+static inline int wrap(int i, int n, CT_TextureWrap mode)
+{
+	if ((unsigned)i < (unsigned)n) return i;
+	switch (mode)
+	{
+	case CT_TEXTURE_WRAP_CLAMP:
+		return i < 0 ? 0 : n-1;
+	case CT_TEXTURE_WRAP_MIRROR:
+		i %= 2*n;
+		if (i < 0) i += 2*n;
+		return i < n ? i : 2*n-1-i;
+	default:
+		i %= n;
+		return i < 0 ? i + n : i;
+	}
+}
+
+/* Far outside the texture all coordinates wrap or clamp alike anyway. */
+static inline int texel_coord(float v)
+{
+	if (!(v > -COORD_LIMIT)) return -COORD_LIMIT;
+	if (v > COORD_LIMIT) return COORD_LIMIT;
+	int i = (int)v;
+	return i - (v < i);
+}
+
+static inline const unsigned char* texel_at(SW_Sampler s, float x, float y)
+{
+	int tx = wrap(texel_coord(x), s.w, s.wrap);
+	int ty = wrap(texel_coord(y), s.h, s.wrap);
+	return s.pixels + ((size_t)ty * s.w + tx) * 4;
+}
+
+static inline v4f load(const unsigned char* p)
+{
+	v4f v = { p[0], p[1], p[2], p[3] };
+	return v;
+}
+
+/* Mipmapped filters sample the first level. */
+static inline v4f sample(SW_Sampler s, float x, float y)
+{
+	if (!s.is_linear) return load(texel_at(s, x, y));
+	x -= .5f;
+	y -= .5f;
+	int x0 = texel_coord(x), y0 = texel_coord(y);
+	float ax = x - x0, ay = y - y0;
+	int x1 = wrap(x0 + 1, s.w, s.wrap);
+	int y1 = wrap(y0 + 1, s.h, s.wrap);
+	x0 = wrap(x0, s.w, s.wrap);
+	y0 = wrap(y0, s.h, s.wrap);
+	const unsigned char* row0 = s.pixels + (size_t)y0 * s.w * 4;
+	const unsigned char* row1 = s.pixels + (size_t)y1 * s.w * 4;
+	v4f top    = load(row0 + x0*4);
+	v4f bottom = load(row1 + x0*4);
+	top    += (load(row0 + x1*4) - top) * ax;
+	bottom += (load(row1 + x1*4) - bottom) * ax;
+	return top + (bottom - top) * ay;
+}
+
+/* Blending */
+
+static inline v4f clamp(v4f v)
+{
+	static const v4f zero = { 0, 0, 0, 0 };
+	static const v4f full = { 255, 255, 255, 255 };
+	v4i below = v < zero, above = v > full;
+	return (v4f)(((v4i)v & ~below & ~above) | ((v4i)full & above));
+}
+
+/* The blend functions set_blend_mode gives GL. */
+static inline v4f blend(CT_BlendMode mode, v4f src, v4f dst)
+{
+	float a = src[3] * (1.0f/255);
+	switch (mode)
+	{
+	case CT_BLEND_MODE_TRANS:
+		return src * a + dst * (1 - a);
+	case CT_BLEND_MODE_ADD:
+		return src * dst * (1.0f/255) + dst * (1 - a);
+	case CT_BLEND_MODE_ONE_ONE:
+		return src + dst;
+	case CT_BLEND_MODE_PREMULTIPLIED:
+		return src + dst * (1 - a);
+	default:
+		return src;
+	}
+}
+
+static inline void store(unsigned char* p, v4f v)
+{
+	static const v4f half = { .5f, .5f, .5f, .5f };
+	v4i i = __builtin_convertvector(clamp(v) + half, v4i);
+	p[0] = i[0];
+	p[1] = i[1];
+	p[2] = i[2];
+	p[3] = i[3];
+}
+
+/* Rasterising */
+
+enum
+{
+	SPAN_COPY,   /* Texels replace the target's pixels */
+	SPAN_SPRITE, /* Same, but only where they are opaque */
+	SPAN_BLEND
+};
+
+typedef struct
+{
+	CT_Texture* target;
+	SW_Sampler sampler;
+	v4f colour;
+	CT_BlendMode blend;
+	int is_bright; /* Colour outside 0-1, fragments need clamping */
+	int span;
+	int clip[4];   /* The target's pixels it may write */
+} SW_Draw;
+
+typedef struct
+{
+	float x, y; /* Target pixels */
+	float u, v;
+} SW_Vertex;
+
+typedef struct
+{
+	int p[3][2]; /* Snapped, see snap */
+	float u[3], v[3];
+	unsigned draw;
+} SW_Triangle;
+
+typedef struct
+{
+	long long a, b, c;
+} SW_Edge;
+
+static void draw_init(SW_Draw* draw, CT_Texture* target, CT_Texture* tex,
+		      const float* colour, CT_BlendMode blend, const int* clip)
+{
+	int is_white = 1, i;
+	draw->target = target;
+	memcpy(draw->clip, clip, sizeof(draw->clip));
+	draw->sampler.pixels = tex->pixels;
+	draw->sampler.w      = tex->w;
+	draw->sampler.h      = tex->h;
+	draw->sampler.wrap   = tex->wrap;
+	draw->sampler.is_linear = tex->filter == CT_TEXTURE_FILTER_LINEAR ||
+		tex->filter == CT_TEXTURE_FILTER_LINEAR_MIPMAP;
+	draw->blend = blend;
+	draw->is_bright = 0;
+	for (i=0; i<4; i++)
+	{
+		draw->colour[i] = colour[i];
+		if (colour[i] != 1) is_white = 0;
+		if (colour[i] < 0 || colour[i] > 1) draw->is_bright = 1;
+	}
+	draw->span = SPAN_BLEND;
+	if (is_white && !draw->sampler.is_linear)
+	{
+		if (blend == CT_BLEND_MODE_NORMAL)
+			draw->span = SPAN_COPY;
+		else if (blend == CT_BLEND_MODE_TRANS ||
+			 blend == CT_BLEND_MODE_PREMULTIPLIED)
+			draw->span = SPAN_SPRITE;
+	}
+}
+
+/* The row of texels a span reads when it runs along one without leaving
+   the texture, NULL otherwise. Such spans need no wrapping. */
+static const uint32_t* span_row(SW_Sampler s, int x0, int x1,
+				float u, float du, float v, float dv)
+{
+	if (dv != 0 || s.is_linear) return NULL;
+	float first = u + du*(x0 + .5f), last = u + du*(x1 + .5f);
+	if (!(first >= 0 && last >= 0 && first < s.w && last < s.w)) return NULL;
+	int y = wrap(texel_coord(v), s.h, s.wrap);
+	return (const uint32_t*)s.pixels + (size_t)y * s.w;
+}
+
+/* Copies the texels of a span_row to `dst`, four at a time. With
+   `is_sprite` transparent texels are skipped and translucent ones are
+   blended in `mode`. */
+static void span_row_draw(uint32_t* dst, const uint32_t* row, int x0, int x1,
+			  float u, float du, int is_sprite, CT_BlendMode mode)
+{
+	v4f px = { .5f, 1.5f, 2.5f, 3.5f };
+	int x = x0, i;
+	px += (float)x0;
+	for (; x <= x1; x += 4, dst += 4, px += 4)
+	{
+		v4i tx = __builtin_convertvector(u + du*px, v4i);
+		int count = x1 - x < 3 ? x1 - x + 1 : 4;
+		for (i=0; i<count; i++)
+		{
+			uint32_t texel = row[tx[i]];
+			const unsigned char* bytes = (const unsigned char*)&texel;
+			if (!is_sprite || bytes[3] == 255)
+				dst[i] = texel;
+			else if (bytes[3] || mode == CT_BLEND_MODE_PREMULTIPLIED)
+				store((unsigned char*)(dst + i),
+				      blend(mode, load(bytes), load((unsigned char*)(dst + i))));
+		}
+	}
+}
+
+/* The texel at the centre of pixel `x` of the span is (u + du*(x+.5),
+   v + dv*(x+.5)), the same in whichever span the pixel is drawn. */
+static void draw_span(const SW_Draw* draw, int y, int x0, int x1,
+		      float u, float du, float v, float dv)
+{
+	SW_Sampler s = draw->sampler;
+	CT_BlendMode mode = draw->blend;
+	uint32_t* dst = (uint32_t*)draw->target->pixels +
+		(size_t)y * draw->target->w + x0;
+	int x;
+	if (draw->span != SPAN_BLEND)
+	{
+		const uint32_t* row = span_row(s, x0, x1, u, du, v, dv);
+		if (row)
+		{
+			span_row_draw(dst, row, x0, x1, u, du,
+				      draw->span == SPAN_SPRITE, mode);
+			return;
+		}
+	}
+	switch (draw->span)
+	{
+	case SPAN_COPY:
+		for (x=x0; x<=x1; x++, dst++)
+		{
+			float px = x + .5f;
+			*dst = *(const uint32_t*)texel_at(s, u + du*px, v + dv*px);
+		}
+		break;
+	case SPAN_SPRITE:
+		for (x=x0; x<=x1; x++, dst++)
+		{
+			float px = x + .5f;
+			const unsigned char* texel = texel_at(s, u + du*px, v + dv*px);
+			if (texel[3] == 255)
+				*dst = *(const uint32_t*)texel;
+			else if (texel[3] || mode == CT_BLEND_MODE_PREMULTIPLIED)
+				store((unsigned char*)dst, blend(mode, load(texel),
+						 load((unsigned char*)dst)));
+		}
+		break;
+	default:
+		for (x=x0; x<=x1; x++, dst++)
+		{
+			float px = x + .5f;
+			v4f src = sample(s, u + du*px, v + dv*px) * draw->colour;
+			if (draw->is_bright) src = clamp(src);
+			store((unsigned char*)dst, blend(mode, src, load((unsigned char*)dst)));
+		}
+		break;
+	}
+}
+
+static int snap(float v)
+{
+	if (!(v > -COORD_LIMIT)) v = -COORD_LIMIT;
+	if (v > COORD_LIMIT) v = COORD_LIMIT;
+	return (int)lrintf(v * SUBPIXEL);
+}
+
+static long long div_floor(long long n, long long d)
+{
+	long long q = n / d;
+	return (n % d != 0 && (n < 0) != (d < 0)) ? q - 1 : q;
+}
+
+/* Pixels are inside where all three edge functions are >= 0. The
+   edges on the top left side keep their pixels, the others give them
+   to the neighbouring triangle, so 1 is taken off their `c`. */
+static void edge_init(SW_Edge* e, const int* p, const int* q)
+{
+	e->a = p[1] - q[1];
+	e->b = q[0] - p[0];
+	e->c = (long long)p[0] * q[1] - (long long)p[1] * q[0];
+	if (!(e->a > 0 || (e->a == 0 && e->b > 0))) e->c--;
+}
+
+/* Whether the centre of pixel `x` is inside `e`, `r` being the part of
+   the edge function that only depends on the row. */
+static inline int is_inside(const SW_Edge* e, long long r, int x)
+{
+	return e->a * ((long long)x * SUBPIXEL + SUBPIXEL/2) + r >= 0;
+}
+
+/* Narrows the span [*left, *right] to the pixels inside `e`. The
+   crossing is estimated in floating point and settled with exact
+   tests, which only move a pixel or so. */
+static void edge_span(const SW_Edge* e, long long r, const int* clip,
+		      int* left, int* right)
+{
+	if (e->a == 0)
+	{
+		if (r < 0) *left = *right + 1;
+		return;
+	}
+	double cross = ((double)-r / e->a - SUBPIXEL/2) / SUBPIXEL;
+	if (!(cross > clip[0] - 1)) cross = clip[0] - 1;
+	if (cross > clip[1]) cross = clip[1];
+	int x;
+	if (e->a > 0)
+	{
+		x = ceil(cross);
+		while (x < clip[1] && !is_inside(e, r, x)) x++;
+		while (x > clip[0] && is_inside(e, r, x-1)) x--;
+		if (x > *left) *left = x;
+	} else
+	{
+		x = floor(cross);
+		while (x >= clip[0] && !is_inside(e, r, x)) x--;
+		while (x < clip[1]-1 && is_inside(e, r, x+1)) x++;
+		if (x < *right) *right = x;
+	}
+}
+
+/* Snaps the triangle `v`, returns 0 when it has no area. `bounds` gets
+   the pixels whose centres are within its box: left, right, top,
+   bottom. */
+static int triangle_init(SW_Triangle* tri, const SW_Vertex* v, int* bounds)
+{
+	int i;
+	for (i=0; i<3; i++)
+	{
+		tri->p[i][0] = snap(v[i].x);
+		tri->p[i][1] = snap(v[i].y);
+		tri->u[i] = v[i].u;
+		tri->v[i] = v[i].v;
+	}
+	int (*p)[2] = tri->p;
+	if ((long long)(p[1][0] - p[0][0]) * (p[2][1] - p[0][1]) ==
+	    (long long)(p[1][1] - p[0][1]) * (p[2][0] - p[0][0]))
+		return 0;
+	int min[2] = { p[0][0], p[0][1] }, max[2] = { p[0][0], p[0][1] };
+	int j;
+	for (i=1; i<3; i++)
+	{
+		for (j=0; j<2; j++)
+		{
+			if (p[i][j] < min[j]) min[j] = p[i][j];
+			if (p[i][j] > max[j]) max[j] = p[i][j];
+		}
+	}
+	for (j=0; j<2; j++)
+	{
+		bounds[j*2]   = -div_floor(-(min[j] - SUBPIXEL/2), SUBPIXEL);
+		bounds[j*2+1] = div_floor(max[j] - SUBPIXEL/2, SUBPIXEL) + 1;
+	}
+	return 1;
+}
+
+/* Rasterises `tri` within the pixels `clip`. */
+static void draw_triangle(const SW_Draw* draw, const SW_Triangle* tri,
+			  const int* clip)
+{
+	const int (*p)[2] = (const int (*)[2])tri->p;
+	int i;
+	long long area = (long long)(p[1][0] - p[0][0]) * (p[2][1] - p[0][1]) -
+		(long long)(p[1][1] - p[0][1]) * (p[2][0] - p[0][0]);
+	/* Either winding is drawn, there is no culling */
+	int i1 = area > 0 ? 1 : 2, i2 = area > 0 ? 2 : 1;
+	SW_Edge edges[3];
+	edge_init(edges+0, p[0], p[i1]);
+	edge_init(edges+1, p[i1], p[i2]);
+	edge_init(edges+2, p[i2], p[0]);
+
+	/* Texel coordinates as planes over the target's pixels */
+	double tw = draw->sampler.w, th = draw->sampler.h;
+	double x1 = (double)(p[1][0] - p[0][0]) / SUBPIXEL;
+	double y1 = (double)(p[1][1] - p[0][1]) / SUBPIXEL;
+	double x2 = (double)(p[2][0] - p[0][0]) / SUBPIXEL;
+	double y2 = (double)(p[2][1] - p[0][1]) / SUBPIXEL;
+	double det = x1*y2 - x2*y1;
+	double du1 = (tri->u[1] - tri->u[0]) * tw, du2 = (tri->u[2] - tri->u[0]) * tw;
+	double dv1 = (tri->v[1] - tri->v[0]) * th, dv2 = (tri->v[2] - tri->v[0]) * th;
+	double dudx = (du1*y2 - du2*y1) / det, dudy = (du2*x1 - du1*x2) / det;
+	double dvdx = (dv1*y2 - dv2*y1) / det, dvdy = (dv2*x1 - dv1*x2) / det;
+	double ox = (double)p[0][0] / SUBPIXEL, oy = (double)p[0][1] / SUBPIXEL;
+
+	/* Rows with their pixel centres within the triangle's height */
+	int top = p[0][1], bottom = p[0][1];
+	for (i=1; i<3; i++)
+	{
+		if (p[i][1] < top) top = p[i][1];
+		if (p[i][1] > bottom) bottom = p[i][1];
+	}
+	int first = -div_floor(-(top - SUBPIXEL/2), SUBPIXEL);
+	int last  = div_floor(bottom - SUBPIXEL/2, SUBPIXEL);
+	if (first < clip[2]) first = clip[2];
+	if (last > clip[3]-1) last = clip[3]-1;
+
+	int y;
+	for (y=first; y<=last; y++)
+	{
+		long long py = (long long)y * SUBPIXEL + SUBPIXEL/2;
+		int left = clip[0], right = clip[1]-1;
+		for (i=0; i<3 && left <= right; i++)
+		{
+			edge_span(edges + i, edges[i].b * py + edges[i].c, clip,
+				  &left, &right);
+		}
+		if (left > right) continue;
+		double cy = y + .5 - oy;
+		draw_span(draw, y, left, right,
+			  tri->u[0]*tw + dudy*cy - dudx*ox, dudx,
+			  tri->v[0]*th + dvdy*cy - dvdx*ox, dvdx);
+	}
+}
+
+/* Tiles
+
+   Draws into a target are only recorded: their triangles are binned
+   into the tiles of the target they touch, in the order they come in.
+   sw_finish then rasterises the tiles on a pool of threads. Each tile
+   has its pixels to itself and draws its triangles in order, so the
+   result is the same as drawing them one after another, blending
+   included, with any number of threads. */
+
+#define TILE_SIZE 64
+#define MAX_THREADS 32
+
+/* Past this many triangles a frame is finished early, bounding the
+   memory recording takes. */
+#define FRAME_TRIANGLES (1 << 18)
+
+typedef struct
+{
+	unsigned* triangles;
+	unsigned count, size;
+} SW_Bin;
+
+static struct
+{
+	CT_Texture* target; /* NULL when nothing is recorded */
+	SW_Draw* draws;
+	unsigned draw_count, draw_size;
+	SW_Triangle* triangles;
+	unsigned triangle_count, triangle_size;
+	SW_Bin* bins;
+	int columns, rows;
+	unsigned bin_size;
+	SDL_atomic_t next_bin; /* The next to rasterise */
+} frame;
+
+static struct
+{
+	SDL_Thread* threads[MAX_THREADS];
+	int count;  /* Running, besides the one calling sw_finish */
+	int wanted; /* Threads in all, 0 is one per CPU */
+	int is_quitting;
+	SDL_sem* start;
+	SDL_sem* done;
+} pool;
+
+static void* grow(void* items, unsigned* size, unsigned count, size_t item)
+{
+	if (count < *size) return items;
+	*size = *size ? *size * 2 : 64;
+	return srealloc(items, *size * item);
+}
+
+static void frame_begin(CT_Texture* target)
+{
+	frame.target = target;
+	frame.columns = (target->w + TILE_SIZE - 1) / TILE_SIZE;
+	frame.rows = (target->h + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned count = frame.columns * frame.rows;
+	if (count > frame.bin_size)
+	{
+		frame.bins = srealloc(frame.bins, count * sizeof(SW_Bin));
+		memset(frame.bins + frame.bin_size, 0,
+		       (count - frame.bin_size) * sizeof(SW_Bin));
+		frame.bin_size = count;
+	}
+}
+
+static void frame_bin(unsigned triangle, const int* bounds, const int* clip)
+{
+	int left   = bounds[0] > clip[0] ? bounds[0] : clip[0];
+	int right  = bounds[1] < clip[1] ? bounds[1] : clip[1];
+	int top    = bounds[2] > clip[2] ? bounds[2] : clip[2];
+	int bottom = bounds[3] < clip[3] ? bounds[3] : clip[3];
+	if (left >= right || top >= bottom) return;
+	int x, y;
+	for (y=top/TILE_SIZE; y<=(bottom-1)/TILE_SIZE; y++)
+	{
+		for (x=left/TILE_SIZE; x<=(right-1)/TILE_SIZE; x++)
+		{
+			SW_Bin* bin = frame.bins + y*frame.columns + x;
+			bin->triangles = grow(bin->triangles, &bin->size,
+					      bin->count, sizeof(unsigned));
+			bin->triangles[bin->count++] = triangle;
+		}
+	}
+}
+
+static void bin_draw(int index)
+{
+	const SW_Bin* bin = frame.bins + index;
+	int tile[4];
+	tile[0] = (index % frame.columns) * TILE_SIZE;
+	tile[1] = tile[0] + TILE_SIZE;
+	tile[2] = (index / frame.columns) * TILE_SIZE;
+	tile[3] = tile[2] + TILE_SIZE;
+	unsigned i;
+	for (i=0; i<bin->count; i++)
+	{
+		const SW_Triangle* tri = frame.triangles + bin->triangles[i];
+		const SW_Draw* draw = frame.draws + tri->draw;
+		const int* c = draw->clip;
+		int clip[4] = {
+			c[0] > tile[0] ? c[0] : tile[0],
+			c[1] < tile[1] ? c[1] : tile[1],
+			c[2] > tile[2] ? c[2] : tile[2],
+			c[3] < tile[3] ? c[3] : tile[3]
+		};
+		if (clip[0] < clip[1] && clip[2] < clip[3])
+			draw_triangle(draw, tri, clip);
+	}
+}
+
+/* Takes bins until none are left, on every thread at once. */
+static void frame_draw()
+{
+	int count = frame.columns * frame.rows, i;
+	while ((i = SDL_AtomicAdd(&frame.next_bin, 1)) < count)
+		bin_draw(i);
+}
+
+static int pool_thread(void* data)
+{
+	for (;;)
+	{
+		SDL_SemWait(pool.start);
+		if (pool.is_quitting) return 0;
+		frame_draw();
+		SDL_SemPost(pool.done);
+	}
+}
+
+static void pool_stop()
+{
+	int i;
+	pool.is_quitting = 1;
+	for (i=0; i<pool.count; i++) SDL_SemPost(pool.start);
+	for (i=0; i<pool.count; i++) SDL_WaitThread(pool.threads[i], NULL);
+	if (pool.start) SDL_DestroySemaphore(pool.start);
+	if (pool.done) SDL_DestroySemaphore(pool.done);
+	pool.start = pool.done = NULL;
+	pool.count = 0;
+	pool.is_quitting = 0;
+}
+
+/* Starts the pool the first time it's needed. Threads that can't be
+   created are done without. */
+static void pool_start()
+{
+	int wanted = pool.wanted ? pool.wanted : SDL_GetCPUCount();
+	if (wanted > MAX_THREADS) wanted = MAX_THREADS;
+	if (pool.start || wanted < 2) return;
+	pool.start = SDL_CreateSemaphore(0);
+	pool.done = SDL_CreateSemaphore(0);
+	if (!pool.start || !pool.done) return;
+	while (pool.count < wanted-1)
+	{
+		SDL_Thread* thread = SDL_CreateThread(pool_thread, "ct_software", NULL);
+		if (!thread) break;
+		pool.threads[pool.count++] = thread;
+	}
+}
+
+void sw_threads_set(unsigned count)
+{
+	sw_finish();
+	pool_stop();
+	pool.wanted = count;
+}
+
+void sw_finish()
+{
+	int i, count = 0, busy = 0;
+	if (!frame.target) return;
+	for (i=0; i<frame.columns * frame.rows; i++)
+		if (frame.bins[i].count) busy++;
+	SDL_AtomicSet(&frame.next_bin, 0);
+	if (busy > 1)
+	{
+		pool_start();
+		count = pool.count;
+	}
+	for (i=0; i<count; i++) SDL_SemPost(pool.start);
+	frame_draw();
+	for (i=0; i<count; i++) SDL_SemWait(pool.done);
+	for (i=0; i<frame.columns * frame.rows; i++) frame.bins[i].count = 0;
+	frame.draw_count = 0;
+	frame.triangle_count = 0;
+	frame.target = NULL;
+}
+
+void sw_quit()
+{
+	sw_finish();
+	pool_stop();
+	int i;
+	for (i=0; i<(int)frame.bin_size; i++) sfree(frame.bins[i].triangles);
+	sfree(frame.bins);
+	sfree(frame.draws);
+	sfree(frame.triangles);
+	memset(&frame, 0, sizeof(frame));
+	pool.wanted = 0;
+}
+
+/* Drawing */
+
+void sw_draw(CT_Texture* target, CT_Texture* tex,
+	     const float* modelview, const float* colour,
+	     CT_BlendMode blend,
+	     const float* positions, int stride,
+	     const float* coords, unsigned quads,
+	     const unsigned short* indices)
+{
+	const float* m = modelview;
+	int clip[4];
+	if (!tex->w || !tex->h) return;
+	target_clip(target, clip);
+	if (clip[0] >= clip[1] || clip[2] >= clip[3]) return;
+	/* A texture drawn into itself reads pixels as they are written,
+	   that can only be done one triangle after another. */
+	int is_direct = tex == target;
+	SW_Draw direct;
+	if (is_direct || frame.target != target ||
+	    frame.triangle_count >= FRAME_TRIANGLES)
+		sw_finish();
+	if (is_direct)
+	{
+		draw_init(&direct, target, tex, colour, blend, clip);
+	} else
+	{
+		if (!frame.target) frame_begin(target);
+		frame.draws = grow(frame.draws, &frame.draw_size,
+				   frame.draw_count, sizeof(SW_Draw));
+		draw_init(frame.draws + frame.draw_count++, target, tex,
+			  colour, blend, clip);
+	}
+	unsigned i, j;
+	for (i=0; i<quads; i++)
+	{
+		SW_Vertex v[6];
+		for (j=0; j<6; j++)
+		{
+			unsigned index = indices[i*6+j];
+			const float* p = (const float*)((const char*)positions + index*stride);
+			v[j].x = (m[0]*p[0] + m[4]*p[1] + m[12]) * target->w;
+			v[j].y = (m[1]*p[0] + m[5]*p[1] + m[13]) * target->h;
+			v[j].u = coords[index*4+0];
+			v[j].v = coords[index*4+1];
+		}
+		for (j=0; j<6; j+=3)
+		{
+			SW_Triangle direct_tri;
+			SW_Triangle* tri = &direct_tri;
+			int bounds[4];
+			if (!is_direct)
+			{
+				frame.triangles = grow(frame.triangles, &frame.triangle_size,
+						       frame.triangle_count, sizeof(SW_Triangle));
+				tri = frame.triangles + frame.triangle_count;
+				tri->draw = frame.draw_count - 1;
+			}
+			if (!triangle_init(tri, v+j, bounds)) continue;
+			if (is_direct)
+			{
+				draw_triangle(&direct, tri, clip);
+				continue;
+			}
+			frame_bin(frame.triangle_count++, bounds, clip);
+		}
+	}
+}
@@ -0,0 +1,76 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#ifndef __software_h_
+#define __software_h_
+
+#include "core.h"
+
+/* The software backend: textures are RGBA8 in memory, rows from the top
+   like the engine's coordinates, and quads are rasterised on the CPU
+   with the semantics of the default shader. */
+
+/* Allocates cleared pixels for `tex`, which must have its size set. */
+extern void sw_texture_alloc(CT_Texture* tex);
+
+extern void sw_texture_free(CT_Texture* tex);
+
+/* Converts 3 or 4 byte per pixel RGB(A) or, with `is_bgr`, BGR(A)
+   pixels into the texture. */
+extern void sw_texture_upload(CT_Texture* tex, const unsigned char* pixels,
+			      unsigned pitch, unsigned bpp, int is_bgr);
+
+/* Limits drawing and clearing to the pixel rectangle (left, right, top,
+   bottom), NULL lifts the limit. */
+extern void sw_scissor(const int* rect);
+
+extern void sw_clear(CT_Texture* target, const float* colour);
+
+/* Pixel copy, the rectangles must already be clipped to both textures. */
+extern void sw_copy(CT_Texture* src, int sx, int sy,
+		    CT_Texture* dst, int dx, int dy, int w, int h);
+
+/* Draws `quads` quads (6 indices each) of `tex` into `target`, the
+   arguments are those of the GL draw: `stride` is in bytes, texture
+   coordinates always have a stride of 16. Draws are recorded and only
+   rasterised by sw_finish, `tex` mustn't change until then except
+   through these functions, which finish first. */
+extern void sw_draw(CT_Texture* target, CT_Texture* tex,
+		    const float* modelview, const float* colour,
+		    CT_BlendMode blend,
+		    const float* positions, int stride,
+		    const float* coords, unsigned quads,
+		    const unsigned short* indices);
+
+/* Rasterises the recorded draws, on several threads. */
+extern void sw_finish();
+
+/* Threads sw_finish uses, counting the calling one, 0 is one per CPU. */
+extern void sw_threads_set(unsigned count);
+
+/* Finishes and frees the threads and what recording allocated. */
+extern void sw_quit();
+
+#endif /* __software_h_ */
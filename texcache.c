@@ -0,0 +1,240 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#include "texcache.h"
+#include "core.h"
+#include "aux.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+
+#define TC_MAGIC "LETC"
+#define TC_VERSION 1
+#define TC_ALIGN 16
+/* Larger sides are rejected as corrupt, no driver takes them anyway. */
+#define TC_MAX_SIZE 16384
+
+typedef struct
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t w, h;
+	uint32_t levels;
+	uint32_t flags;
+	uint32_t reserved[2];
+} TC_Header;
+
+static size_t align_up(size_t v)
+{
+	return (v + TC_ALIGN - 1) & ~(size_t)(TC_ALIGN - 1);
+}
+
+static unsigned level_size(unsigned size, unsigned level)
+{
+	size >>= level;
+	return size ? size : 1;
+}
+
+static size_t level_bytes(unsigned w, unsigned h, unsigned level)
+{
+	return (size_t)level_size(w, level) * level_size(h, level) * 4;
+}
+
+/* Levels in a full mip chain down to 1x1. */
+static unsigned chain_levels(unsigned w, unsigned h)
+{
+	unsigned levels = 1;
+	while (level_size(w, levels-1) > 1 || level_size(h, levels-1) > 1)
+	{
+		levels++;
+	}
+	return levels;
+}
+
+static size_t blob_size(unsigned w, unsigned h, unsigned levels)
+{
+	size_t size = sizeof(TC_Header);
+	unsigned i;
+	for (i=0; i<levels; i++)
+	{
+		size = align_up(size) + level_bytes(w, h, i);
+	}
+	return size;
+}
+
+int tc_is_blob(const void* data, size_t size)
+{
+	return size >= sizeof(TC_Header) && memcmp(data, TC_MAGIC, 4) == 0;
+}
+
+int tc_blob_from_memory(const void* data, size_t size, TC_Blob* blob)
+{
+	if (!tc_is_blob(data, size)) return 1;
+	const TC_Header* header = data;
+	if (header->version != TC_VERSION ||
+	    header->w == 0 || header->w > TC_MAX_SIZE ||
+	    header->h == 0 || header->h > TC_MAX_SIZE ||
+	    header->levels == 0 ||
+	    header->levels > chain_levels(header->w, header->h) ||
+	    blob_size(header->w, header->h, header->levels) > size)
+	{
+		return 1;
+	}
+	blob->data      = data;
+	blob->size      = size;
+	blob->is_mapped = 0;
+	blob->w         = header->w;
+	blob->h         = header->h;
+	blob->levels    = header->levels;
+	blob->flags     = header->flags;
+	return 0;
+}
+
+int tc_blob_open(const char* filename, TC_Blob* blob)
+{
+	size_t size;
+	const void* data = map_file(filename, &size);
+	if (!data) return 1;
+	if (tc_blob_from_memory(data, size, blob))
+	{
+		unmap_file(data, size);
+		return 1;
+	}
+	blob->is_mapped = 1;
+	return 0;
+}
+
+void tc_blob_close(TC_Blob* blob)
+{
+	if (blob->is_mapped) unmap_file(blob->data, blob->size);
+	blob->data = NULL;
+}
+
+const unsigned char* tc_blob_level(TC_Blob* blob, unsigned level,
+				   unsigned* w, unsigned* h)
+{
+	size_t offset = sizeof(TC_Header);
+	unsigned i;
+	for (i=0; i<level; i++)
+	{
+		offset = align_up(offset) + level_bytes(blob->w, blob->h, i);
+	}
+	*w = level_size(blob->w, level);
+	*h = level_size(blob->h, level);
+	return blob->data + align_up(offset);
+}
+
+static void premultiply(unsigned char* pixels, size_t count)
+{
+	size_t i;
+	for (i=0; i<count; i++, pixels += 4)
+	{
+		unsigned a = pixels[3];
+		pixels[0] = (pixels[0] * a + 127) / 255;
+		pixels[1] = (pixels[1] * a + 127) / 255;
+		pixels[2] = (pixels[2] * a + 127) / 255;
+	}
+}
+
+/* 2x2 box filter, the last row/column is repeated for odd sizes. */
+static void downsample(const unsigned char* src, unsigned sw, unsigned sh,
+		       unsigned char* dst, unsigned dw, unsigned dh)
+{
+	unsigned x, y, c;
+	for (y=0; y<dh; y++)
+	{
+		unsigned y0 = y*2, y1 = y*2+1 < sh ? y*2+1 : sh-1;
+		for (x=0; x<dw; x++)
+		{
+			unsigned x0 = x*2, x1 = x*2+1 < sw ? x*2+1 : sw-1;
+			for (c=0; c<4; c++)
+			{
+				dst[(y*dw+x)*4+c] = (src[(y0*sw+x0)*4+c] +
+						     src[(y0*sw+x1)*4+c] +
+						     src[(y1*sw+x0)*4+c] +
+						     src[(y1*sw+x1)*4+c] + 2) / 4;
+			}
+		}
+	}
+}
+
+unsigned char* tc_blob_create(SDL_Surface* sur, unsigned flags, size_t* size)
+{
+	SDL_Surface* rgba = SDL_ConvertSurfaceFormat(sur, SDL_PIXELFORMAT_RGBA32, 0);
+	if (!rgba) return NULL;
+	unsigned w = rgba->w, h = rgba->h;
+	unsigned levels = flags & TC_MIPMAPS ? chain_levels(w, h) : 1;
+	*size = blob_size(w, h, levels);
+	unsigned char* data = smalloc_tag(*size, CT_MEMORY_IMAGE);
+	memset(data, 0, *size);
+	TC_Header* header = (TC_Header*)data;
+	memcpy(header->magic, TC_MAGIC, 4);
+	header->version = TC_VERSION;
+	header->w       = w;
+	header->h       = h;
+	header->levels  = levels;
+	header->flags   = flags;
+	/* Tightly pack the first level */
+	unsigned char* level = data + align_up(sizeof(TC_Header));
+	unsigned y;
+	SDL_LockSurface(rgba);
+	for (y=0; y<h; y++)
+	{
+		memcpy(level + y*w*4, (unsigned char*)rgba->pixels + y*rgba->pitch, w*4);
+	}
+	SDL_UnlockSurface(rgba);
+	SDL_FreeSurface(rgba);
+	if (flags & TC_PREMULTIPLIED) premultiply(level, (size_t)w*h);
+	/* Mip chain, filtered after premultiplying so colours don't bleed. */
+	unsigned i;
+	size_t offset = align_up(sizeof(TC_Header));
+	for (i=1; i<levels; i++)
+	{
+		unsigned sw = level_size(w, i-1), sh = level_size(h, i-1);
+		unsigned dw = level_size(w, i),   dh = level_size(h, i);
+		unsigned char* next = data + align_up(offset + level_bytes(w, h, i-1));
+		downsample(data + offset, sw, sh, next, dw, dh);
+		offset = next - data;
+	}
+	return data;
+}
+
+int tc_blob_write(const char* filename, const unsigned char* data, size_t size)
+{
+	return write_file(filename, data, size);
+}
+
+unsigned long long tc_source_hash(const char* filename, unsigned flags)
+{
+	size_t size;
+	const void* data = map_file(filename, &size);
+	if (!data) return 0;
+	unsigned long long hash = fnv1a(data, size, FNV1A_SEED);
+	unmap_file(data, size);
+	unsigned key[2] = { TC_VERSION, flags };
+	return fnv1a(key, sizeof(key), hash);
+}
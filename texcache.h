@@ -0,0 +1,69 @@
+/**
+Copyright (c) 2014 Richard van Roy (pluizer)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+**/
+
+#ifndef __texcache_h_
+#define __texcache_h_
+
+#include <stddef.h>
+
+typedef struct SDL_Surface SDL_Surface;
+
+#define TC_PREMULTIPLIED 1
+#define TC_MIPMAPS 2
+
+/* A pre-decoded RGBA8 texture, either memory mapped from a cache
+   file or pointing into memory owned by someone else (a pack). */
+typedef struct _TC_Blob
+{
+	const unsigned char* data;
+	size_t size;
+	int is_mapped;
+	unsigned w, h;
+	unsigned levels;
+	unsigned flags;
+} TC_Blob;
+
+extern int tc_is_blob(const void* data, size_t size);
+
+extern int tc_blob_open(const char* filename, TC_Blob* blob);
+
+extern int tc_blob_from_memory(const void* data, size_t size, TC_Blob* blob);
+
+extern void tc_blob_close(TC_Blob* blob);
+
+extern const unsigned char* tc_blob_level(TC_Blob* blob, unsigned level,
+					  unsigned* w, unsigned* h);
+
+/* Converts `sur` to RGBA8 and applies `flags`, the result is
+   allocated with smalloc, release it with sfree. Returns NULL on
+   failure. */
+extern unsigned char* tc_blob_create(SDL_Surface* sur, unsigned flags, size_t* size);
+
+extern int tc_blob_write(const char* filename, const unsigned char* data, size_t size);
+
+/* Hash of the file's contents and `flags`, returns 0 on failure. */
+extern unsigned long long tc_source_hash(const char* filename, unsigned flags);
+
+#endif /* __texcache_h_ */